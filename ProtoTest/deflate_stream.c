@@ -0,0 +1,466 @@
+#include "deflate_stream.h"
+#include "mongoose.h"
+#include <string.h>
+
+#define MIN_MATCH   3
+#define MAX_MATCH   258
+#define MAX_CHAIN   64      // Hash chain entries tried for a match
+#define TOO_FAR     4096    // Matches of MIN_MATCH further away cost more than their literals
+#define LOOKAHEAD   (MAX_MATCH + MIN_MATCH + 1)  // Input kept ahead of `pos` until the stream is finished
+#define WINDOW_MASK (DEFLATE_WINDOW_SIZE - 1)
+#define END_BLOCK   256
+
+#define LITLEN_CODES 286
+#define DIST_CODES   30
+#define CLEN_CODES   19
+#define STORED_MAX   65535   // Bytes of a stored block at most
+
+static const short length_base[29] = {
+    3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+    35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258 };
+static const short length_extra[29] = {
+    0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+    3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0 };
+static const int dist_base[30] = {
+    1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193,
+    257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577 };
+static const short dist_extra[30] = {
+    0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6,
+    7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13 };
+static const short clen_order[19] = { 16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15 };
+static const short clen_extra[19] = { 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 2, 3, 7 };
+
+/** Pass the buffered output to the callback */
+static void flush_out(deflate_stream_t* s) {
+    if (s->out_len == 0) return;
+    if (!s->failed && !s->out_fn((const char*)s->out, s->out_len, s->out_arg)) s->failed = true;
+    s->total_out += s->out_len;
+    s->out_len = 0;
+}
+
+static void put_byte(deflate_stream_t* s, unsigned char c) {
+    s->out[s->out_len++] = c;
+    if (s->out_len == DEFLATE_OUT_SIZE) flush_out(s);
+}
+
+/** Append the `n` low bits of `value`, LSB first */
+static void put_bits(deflate_stream_t* s, uint32_t value, int n) {
+    s->bit_buf |= (uint64_t)value << s->bit_count;
+    s->bit_count += n;
+    while (s->bit_count >= 8) {
+        put_byte(s, (unsigned char)s->bit_buf);
+        s->bit_buf >>= 8;
+        s->bit_count -= 8;
+    }
+}
+
+/** Pad the output with zero bits up to the next byte boundary */
+static void align_to_byte(deflate_stream_t* s) {
+    if (s->bit_count > 0) put_bits(s, 0, 8 - s->bit_count);
+}
+
+/** Index of the last entry of `base` not above `value` */
+static int find_code(const int* base, int n, int value) {
+    int lo = 0, hi = n - 1;
+    while (lo < hi) {
+        int mid = (lo + hi + 1) / 2;
+        if (base[mid] <= value) lo = mid;
+        else hi = mid - 1;
+    }
+    return lo;
+}
+
+static int length_code(int len) {
+    int i = 28;
+    while (length_base[i] > len) i--;
+    return i;
+}
+
+/** Huffman code lengths of at most `limit` bits for `n` symbols, a symbol without frequency gets none */
+static void build_lengths(const uint32_t* freq, int n, int limit, unsigned char* lens) {
+    uint32_t f[LITLEN_CODES];
+    uint32_t weight[2 * LITLEN_CODES];
+    short leaf[LITLEN_CODES];
+    short parent[2 * LITLEN_CODES];
+    unsigned char depth[2 * LITLEN_CODES];
+    memcpy(f, freq, n * sizeof(f[0]));
+
+    for (;;) {
+        int count = 0;
+        for (int i = 0; i < n; i++) {
+            lens[i] = 0;
+            if (f[i] == 0) continue;
+            // Insertion sort by frequency, n is small
+            int j = count++;
+            while (j > 0 && f[leaf[j - 1]] > f[i]) {
+                leaf[j] = leaf[j - 1];
+                j--;
+            }
+            leaf[j] = (short)i;
+        }
+        if (count == 0) return;
+        if (count == 1) {
+            lens[leaf[0]] = 1;
+            return;
+        }
+
+        // Leaves are nodes [0, count) in frequency order, merged nodes follow in the order they are made,
+        // so the two smallest are always at the front of one of the two ranges
+        for (int i = 0; i < count; i++) weight[i] = f[leaf[i]];
+        int next_leaf = 0, next_node = count, root = 2 * count - 2;
+        for (int node = count; node <= root; node++) {
+            for (int k = 0; k < 2; k++) {
+                int pick;
+                if (next_leaf < count && (next_node >= node || weight[next_leaf] <= weight[next_node])) pick = next_leaf++;
+                else pick = next_node++;
+                parent[pick] = (short)node;
+                weight[node] = k == 0 ? weight[pick] : weight[node] + weight[pick];
+            }
+        }
+        depth[root] = 0;
+        int max_depth = 0;
+        for (int i = root - 1; i >= 0; i--) {
+            depth[i] = depth[parent[i]] + 1;
+            if (i < count && depth[i] > max_depth) max_depth = depth[i];
+        }
+        for (int i = 0; i < count; i++) lens[leaf[i]] = depth[i];
+        if (max_depth <= limit) return;
+
+        // Too deep, flatten the frequencies and build again
+        for (int i = 0; i < n; i++) {
+            if (f[i] != 0) f[i] = (f[i] >> 1) | 1;
+        }
+    }
+}
+
+/** Canonical codes of `lens`, bit reversed so they can be sent LSB first */
+static void build_codes(const unsigned char* lens, int n, uint16_t* codes) {
+    int count[16] = { 0 };
+    int next[16];
+    for (int i = 0; i < n; i++) count[lens[i]]++;
+    count[0] = 0;
+    int code = 0;
+    for (int bits = 1; bits < 16; bits++) {
+        code = (code + count[bits - 1]) << 1;
+        next[bits] = code;
+    }
+    for (int i = 0; i < n; i++) {
+        if (lens[i] == 0) continue;
+        int c = next[lens[i]]++, r = 0;
+        for (int b = 0; b < lens[i]; b++) {
+            r = (r << 1) | (c & 1);
+            c >>= 1;
+        }
+        codes[i] = (uint16_t)r;
+    }
+}
+
+/** Lengths of the fixed codes of a type 1 block */
+static void fixed_lengths(unsigned char* lit_lens, unsigned char* dist_lens) {
+    int i = 0;
+    for (; i < 144; i++) lit_lens[i] = 8;
+    for (; i < 256; i++) lit_lens[i] = 9;
+    for (; i < 280; i++) lit_lens[i] = 7;
+    for (; i < 288; i++) lit_lens[i] = 8;
+    for (i = 0; i < DIST_CODES; i++) dist_lens[i] = 5;
+}
+
+/** Run length encode code lengths with symbols 16 to 18, returns the number of symbols */
+static int encode_lengths(const unsigned char* lens, int n, unsigned char* syms, unsigned char* extra) {
+    int count = 0;
+    for (int i = 0; i < n;) {
+        int run = 1;
+        while (i + run < n && lens[i + run] == lens[i]) run++;
+        if (lens[i] == 0 && run >= 3) {
+            int r = run > 138 ? 138 : run;
+            syms[count] = r >= 11 ? 18 : 17;
+            extra[count++] = (unsigned char)(r >= 11 ? r - 11 : r - 3);
+            i += r;
+        }
+        else if (lens[i] != 0 && run >= 4) {
+            // The length itself, then repeats of the previous one
+            syms[count] = lens[i];
+            extra[count++] = 0;
+            int r = run - 1 > 6 ? 6 : run - 1;
+            syms[count] = 16;
+            extra[count++] = (unsigned char)(r - 3);
+            i += 1 + r;
+        }
+        else {
+            syms[count] = lens[i];
+            extra[count++] = 0;
+            i++;
+        }
+    }
+    return count;
+}
+
+/** Write the buffered symbols with the codes of `lit` and `dist` */
+static void write_symbols(deflate_stream_t* s, const uint16_t* lit_codes, const unsigned char* lit_lens,
+    const uint16_t* dist_codes, const unsigned char* dist_lens) {
+    for (uint32_t i = 0; i < s->sym_count; i++) {
+        int dist = s->sym_dist[i];
+        if (dist == 0) {
+            int c = s->sym_lit[i];
+            put_bits(s, lit_codes[c], lit_lens[c]);
+            continue;
+        }
+        int len = s->sym_lit[i];
+        int lc = length_code(len);
+        put_bits(s, lit_codes[257 + lc], lit_lens[257 + lc]);
+        if (length_extra[lc]) put_bits(s, len - length_base[lc], length_extra[lc]);
+        int dc = find_code(dist_base, DIST_CODES, dist);
+        put_bits(s, dist_codes[dc], dist_lens[dc]);
+        if (dist_extra[dc]) put_bits(s, dist - dist_base[dc], dist_extra[dc]);
+    }
+    put_bits(s, lit_codes[END_BLOCK], lit_lens[END_BLOCK]);
+}
+
+/** Write the buffered symbols as one block, in whichever of the three block types is smallest */
+static void flush_block(deflate_stream_t* s, bool last) {
+    uint32_t lit_freq[LITLEN_CODES] = { 0 }, dist_freq[DIST_CODES] = { 0 }, clen_freq[CLEN_CODES] = { 0 };
+    unsigned char lit_lens[288], dist_lens[DIST_CODES], clen_lens[CLEN_CODES];
+    uint16_t lit_codes[288], dist_codes[DIST_CODES], clen_codes[CLEN_CODES];
+    unsigned char lens[LITLEN_CODES + DIST_CODES], rle[LITLEN_CODES + DIST_CODES], rle_extra[LITLEN_CODES + DIST_CODES];
+
+    uint64_t extra_bits = 0;
+    for (uint32_t i = 0; i < s->sym_count; i++) {
+        if (s->sym_dist[i] == 0) {
+            lit_freq[s->sym_lit[i]]++;
+            continue;
+        }
+        int lc = length_code(s->sym_lit[i]);
+        int dc = find_code(dist_base, DIST_CODES, s->sym_dist[i]);
+        lit_freq[257 + lc]++;
+        dist_freq[dc]++;
+        extra_bits += length_extra[lc] + dist_extra[dc];
+    }
+    lit_freq[END_BLOCK] = 1;
+    // Some decoders reject a distance code with fewer than two symbols
+    if (dist_freq[0] == 0) dist_freq[0] = 1;
+    if (dist_freq[1] == 0) dist_freq[1] = 1;
+
+    // Dynamic block
+    build_lengths(lit_freq, LITLEN_CODES, 15, lit_lens);
+    build_lengths(dist_freq, DIST_CODES, 15, dist_lens);
+    int hlit = LITLEN_CODES, hdist = DIST_CODES;
+    while (hlit > 257 && lit_lens[hlit - 1] == 0) hlit--;
+    while (hdist > 1 && dist_lens[hdist - 1] == 0) hdist--;
+    memcpy(lens, lit_lens, hlit);
+    memcpy(lens + hlit, dist_lens, hdist);
+    int rle_count = encode_lengths(lens, hlit + hdist, rle, rle_extra);
+    for (int i = 0; i < rle_count; i++) clen_freq[rle[i]]++;
+    build_lengths(clen_freq, CLEN_CODES, 7, clen_lens);
+    int hclen = CLEN_CODES;
+    while (hclen > 4 && clen_lens[clen_order[hclen - 1]] == 0) hclen--;
+
+    uint64_t dynamic_bits = 3 + 5 + 5 + 4 + 3 * hclen + extra_bits;
+    for (int i = 0; i < rle_count; i++) dynamic_bits += clen_lens[rle[i]] + clen_extra[rle[i]];
+    for (int i = 0; i < LITLEN_CODES; i++) dynamic_bits += (uint64_t)lit_freq[i] * lit_lens[i];
+    for (int i = 0; i < DIST_CODES; i++) dynamic_bits += (uint64_t)dist_freq[i] * dist_lens[i];
+
+    // Fixed block, the distance frequencies padded above cost nothing there
+    unsigned char fixed_lit[288], fixed_dist[DIST_CODES];
+    fixed_lengths(fixed_lit, fixed_dist);
+    uint64_t fixed_bits = 3 + extra_bits;
+    for (int i = 0; i < LITLEN_CODES; i++) fixed_bits += (uint64_t)lit_freq[i] * fixed_lit[i];
+    for (uint32_t i = 0; i < s->sym_count; i++) {
+        if (s->sym_dist[i] != 0) fixed_bits += 5;
+    }
+
+    // Stored blocks, the raw bytes of the block are still in the window
+    uint32_t raw_len = s->pos - s->block_start;
+    uint32_t stored_blocks = raw_len == 0 ? 1 : (raw_len + STORED_MAX - 1) / STORED_MAX;
+    uint64_t stored_bits = ((uint64_t)raw_len + 5 * stored_blocks) * 8 + 7;
+
+    if (stored_bits < dynamic_bits && stored_bits < fixed_bits) {
+        const unsigned char* raw = s->window + s->block_start;
+        for (uint32_t b = 0; b < stored_blocks; b++) {
+            uint32_t n = raw_len > STORED_MAX ? STORED_MAX : raw_len;
+            put_bits(s, last && b + 1 == stored_blocks ? 1 : 0, 1);
+            put_bits(s, 0, 2);
+            align_to_byte(s);
+            put_bits(s, n, 16);
+            put_bits(s, ~n & 0xffff, 16);
+            for (uint32_t i = 0; i < n; i++) put_byte(s, raw[i]);
+            raw += n;
+            raw_len -= n;
+        }
+    }
+    else if (fixed_bits <= dynamic_bits) {
+        build_codes(fixed_lit, 288, lit_codes);
+        build_codes(fixed_dist, DIST_CODES, dist_codes);
+        put_bits(s, last ? 1 : 0, 1);
+        put_bits(s, 1, 2);
+        write_symbols(s, lit_codes, fixed_lit, dist_codes, fixed_dist);
+    }
+    else {
+        build_codes(lit_lens, hlit, lit_codes);
+        build_codes(dist_lens, hdist, dist_codes);
+        build_codes(clen_lens, CLEN_CODES, clen_codes);
+        put_bits(s, last ? 1 : 0, 1);
+        put_bits(s, 2, 2);
+        put_bits(s, hlit - 257, 5);
+        put_bits(s, hdist - 1, 5);
+        put_bits(s, hclen - 4, 4);
+        for (int i = 0; i < hclen; i++) put_bits(s, clen_lens[clen_order[i]], 3);
+        for (int i = 0; i < rle_count; i++) {
+            put_bits(s, clen_codes[rle[i]], clen_lens[rle[i]]);
+            if (clen_extra[rle[i]]) put_bits(s, rle_extra[i], clen_extra[rle[i]]);
+        }
+        write_symbols(s, lit_codes, lit_lens, dist_codes, dist_lens);
+    }
+
+    s->sym_count = 0;
+    s->block_start = s->pos;
+}
+
+static uint32_t hash3(const unsigned char* p) {
+    uint32_t v = (uint32_t)p[0] << 16 | (uint32_t)p[1] << 8 | p[2];
+    return (v * 2654435761u) >> 18 & (DEFLATE_HASH_SIZE - 1);
+}
+
+static void insert_hash(deflate_stream_t* s, uint32_t pos) {
+    uint32_t h = hash3(s->window + pos);
+    s->prev[pos & WINDOW_MASK] = s->head[h];
+    s->head[h] = (uint16_t)pos;
+}
+
+/** Encode window bytes up to the lookahead, or all of them with `flush` */
+static void compress_window(deflate_stream_t* s, bool flush) {
+    uint32_t limit = flush ? s->window_len : (s->window_len > LOOKAHEAD ? s->window_len - LOOKAHEAD : 0);
+    while (s->pos < limit && !s->failed) {
+        uint32_t avail = s->window_len - s->pos;
+        uint32_t best_len = 0, best_dist = 0;
+        if (avail >= MIN_MATCH) {
+            const unsigned char* b = s->window + s->pos;
+            uint32_t max_len = avail < MAX_MATCH ? avail : MAX_MATCH;
+            uint32_t cur = s->head[hash3(b)];
+            int chain = MAX_CHAIN;
+            // Position 0 doubles as the end of a chain, its matches are lost
+            while (cur > 0 && cur < s->pos && s->pos - cur <= DEFLATE_WINDOW_SIZE && chain-- > 0) {
+                const unsigned char* a = s->window + cur;
+                if (a[best_len] == b[best_len] && a[0] == b[0]) {
+                    uint32_t len = 1;
+                    while (len < max_len && a[len] == b[len]) len++;
+                    if (len > best_len) {
+                        best_len = len;
+                        best_dist = s->pos - cur;
+                        if (len == max_len) break;
+                    }
+                }
+                uint32_t next = s->prev[cur & WINDOW_MASK];
+                if (next >= cur) break; // Overwritten by a newer position, the rest of the chain is gone
+                cur = next;
+            }
+            insert_hash(s, s->pos);
+        }
+
+        if (best_len > MIN_MATCH || (best_len == MIN_MATCH && best_dist <= TOO_FAR)) {
+            s->sym_lit[s->sym_count] = (uint16_t)best_len;
+            s->sym_dist[s->sym_count++] = (uint16_t)best_dist;
+            for (uint32_t i = 1; i < best_len; i++) {
+                if (s->window_len - (s->pos + i) >= MIN_MATCH) insert_hash(s, s->pos + i);
+            }
+            s->pos += best_len;
+        }
+        else {
+            s->sym_lit[s->sym_count] = s->window[s->pos];
+            s->sym_dist[s->sym_count++] = 0;
+            s->pos++;
+        }
+        if (s->sym_count == DEFLATE_BLOCK_SYMBOLS) flush_block(s, false);
+    }
+}
+
+/** Drop the older half of the full window, ending the current block first so it can still be stored */
+static void slide_window(deflate_stream_t* s) {
+    flush_block(s, false);
+    memmove(s->window, s->window + DEFLATE_WINDOW_SIZE, DEFLATE_WINDOW_SIZE);
+    s->window_len -= DEFLATE_WINDOW_SIZE;
+    s->pos -= DEFLATE_WINDOW_SIZE;
+    s->block_start = s->pos;
+    for (int i = 0; i < DEFLATE_HASH_SIZE; i++) {
+        s->head[i] = s->head[i] >= DEFLATE_WINDOW_SIZE ? (uint16_t)(s->head[i] - DEFLATE_WINDOW_SIZE) : 0;
+    }
+    for (int i = 0; i < DEFLATE_WINDOW_SIZE; i++) {
+        s->prev[i] = s->prev[i] >= DEFLATE_WINDOW_SIZE ? (uint16_t)(s->prev[i] - DEFLATE_WINDOW_SIZE) : 0;
+    }
+}
+
+/** Update the trailer check with input bytes */
+static void update_check(deflate_stream_t* s, const unsigned char* data, size_t n) {
+    if (s->format == DEFLATE_FORMAT_GZIP) {
+        s->check = mg_crc32(s->check, (const char*)data, n);
+    }
+    else if (s->format == DEFLATE_FORMAT_ZLIB) {
+        uint32_t a = s->check & 0xffff, b = s->check >> 16;
+        for (size_t i = 0; i < n; i++) {
+            a = (a + data[i]) % 65521;
+            b = (b + a) % 65521;
+        }
+        s->check = (b << 16) | a;
+    }
+}
+
+void deflate_stream_init(deflate_stream_t* s, int format) {
+    s->format = format;
+    s->started = s->finished = s->failed = false;
+    s->check = format == DEFLATE_FORMAT_ZLIB ? 1 : 0;
+    s->total_in = s->total_out = 0;
+    s->bit_buf = 0;
+    s->bit_count = 0;
+    s->window_len = s->pos = s->block_start = 0;
+    s->sym_count = 0;
+    s->out_len = 0;
+    memset(s->head, 0, sizeof(s->head));
+    memset(s->prev, 0, sizeof(s->prev));
+}
+
+int deflate_stream_feed(deflate_stream_t* s, const char* in, size_t len, bool finish, deflate_output_fn out, void* arg) {
+    const unsigned char* p = (const unsigned char*)in;
+    if (s->finished || s->failed) return DEFLATE_ERROR;
+    s->out_fn = out;
+    s->out_arg = arg;
+
+    if (!s->started) {
+        static const unsigned char gzip_header[10] = { 0x1f, 0x8b, 8, 0, 0, 0, 0, 0, 0, 0xff };
+        if (s->format == DEFLATE_FORMAT_GZIP) {
+            for (size_t i = 0; i < sizeof(gzip_header); i++) put_byte(s, gzip_header[i]);
+        }
+        else if (s->format == DEFLATE_FORMAT_ZLIB) {
+            put_byte(s, 0x78); // 32K window, deflate
+            put_byte(s, 0x9c); // Default level, no dictionary
+        }
+        s->started = true;
+    }
+    update_check(s, p, len);
+    s->total_in += len;
+
+    while (len > 0 && !s->failed) {
+        if (s->window_len == sizeof(s->window)) slide_window(s);
+        size_t n = sizeof(s->window) - s->window_len;
+        if (n > len) n = len;
+        memcpy(s->window + s->window_len, p, n);
+        s->window_len += (uint32_t)n;
+        p += n;
+        len -= n;
+        compress_window(s, false);
+    }
+
+    if (finish && !s->failed) {
+        compress_window(s, true);
+        flush_block(s, true);
+        align_to_byte(s);
+        if (s->format == DEFLATE_FORMAT_GZIP) {
+            put_bits(s, s->check, 32);
+            put_bits(s, (uint32_t)s->total_in, 32);
+        }
+        else if (s->format == DEFLATE_FORMAT_ZLIB) {
+            for (int i = 3; i >= 0; i--) put_byte(s, (unsigned char)(s->check >> (i * 8)));
+        }
+        s->finished = true;
+    }
+    flush_out(s);
+    return s->failed ? DEFLATE_ERROR : DEFLATE_OK;
+}
@@ -0,0 +1,71 @@
+#ifndef PROTO_DEFLATE_STREAM_H
+#define PROTO_DEFLATE_STREAM_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Container around the deflate data, same values as INFLATE_FORMAT_*
+#define DEFLATE_FORMAT_RAW  0  // Bare deflate blocks (RFC 1951)
+#define DEFLATE_FORMAT_ZLIB 1  // zlib header and Adler-32 trailer (RFC 1950), HTTP "deflate"
+#define DEFLATE_FORMAT_GZIP 2  // gzip member with CRC-32 trailer (RFC 1952)
+
+// Results of deflate_stream_feed
+#define DEFLATE_OK     0
+#define DEFLATE_ERROR -1  // The output callback failed, or input after the end of the stream
+
+#define DEFLATE_WINDOW_SIZE   32768
+#define DEFLATE_HASH_SIZE     16384  // Hash chain heads, a power of 2
+#define DEFLATE_BLOCK_SYMBOLS 8192   // Literals and matches buffered before a block is written
+#define DEFLATE_OUT_SIZE      4096   // Output passed to the callback at once at most
+
+/** Receives compressed bytes in order, returns false to abort */
+typedef bool (*deflate_output_fn)(const char* data, size_t len, void* arg);
+
+/**
+ * Incremental deflate state, input may be fed in pieces of any size.
+ * About 200KB, so allocate it rather than putting it on the stack.
+ */
+typedef struct deflate_stream {
+    int format;
+    bool started;               // Container header written
+    bool finished;              // Last block and trailer written
+    bool failed;                // The output callback returned false
+    uint32_t check;             // CRC-32 or Adler-32 of the input
+    uint64_t total_in;
+    uint64_t total_out;
+    uint64_t bit_buf;           // Output bits not written yet, LSB first
+    int bit_count;
+    deflate_output_fn out_fn;   // Callback of the running deflate_stream_feed
+    void* out_arg;
+    unsigned char window[2 * DEFLATE_WINDOW_SIZE]; // History and lookahead, slid by half when full
+    uint32_t window_len;        // Bytes of `window` holding input
+    uint32_t pos;               // Next window byte to encode
+    uint32_t block_start;       // First window byte of the current block
+    uint16_t head[DEFLATE_HASH_SIZE];    // Latest window position of each hash, 0 if none
+    uint16_t prev[DEFLATE_WINDOW_SIZE];  // Earlier position with the same hash
+    uint16_t sym_lit[DEFLATE_BLOCK_SYMBOLS];  // Literal byte, or match length
+    uint16_t sym_dist[DEFLATE_BLOCK_SYMBOLS]; // Match distance, 0 for a literal
+    uint32_t sym_count;
+    unsigned char out[DEFLATE_OUT_SIZE];
+    size_t out_len;
+} deflate_stream_t;
+
+/** Reset `s` for a new stream of `format` */
+extern void deflate_stream_init(deflate_stream_t* s, int format);
+
+/**
+ * Compress `len` bytes of `in`, passing the output to `out` as it is produced.
+ * With `finish` the stream is ended after `in`, no more input is accepted then.
+ * Returns DEFLATE_OK or DEFLATE_ERROR.
+ */
+extern int deflate_stream_feed(deflate_stream_t* s, const char* in, size_t len, bool finish, deflate_output_fn out, void* arg);
+
+#ifdef __cplusplus
+}
+#endif
+#endif // PROTO_DEFLATE_STREAM_H
@@ -1,32 +1,230 @@
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE // fallocate()
+#endif
+
 #include "http_download.h"
+#include "inflate_stream.h"
+
+#if MG_ARCH == MG_ARCH_WIN32
+#include <io.h>
+#elif MG_ARCH == MG_ARCH_UNIX
+#include <sys/mman.h>
+#endif
 
-// Configuration defaults
+// Configuration defaults, shared by every download of a batch
 static int64_t max_size_per_piece = 1 * 1024 * 1024; // 1MB per chunk
 static uint64_t s_timeout_ms = 10000;                // 10s connection timeout
 static uint64_t s_transfer_timeout_ms = 30000;       // 30s transfer timeout
-static const char* url = NULL;
-static const char* download_path = NULL;
-
-// Download state
-static FILE* file = NULL;
-static char* buffer = NULL;
-static int64_t buffer_len = 0;
-static int64_t offset = 0;
-static int64_t all_size = 0;
-static int retry_count = 0;
-static const int max_retries = 3;
+static int max_parallel_jobs = 1;                    // Range requests kept in flight at once per download
+static bool keep_alive = false;                      // Reuse each connection for successive ranges
+static bool stream_to_disk = false;                  // Write body bytes as they arrive instead of buffering the chunk
+static bool resume_enabled = false;                  // Keep a journal and continue an interrupted download
+static bool adaptive_chunks = false;                 // Resize chunks from measured throughput and RTT
+static bool use_mmap = false;                        // Copy received bytes into a shared mapping of the file
+static int64_t sync_interval = 0;                    // Sync data after this many written bytes, 0: at the end only
+static bool accept_encoding = false;                 // Ask for gzip/deflate and inflate encoded responses
+static int64_t min_size_per_piece = 64 * 1024;       // Adaptive lower bound, set by -smin
+static int64_t max_adaptive_size = 8 * 1024 * 1024;  // Adaptive upper bound, set by -smax
+static const uint64_t adaptive_fast_ms = 2000;       // Ranges transferred faster than this grow the chunk
+static const uint64_t adaptive_slow_ms = 10000;      // Ranges transferred slower than this shrink it
+static int max_connections = 0;                      // Connections open at once over all downloads, 0: no limit
+static int max_host_connections = 0;                 // Connections open at once to one host, 0: no limit
+
+// Bandwidth limit, a token bucket shared by every connection of the process.
+// `rate_limit` may be changed from other threads, it is only accessed through atomic operations
+static long rate_limit = 0;            // Bytes per second, 0: no limit
+static int64_t rate_tokens = 0;        // Bytes that may still be read, negative while reads are paused
+static uint64_t rate_refill_ms = 0;    // mg_millis() of the last refill
+static const uint64_t rate_burst_ms = 250; // Idle time that may be caught up in one burst
+
+// Retry policy
+static int max_retries = 3;                     // Retries per range, set by -retries
+static uint64_t retry_base_ms = 1000;           // First backoff delay, doubled on every retry, set by -backoff
+static const uint64_t retry_max_ms = 60000;     // Backoff delay cap
+static const uint64_t retry_after_max_ms = 3600000; // Longest Retry-After that is honoured
+
+// Metrics reporting
+static http_download_metrics_fn metrics_fn = NULL;  // Receives the metrics of every download, NULL: not collected for anyone
+static void* metrics_arg = NULL;
+static uint64_t metrics_interval_ms = 1000;         // Time between two reports of a running download
+static uint64_t metrics_report_ms = 0;              // mg_millis() of the last periodic report
+#define METRICS_WINDOW 60                           // Seconds of throughput history, the longest sliding window
 
 // Status codes
 #define STETE_RUNNING 0
 #define STATE_SUCCESS 1
 #define STATE_ERROR   2
 
+// Segment states
+#define SEGMENT_IDLE    0  // No range assigned
+#define SEGMENT_PENDING 1  // Range assigned, request not sent yet
+#define SEGMENT_RUNNING 2  // Request in flight
+#define SEGMENT_DONE    3  // Range written to file
+#define SEGMENT_ERROR   4  // Request failed, range must be fetched again
+#define SEGMENT_BACKOFF 5  // Waiting for the retry timer
+
+// Position in a chunked response body
+#define CHUNK_SIZE     0  // Expecting a chunk size line
+#define CHUNK_DATA     1  // Inside the data of a chunk
+#define CHUNK_DATA_END 2  // Expecting the CRLF after the data of a chunk
+#define CHUNK_TRAILER  3  // Last chunk seen, expecting trailer fields or the final CRLF
+#define CHUNK_DONE     4  // Body complete
+
+// Error classes, decide whether and how soon a failed range is retried
+#define ERROR_CLASS_NETWORK 0  // Connection reset, timeout, bad response: backoff
+#define ERROR_CLASS_DNS     1  // Name resolution failed: longer backoff
+#define ERROR_CLASS_SERVER  2  // 5xx, 408 or 429: backoff, honouring Retry-After
+#define ERROR_CLASS_FATAL   3  // Other 4xx, local write failure: no retry
+
+struct download_ctx;
+
+/** One ranged request slot, up to `jobs` of them run at once for a download */
+typedef struct {
+    struct download_ctx* ctx;     // Download the slot belongs to
+    int id;                       // Slot index, for log output
+    int64_t start;                // First byte of the range
+    int64_t end;                  // Last byte of the range (inclusive)
+    int state;                    // SEGMENT_* value
+    int retry_count;              // Failed attempts for the current range
+    int error_class;              // ERROR_CLASS_* of the last failure
+    uint64_t retry_after_ms;      // Delay requested by the server's Retry-After, 0 if none
+    struct mg_connection* conn;   // Connection serving this range, NULL if none
+    bool reused;                  // Current request was sent on a kept-alive connection
+    int64_t request_end;          // Last byte asked for by the current request
+    uint64_t sent_ms;             // mg_millis() when the current request was sent
+    uint64_t first_byte_ms;       // mg_millis() when its first response byte arrived, 0 if none yet
+    bool in_body;                 // Streaming only: headers parsed, body bytes expected
+    bool server_closes;           // Streaming only: response carried "Connection: close"
+    int64_t body_start;           // Streaming only: file position of the first body byte
+    int64_t write_pos;            // Streaming only: file position of the next body byte
+    int64_t body_left;            // Streaming only: body bytes still expected, -1 if only the last chunk tells
+    bool chunked;                 // Streaming only: body uses the chunked transfer coding
+    int chunk_state;              // Streaming only: CHUNK_* position in a chunked body
+    int64_t chunk_left;           // Streaming only: data bytes left in the current chunk
+} download_segment_t;
+
+/** Inclusive byte range */
+typedef struct {
+    int64_t start;
+    int64_t end;
+} byte_range_t;
+
+/** Sorted list of merged byte ranges */
+typedef struct {
+    byte_range_t* items;
+    int count;
+    int cap;
+} range_list_t;
+
+struct download_batch;
+
+/** State of one URL to file download, any number of them can share a mg_mgr */
+typedef struct download_ctx {
+    struct download_batch* batch; // Batch whose connection limits apply
+    char* url;
+    char* download_path;
+    int state;                    // STETE_RUNNING until the download succeeded or failed
+    int jobs;                     // Number of segment slots
+    int64_t chunk_size;           // Bytes per range, changes with -adaptive
+    download_segment_t* segments;
+
+    FILE* file;
+    int64_t offset;               // Next byte not yet assigned to any segment
+    int64_t downloaded;           // Bytes written to file so far
+    int64_t all_size;
+    bool size_probe_sent;         // A request went out before the total size was known
+
+    // Resume journal, a text file next to the download:
+    //   size <total>, etag <value>, modified <value>, then one "range <start> <end>"
+    //   line per range that is known to be on disk
+    char* journal_path;
+    FILE* journal;
+    int64_t journal_size;         // Total size recorded by an earlier attempt, 0 if none
+    char etag[128];               // Strong ETag of the remote file
+    char last_modified[64];       // Last-Modified of the remote file
+    range_list_t done_ranges;     // Ranges already on disk
+    range_list_t unjournaled_ranges; // Completed since the last data sync, journaled after the next one
+
+    // Output file backend, preallocated and optionally mapped once the total size is known
+    int64_t output_size;          // Size the output was preallocated to, 0 if not yet
+    char* output_map;             // Shared mapping of the whole output, NULL if pwrite is used
+    int64_t unsynced_bytes;       // Bytes written since the last data sync
+
+    // Integrity verification, bytes are hashed in file order as they are written
+    bool verify_sha256;
+    unsigned char expected_sha256[32];
+    bool verify_crc32;
+    uint32_t expected_crc32;
+    mg_sha256_ctx sha256_ctx;
+    uint32_t crc32_value;
+    int64_t hash_offset;          // Bytes before this position are hashed
+    range_list_t unhashed_ranges; // Written past `hash_offset`, hashed once the gap closes
+
+    // Content decoding, an encoded body is fetched with a single request and
+    // inflated before it is hashed and written
+    inflate_stream_t* decoder;    // Allocated if `accept_encoding` is set
+    bool decoding;                // The current response is encoded
+    int decode_result;
+
+    // Metrics, counters are kept in `metrics` directly, rates and averages are derived on report
+    http_download_metrics_t metrics;
+    uint64_t start_ms;            // mg_millis() when the download started
+    uint64_t ttfb_sum_ms;
+    int ttfb_count;
+    uint64_t dns_sum_ms, connect_sum_ms, tls_sum_ms;
+    int dns_count, connect_count, tls_count;
+    int64_t window_bytes[METRICS_WINDOW];   // Bytes received in a second since the start, indexed by second % METRICS_WINDOW
+    uint64_t window_second[METRICS_WINDOW]; // Second the entry of `window_bytes` belongs to
+} download_ctx_t;
+
+/** Downloads that run together on one mg_mgr */
+typedef struct download_batch {
+    download_ctx_t* items;
+    int count;
+    int cap;
+    int next;                     // Download scheduled first in the next round, rotates for fairness
+} download_batch_t;
+
 // Forward declarations
 static void http_download_callback_fn(struct mg_connection* c, int ev, void* ev_data);
 static void parse_content_range_value(const char* str, int len, int64_t* start_pos, int64_t* end_pos, int64_t* all_size, bool* success);
-static void write_to_file();
+static bool write_to_file(download_ctx_t* ctx, int64_t pos, const char* data, size_t len);
+static bool read_from_file(download_ctx_t* ctx, int64_t pos, char* data, size_t len);
+static bool store_body_bytes(download_ctx_t* ctx, int64_t pos, const char* data, size_t len);
+static void reset_hashes(download_ctx_t* ctx);
+static bool verify_download(download_ctx_t* ctx);
+static bool parse_hex(const char* str, unsigned char* out, size_t len);
+static bool parse_crc32(const char* str, uint32_t* out);
+static bool add_range(range_list_t* list, int64_t start, int64_t end);
+static download_ctx_t* add_download(download_batch_t* batch, const char* url, const char* path);
+static bool load_manifest(download_batch_t* batch, const char* path);
+static bool start_download(download_ctx_t* ctx);
+static int schedule_batch(download_batch_t* batch, struct mg_mgr* mgr);
+static bool connection_available(download_ctx_t* ctx);
+static int schedule_segments(download_ctx_t* ctx, struct mg_mgr* mgr);
+static int finish_download(download_ctx_t* ctx, int state);
+static void print_batch_progress(download_batch_t* batch);
+static void refill_rate_tokens();
+static long load_rate_limit();
+static uint64_t retry_delay_ms(download_segment_t* seg);
+static void retry_timer_fn(void* arg);
+static void send_range_request(struct mg_connection* c, download_segment_t* seg);
+static bool load_journal(download_ctx_t* ctx);
+static bool open_journal(download_ctx_t* ctx, bool append);
+static void record_done_range(download_ctx_t* ctx, int64_t start, int64_t end);
+static void sync_file(FILE* fp);
+static bool prepare_output(download_ctx_t* ctx, int64_t size);
+static void release_output_map(download_ctx_t* ctx);
+static bool flush_output(download_ctx_t* ctx);
+static bool select_decoder(download_segment_t* seg, struct mg_http_message* hm);
+static void discard_output(download_ctx_t* ctx);
+static void record_first_byte(download_segment_t* seg);
+static void record_received(download_ctx_t* ctx, long len);
+static void record_phase(download_ctx_t* ctx, struct mg_connection* c, int ev);
+static void report_metrics(download_ctx_t* ctx);
+static void print_metrics(const http_download_metrics_t* metrics, void* arg);
 static void print_http_download_usage();
-static void cleanup_resources();
+static void free_download(download_ctx_t* ctx);
 
 static int64_t string_to_long(const char* str, int len, bool* success) {
     int64_t value = 0;
@@ -60,22 +258,57 @@ static int64_t string_to_long(const char* str, int len, bool* success) {
 
 int http_download_main(int argc, char* argv[]) {
     int ret = 0;
+    const char* url = NULL;
+    const char* download_path = NULL;
+    const char* manifest_path = NULL;
+    bool verify_sha256 = false;
+    unsigned char expected_sha256[32];
+    bool verify_crc32 = false;
+    uint32_t expected_crc32 = 0;
 
     // Parse command line arguments
-    for (int i = 1; i < argc - 1; i++) {
+    for (int i = 1; i < argc; i++) {
         if (!strcmp("-h", argv[i]) || !strcmp("-help", argv[i]) || !strcmp("-?", argv[i])) {
             print_http_download_usage();
             return 0;
         }
-        if (!strcmp("-u", argv[i])) {
+        if (!strcmp("-k", argv[i])) {
+            keep_alive = true;
+        }
+        else if (!strcmp("-stream", argv[i])) {
+            stream_to_disk = true;
+        }
+        else if (!strcmp("-r", argv[i])) {
+            resume_enabled = true;
+        }
+        else if (!strcmp("-adaptive", argv[i])) {
+            adaptive_chunks = true;
+        }
+        else if (!strcmp("-mmap", argv[i])) {
+            use_mmap = true;
+        }
+        else if (!strcmp("-gzip", argv[i])) {
+            accept_encoding = true;
+        }
+        else if (i + 1 >= argc) {
+            // Every option below takes a value
+            printf("Missing value for option: %s\n", argv[i]);
+            print_http_download_usage();
+            return 1;
+        }
+        else if (!strcmp("-u", argv[i])) {
             url = argv[++i];
         }
         else if (!strcmp("-p", argv[i])) {
             download_path = argv[++i];
         }
+        else if (!strcmp("-m", argv[i])) {
+            manifest_path = argv[++i];
+        }
         else if (!strcmp("-t", argv[i])) {
+            const char* value = argv[++i];
             bool success = false;
-            s_timeout_ms = string_to_long(argv[++i], strlen(argv[i]), &success);
+            s_timeout_ms = string_to_long(value, strlen(value), &success);
             if (!success || s_timeout_ms <= 0) {
                 printf("Invalid timeout value: must be positive integer\n");
                 print_http_download_usage();
@@ -83,14 +316,137 @@ int http_download_main(int argc, char* argv[]) {
             }
         }
         else if (!strcmp("-s", argv[i])) {
+            const char* value = argv[++i];
             bool success = false;
-            max_size_per_piece = string_to_long(argv[++i], strlen(argv[i]), &success);
+            max_size_per_piece = string_to_long(value, strlen(value), &success);
             if (!success || max_size_per_piece <= 0) {
                 printf("Invalid size value: must be positive integer\n");
                 print_http_download_usage();
                 return 1;
             }
         }
+        else if (!strcmp("-smin", argv[i])) {
+            const char* value = argv[++i];
+            bool success = false;
+            min_size_per_piece = string_to_long(value, strlen(value), &success);
+            if (!success || min_size_per_piece <= 0) {
+                printf("Invalid minimum size value: must be positive integer\n");
+                print_http_download_usage();
+                return 1;
+            }
+        }
+        else if (!strcmp("-smax", argv[i])) {
+            const char* value = argv[++i];
+            bool success = false;
+            max_adaptive_size = string_to_long(value, strlen(value), &success);
+            if (!success || max_adaptive_size <= 0) {
+                printf("Invalid maximum size value: must be positive integer\n");
+                print_http_download_usage();
+                return 1;
+            }
+        }
+        else if (!strcmp("-sha256", argv[i])) {
+            const char* value = argv[++i];
+            if (!parse_hex(value, expected_sha256, sizeof(expected_sha256))) {
+                printf("Invalid SHA-256 value: must be 64 hex digits\n");
+                print_http_download_usage();
+                return 1;
+            }
+            verify_sha256 = true;
+        }
+        else if (!strcmp("-crc32", argv[i])) {
+            const char* value = argv[++i];
+            if (!parse_crc32(value, &expected_crc32)) {
+                printf("Invalid CRC32 value: must be 8 hex digits\n");
+                print_http_download_usage();
+                return 1;
+            }
+            verify_crc32 = true;
+        }
+        else if (!strcmp("-sync", argv[i])) {
+            const char* value = argv[++i];
+            bool success = false;
+            sync_interval = string_to_long(value, strlen(value), &success);
+            if (!success || sync_interval < 0) {
+                printf("Invalid sync value: must be non-negative integer\n");
+                print_http_download_usage();
+                return 1;
+            }
+        }
+        else if (!strcmp("-retries", argv[i])) {
+            const char* value = argv[++i];
+            bool success = false;
+            max_retries = (int)string_to_long(value, strlen(value), &success);
+            if (!success || max_retries < 0) {
+                printf("Invalid retries value: must be non-negative integer\n");
+                print_http_download_usage();
+                return 1;
+            }
+        }
+        else if (!strcmp("-backoff", argv[i])) {
+            const char* value = argv[++i];
+            bool success = false;
+            retry_base_ms = string_to_long(value, strlen(value), &success);
+            if (!success || retry_base_ms <= 0) {
+                printf("Invalid backoff value: must be positive integer\n");
+                print_http_download_usage();
+                return 1;
+            }
+        }
+        else if (!strcmp("-j", argv[i])) {
+            const char* value = argv[++i];
+            bool success = false;
+            max_parallel_jobs = (int)string_to_long(value, strlen(value), &success);
+            if (!success || max_parallel_jobs <= 0) {
+                printf("Invalid jobs value: must be positive integer\n");
+                print_http_download_usage();
+                return 1;
+            }
+        }
+        else if (!strcmp("-rate", argv[i])) {
+            const char* value = argv[++i];
+            bool success = false;
+            int64_t rate = string_to_long(value, strlen(value), &success);
+            if (!success || rate < 0 || rate > LONG_MAX) {
+                printf("Invalid rate value: must be non-negative integer\n");
+                print_http_download_usage();
+                return 1;
+            }
+            http_download_set_rate_limit((long)rate);
+        }
+        else if (!strcmp("-metrics", argv[i])) {
+            const char* value = argv[++i];
+            bool success = false;
+            int64_t interval = string_to_long(value, strlen(value), &success);
+            if (!success || interval <= 0) {
+                printf("Invalid metrics interval: must be positive integer\n");
+                print_http_download_usage();
+                return 1;
+            }
+            // A callback set through the API takes precedence
+            http_download_set_metrics_callback(metrics_fn != NULL ? metrics_fn : print_metrics,
+                metrics_fn != NULL ? metrics_arg : NULL, (uint64_t)interval);
+        }
+        else if (!strcmp("-c", argv[i])) {
+            const char* value = argv[++i];
+            bool success = false;
+            max_connections = (int)string_to_long(value, strlen(value), &success);
+            if (!success || max_connections < 0) {
+                printf("Invalid connection limit: must be non-negative integer\n");
+                print_http_download_usage();
+                return 1;
+            }
+        }
+        else if (!strcmp("-hc", argv[i])) {
+            const char* value = argv[++i];
+            bool success = false;
+            max_host_connections = (int)string_to_long(value, strlen(value), &success);
+            if (!success || max_host_connections < 0) {
+                printf("Invalid per host connection limit: must be non-negative integer\n");
+                print_http_download_usage();
+                return 1;
+            }
+        }
         else {
             printf("Unknown option: %s\n", argv[i]);
             print_http_download_usage();
@@ -98,241 +454,1764 @@ int http_download_main(int argc, char* argv[]) {
         }
     }
 
-    // Validate required parameters
-    if (url == NULL || download_path == NULL) {
-        printf("URL and download path are required\n");
+    // Validate required parameters, either a single download or a manifest
+    if (manifest_path != NULL ? (url != NULL || download_path != NULL) : (url == NULL || download_path == NULL)) {
+        printf("Either URL and download path, or a manifest are required\n");
         print_http_download_usage();
         return 1;
     }
-
-    // Allocate download buffer
-    buffer = (char*)malloc(max_size_per_piece);
-    if (buffer == NULL) {
-        printf("Failed to allocate download buffer\n");
+    if (manifest_path != NULL && (verify_sha256 || verify_crc32)) {
+        printf("Expected hashes of a batch go into the manifest\n");
         return 1;
     }
 
-    // Open output file (truncate if exists)
-    file = fopen(download_path, "wb+");
-    if (!file) {
-        printf("Failed to open file: %s\n", download_path);
-        ret = 1;
-        cleanup_resources();
+    if (accept_encoding && resume_enabled) {
+        // The encoded body is one stream that can be neither split into ranges nor resumed
+        printf("-gzip cannot be combined with -r\n");
         return 1;
     }
+    if (accept_encoding) {
+        adaptive_chunks = false;
+        stream_to_disk = true;
+    }
 
-    // Main download loop
-    int state = STETE_RUNNING;
-    struct mg_mgr mgr;
-    mg_mgr_init(&mgr);
-
-    do {
-        printf("Downloading range: %lld-%lld\n",
-            offset, offset + max_size_per_piece - 1);
+    if (adaptive_chunks) {
+        // Buffered responses must fit into the connection receive buffer
+        if (!stream_to_disk && max_adaptive_size > (int64_t)(MG_MAX_RECV_SIZE - MG_IO_SIZE)) {
+            max_adaptive_size = (int64_t)(MG_MAX_RECV_SIZE - MG_IO_SIZE);
+        }
+        if (min_size_per_piece > max_adaptive_size) {
+            printf("Minimum chunk size is bigger than maximum chunk size\n");
+            return 1;
+        }
+        if (max_size_per_piece < min_size_per_piece) max_size_per_piece = min_size_per_piece;
+        if (max_size_per_piece > max_adaptive_size) max_size_per_piece = max_adaptive_size;
+    }
 
-        mg_http_connect(&mgr, url, http_download_callback_fn, &state);
+    // Collect the downloads, all of them are added before any starts
+    download_batch_t batch;
+    memset(&batch, 0, sizeof(batch));
+    if (manifest_path != NULL) {
+        if (!load_manifest(&batch, manifest_path)) {
+            ret = 1;
+            goto cleanup;
+        }
+    }
+    else {
+        download_ctx_t* ctx = add_download(&batch, url, download_path);
+        if (ctx == NULL) {
+            ret = 1;
+            goto cleanup;
+        }
+        ctx->verify_sha256 = verify_sha256;
+        memcpy(ctx->expected_sha256, expected_sha256, sizeof(expected_sha256));
+        ctx->verify_crc32 = verify_crc32;
+        ctx->expected_crc32 = expected_crc32;
+    }
 
-        // Event polling loop
-        while (state == STETE_RUNNING) {
-            mg_mgr_poll(&mgr, 1000);
-            printf("Progress: %.1f%%\r", all_size > 0 ? (double)offset / all_size * 100 : 0.0);
-            fflush(stdout);
+    for (int i = 0; i < batch.count; i++) {
+        if (!start_download(&batch.items[i])) {
+            batch.items[i].state = STATE_ERROR;
         }
+    }
 
-        write_to_file();
+    // Main download loop, the first range of each download reveals its total size,
+    // after that up to `jobs` ranges of it are fetched at once
+    struct mg_mgr mgr;
+    mg_mgr_init(&mgr);
 
-        // Handle retry logic
-        if (state == STATE_ERROR && retry_count++ < max_retries) {
-            printf("\nRetrying (%d/%d)...\n", retry_count, max_retries);
-            state = STETE_RUNNING;
-            continue;
-        }
+    while (schedule_batch(&batch, &mgr) > 0) {
+        // Paused reads are resumed from MG_EV_POLL, so poll often while limited
+        mg_mgr_poll(&mgr, load_rate_limit() > 0 ? 20 : 1000);
+        refill_rate_tokens();
+        print_batch_progress(&batch);
 
-        // Continue if more data available
-        if (state == STATE_SUCCESS && all_size > 0 && offset < all_size) {
-            state = STETE_RUNNING;
+        if (metrics_fn != NULL && mg_millis() - metrics_report_ms >= metrics_interval_ms) {
+            metrics_report_ms = mg_millis();
+            for (int i = 0; i < batch.count; i++) {
+                if (batch.items[i].state == STETE_RUNNING) report_metrics(&batch.items[i]);
+            }
         }
+    }
 
-    } while (state == STETE_RUNNING && offset < all_size);
-
-    // Final status
-    if (state == STATE_SUCCESS) {
-        printf("\nDownload completed. Total size: %lld bytes\n", offset);
+    int succeeded = 0;
+    for (int i = 0; i < batch.count; i++) {
+        if (batch.items[i].state == STATE_SUCCESS) succeeded++;
     }
-    else {
-        printf("\nDownload failed\n");
-        ret = 1;
+    if (succeeded != batch.count) ret = 1;
+    if (batch.count > 1) {
+        printf("\n%d of %d downloads completed\n", succeeded, batch.count);
     }
 
     mg_mgr_free(&mgr);
 
 cleanup:
-    cleanup_resources();
+    for (int i = 0; i < batch.count; i++) {
+        free_download(&batch.items[i]);
+    }
+    free(batch.items);
     return ret;
 }
 
+/** Append a download to `batch`, returns NULL if out of memory */
+static download_ctx_t* add_download(download_batch_t* batch, const char* url, const char* path) {
+    if (batch->count == batch->cap) {
+        int cap = batch->cap > 0 ? batch->cap * 2 : 4;
+        download_ctx_t* items = (download_ctx_t*)realloc(batch->items, cap * sizeof(download_ctx_t));
+        if (items == NULL) {
+            printf("Failed to allocate download\n");
+            return NULL;
+        }
+        batch->items = items;
+        batch->cap = cap;
+    }
 
-/** Callback function for mongoose events */
-static void http_download_callback_fn(struct mg_connection* c, int ev, void* ev_data) {
-    int* pstate = (int*)c->fn_data;
-
-    switch (ev) {
-    case MG_EV_OPEN:
-        *(uint64_t*)c->data = mg_millis() + s_timeout_ms + s_transfer_timeout_ms;
-        break;
+    download_ctx_t* ctx = &batch->items[batch->count];
+    memset(ctx, 0, sizeof(*ctx));
+    ctx->batch = batch;
+    ctx->url = mg_mprintf("%s", url);
+    ctx->download_path = mg_mprintf("%s", path);
+    batch->count++;
+    if (ctx->url == NULL || ctx->download_path == NULL) {
+        printf("Failed to allocate download\n");
+        return NULL;
+    }
+    return ctx;
+}
 
-    case MG_EV_CONNECT: {
-        struct mg_str host = mg_url_host(url);
-        mg_printf(c,
-            "GET %s HTTP/1.1\r\n"
-            "Host: %.*s\r\n"
-            "Connection: close\r\n"
-            "Range: bytes=%lld-%lld\r\n"
-            "\r\n",
-            mg_url_uri(url),
-            host.len, host.buf,
-            offset,
-            offset + max_size_per_piece - 1);
-        break;
+/**
+ * Add the downloads listed in a manifest, one "<url> <path> [sha256=<hex>] [crc32=<hex>]"
+ * per line, empty lines and lines starting with '#' are skipped
+ */
+static bool load_manifest(download_batch_t* batch, const char* path) {
+    FILE* fp = fopen(path, "r");
+    if (!fp) {
+        printf("Failed to open manifest: %s\n", path);
+        return false;
     }
 
-    case MG_EV_HTTP_MSG: {
-        struct mg_http_message* hm = (struct mg_http_message*)ev_data;
-        int state_start = -1, state_end = -1;
-        for (size_t i = 0; i < hm->head.len; i++) {
-            if (hm->head.buf[i] == ' ') {
-                if (state_start < 0) {
-                    state_start = i + 1;
-                }
-                else if (state_end < 0) {
-                    state_end = i;
-                    break;
-                }
+    char line[2048], entry_url[1024], entry_path[512], options[2][128];
+    int line_no = 0;
+    bool ok = true;
+    while (ok && fgets(line, sizeof(line), fp)) {
+        line_no++;
+        int n = sscanf(line, "%1023s %511s %127s %127s", entry_url, entry_path, options[0], options[1]);
+        if (n <= 0 || entry_url[0] == '#') continue;
+        if (n < 2) {
+            printf("Manifest line %d: expected <url> <path>\n", line_no);
+            ok = false;
+            break;
+        }
+
+        download_ctx_t* ctx = add_download(batch, entry_url, entry_path);
+        if (ctx == NULL) {
+            ok = false;
+            break;
+        }
+        for (int i = 0; i < n - 2 && ok; i++) {
+            if (!strncmp(options[i], "sha256=", 7) && parse_hex(options[i] + 7, ctx->expected_sha256, sizeof(ctx->expected_sha256))) {
+                ctx->verify_sha256 = true;
+            }
+            else if (!strncmp(options[i], "crc32=", 6) && parse_crc32(options[i] + 6, &ctx->expected_crc32)) {
+                ctx->verify_crc32 = true;
+            }
+            else {
+                printf("Manifest line %d: invalid option %s\n", line_no, options[i]);
+                ok = false;
             }
         }
-        bool get_state_success = false;
-        int resp_code = (int)string_to_long(hm->head.buf + state_start, state_end - state_start, &get_state_success);
+    }
+    fclose(fp);
+
+    if (ok && batch->count == 0) {
+        printf("Manifest %s lists no downloads\n", path);
+        ok = false;
+    }
+    return ok;
+}
+
+/** Allocate the segments of `ctx` and open its output, continuing from a journal with -r */
+static bool start_download(download_ctx_t* ctx) {
+    ctx->state = STETE_RUNNING;
+    ctx->chunk_size = max_size_per_piece;
+    ctx->start_ms = mg_millis();
+    ctx->metrics.url = ctx->url;
+    ctx->metrics.path = ctx->download_path;
+    // An encoded body can not be split into ranges
+    ctx->jobs = accept_encoding ? 1 : max_parallel_jobs;
+
+    // Allocate segment slots
+    ctx->segments = (download_segment_t*)calloc(ctx->jobs, sizeof(download_segment_t));
+    if (ctx->segments == NULL) {
+        printf("Failed to allocate download segments\n");
+        return false;
+    }
+    for (int i = 0; i < ctx->jobs; i++) {
+        ctx->segments[i].ctx = ctx;
+        ctx->segments[i].id = i;
+    }
 
-        // Check HTTP status code
-        if (resp_code != 200 && resp_code != 206) {
-            printf("\nHTTP error: %d\n", resp_code);
-            *pstate = STATE_ERROR;
-            c->is_closing = 1;
-            return;
+    if (accept_encoding) {
+        ctx->decoder = (inflate_stream_t*)calloc(1, sizeof(inflate_stream_t));
+        if (ctx->decoder == NULL) {
+            printf("Failed to allocate decoder\n");
+            return false;
         }
+    }
+
+    reset_hashes(ctx);
 
-        // Handle full file response (no range support)
-        if (resp_code == 200) {
-            const struct mg_str* cl = mg_http_get_header(hm, "Content-Length");
-            if (cl) {
-                bool ok = false;
-                all_size = string_to_long(cl->buf, cl->len, &ok);
-                if (ok) offset = all_size;
+    // Continue from the journal of an earlier attempt if there is one,
+    // a stale journal must not survive a fresh download of the same path
+    ctx->journal_path = mg_mprintf("%s.journal", ctx->download_path);
+    if (resume_enabled && load_journal(ctx)) {
+        ctx->file = fopen(ctx->download_path, "rb+");
+        if (ctx->file) {
+            for (int i = 0; i < ctx->done_ranges.count; i++) {
+                ctx->downloaded += ctx->done_ranges.items[i].end - ctx->done_ranges.items[i].start + 1;
+                // Data of the earlier attempt is read back once the hash reaches it
+                if (ctx->verify_sha256 || ctx->verify_crc32) {
+                    add_range(&ctx->unhashed_ranges, ctx->done_ranges.items[i].start, ctx->done_ranges.items[i].end);
+                }
             }
+            printf("Resuming %s, %lld of %lld bytes already on disk\n", ctx->download_path, ctx->downloaded, ctx->journal_size);
         }
-
-        // Validate body size
-        if (hm->body.len > max_size_per_piece) {
-            printf("\nBody too large (%lld > %lld)\n", hm->body.len, max_size_per_piece);
-            *pstate = STATE_ERROR;
-            c->is_closing = 1;
-            return;
+        else {
+            ctx->done_ranges.count = 0;
+            ctx->journal_size = 0;
         }
+    }
+    else if (ctx->journal_path != NULL) {
+        remove(ctx->journal_path);
+    }
 
-        // Store received data
-        memcpy(buffer, hm->body.buf, hm->body.len);
-        buffer_len = hm->body.len;
+    // Open output file (truncate if exists)
+    if (!ctx->file) ctx->file = fopen(ctx->download_path, "wb+");
+    if (!ctx->file) {
+        printf("Failed to open file: %s\n", ctx->download_path);
+        return false;
+    }
+    return true;
+}
 
-        // Parse Content-Range header
-        struct mg_str* range_hdr = mg_http_get_header(hm, "Content-Range");
-        if (range_hdr != NULL) {
-            bool success = false;
-            int64_t start = -1, end = -1, total = -1;
-            parse_content_range_value(range_hdr->buf, range_hdr->len, &start, &end, &total, &success);
+/** Schedule every running download once, returns how many are still running */
+static int schedule_batch(download_batch_t* batch, struct mg_mgr* mgr) {
+    int running = 0;
 
-            if (success) {
-                offset = end + 1;
-                all_size = total;
-                printf("\nReceived bytes %lld-%lld/%lld\n", start, end, total);
-            }
+    // Start with a different download each round so none starves under the connection limits
+    for (int n = 0; n < batch->count; n++) {
+        download_ctx_t* ctx = &batch->items[(batch->next + n) % batch->count];
+        if (ctx->state != STETE_RUNNING) continue;
+
+        int state = schedule_segments(ctx, mgr);
+        if (state == STETE_RUNNING) {
+            running++;
+        }
+        else {
+            ctx->state = finish_download(ctx, state);
         }
+    }
+    if (batch->count > 0) batch->next = (batch->next + 1) % batch->count;
+    return running;
+}
 
-        c->is_closing = 1;
-        break;
+/** Check the batch limits allow `ctx` to open another connection */
+static bool connection_available(download_ctx_t* ctx) {
+    download_batch_t* batch = ctx->batch;
+    if (max_connections <= 0 && max_host_connections <= 0) return true;
+
+    struct mg_str host = mg_url_host(ctx->url);
+    unsigned short port = mg_url_port(ctx->url);
+    int total = 0, same_host = 0;
+    for (int i = 0; i < batch->count; i++) {
+        download_ctx_t* other = &batch->items[i];
+        if (other->segments == NULL) continue;
+        bool host_match = mg_strcasecmp(mg_url_host(other->url), host) == 0 && mg_url_port(other->url) == port;
+        for (int j = 0; j < other->jobs; j++) {
+            if (other->segments[j].conn == NULL) continue;
+            total++;
+            if (host_match) same_host++;
+        }
     }
+    if (max_connections > 0 && total >= max_connections) return false;
+    if (max_host_connections > 0 && same_host >= max_host_connections) return false;
+    return true;
+}
 
-    case MG_EV_ERROR:
-        printf("\nError: %s\n", (char*)ev_data);
-        *pstate = STATE_ERROR;
-        break;
+/** Stop a download that left the running state: close its connections, flush, verify and report it */
+static int finish_download(download_ctx_t* ctx, int state) {
+    // Ranges still in flight of a failed download are abandoned
+    for (int i = 0; i < ctx->jobs; i++) {
+        download_segment_t* seg = &ctx->segments[i];
+        if (seg->conn != NULL) {
+            seg->conn->is_closing = 1;
+            seg->conn = NULL;
+        }
+        seg->state = SEGMENT_IDLE;
+    }
 
-    case MG_EV_CLOSE:
-        if (*pstate == STETE_RUNNING) *pstate = STATE_SUCCESS;
-        break;
+    // Commit what was written, a failed download keeps its journal up to date
+    if (!flush_output(ctx)) {
+        state = STATE_ERROR;
+    }
 
-    case MG_EV_POLL:
-        if (mg_millis() > *(uint64_t*)c->data) {
-            *pstate = STATE_ERROR;
-            mg_error(c, "Operation timed out");
+    if (state == STATE_SUCCESS && (ctx->verify_sha256 || ctx->verify_crc32) && !verify_download(ctx)) {
+        state = STATE_ERROR;
+        if (ctx->journal) {
+            // Corrupt data must not be resumed
+            fclose(ctx->journal);
+            ctx->journal = NULL;
+            remove(ctx->journal_path);
         }
-        break;
     }
+
+    // Final status
+    if (state == STATE_SUCCESS) {
+        printf("\nDownload completed: %s. Total size: %lld bytes\n", ctx->download_path, ctx->downloaded);
+        if (ctx->journal) {
+            fclose(ctx->journal);
+            ctx->journal = NULL;
+            remove(ctx->journal_path);
+        }
+    }
+    else {
+        printf("\nDownload failed: %s\n", ctx->download_path);
+    }
+
+    // Close the output now, a batch may hold many more files
+    release_output_map(ctx);
+    if (ctx->file) {
+        fclose(ctx->file);
+        ctx->file = NULL;
+    }
+
+    if (metrics_fn != NULL) {
+        ctx->metrics.finished = true;
+        ctx->metrics.success = state == STATE_SUCCESS;
+        report_metrics(ctx);
+    }
+    return state;
 }
 
-/** Parse Content-Range header */
-static void parse_content_range_value(const char* str, int len,
-    int64_t* start_pos, int64_t* end_pos,
-    int64_t* all_size, bool* success) {
-    *success = false;
-    if (!str || len < 11 || !start_pos || !end_pos || !all_size) return;
+/** Print the overall progress of the batch on one line */
+static void print_batch_progress(download_batch_t* batch) {
+    int64_t done = 0, total = 0;
+    int finished = 0;
+    for (int i = 0; i < batch->count; i++) {
+        download_ctx_t* ctx = &batch->items[i];
+        if (ctx->state != STETE_RUNNING) finished++;
+        if (ctx->all_size > 0) {
+            done += ctx->downloaded;
+            total += ctx->all_size;
+        }
+    }
 
-    // Create null-terminated copy for safety
-    char* tmp = (char*)malloc(len + 1);
-    if (!tmp) return;
+    if (batch->count == 1 && batch->items[0].decoding) {
+        printf("Decoded: %lld bytes\r", batch->items[0].downloaded);
+    }
+    else if (batch->count == 1) {
+        printf("Progress: %.1f%%\r", total > 0 ? (double)done / total * 100 : 0.0);
+    }
+    else {
+        printf("Progress: %.1f%%, %d of %d files finished\r", total > 0 ? (double)done / total * 100 : 0.0, finished, batch->count);
+    }
+    fflush(stdout);
+}
 
-    memcpy(tmp, str, len);
-    tmp[len] = '\0';
+void http_download_set_rate_limit(long bytes_per_sec) {
+    long rate = bytes_per_sec > 0 ? bytes_per_sec : 0;
+#if MG_ARCH == MG_ARCH_WIN32
+    InterlockedExchange(&rate_limit, rate);
+#else
+    __atomic_store_n(&rate_limit, rate, __ATOMIC_RELAXED);
+#endif
+}
 
-    // Parse different Content-Range formats
-    if (sscanf(tmp, "bytes %lld-%lld/%lld", start_pos, end_pos, all_size) == 3) {
-        *success = true;
+/** Current bandwidth limit, http_download_set_rate_limit may run on another thread */
+static long load_rate_limit() {
+#if MG_ARCH == MG_ARCH_WIN32
+    return InterlockedCompareExchange(&rate_limit, 0, 0);
+#else
+    return __atomic_load_n(&rate_limit, __ATOMIC_RELAXED);
+#endif
+}
+
+/** Add the tokens earned since the last refill, at most one burst worth */
+static void refill_rate_tokens() {
+    long rate = load_rate_limit();
+    uint64_t now = mg_millis();
+    if (rate <= 0) {
+        rate_tokens = 0;
+        rate_refill_ms = now;
+        return;
     }
-    else if (sscanf(tmp, "bytes %lld-%lld/*", start_pos, end_pos) == 2) {
-        *success = true;  // Server didn't provide total size
+
+    int64_t burst = (int64_t)rate * (int64_t)rate_burst_ms / 1000;
+    if (burst < MG_IO_SIZE) burst = MG_IO_SIZE;
+    int64_t earned = (int64_t)(now - rate_refill_ms) * rate / 1000;
+    // Low rates earn nothing in a short interval, keep the time for the next refill
+    if (earned == 0) return;
+    rate_tokens += earned;
+    if (rate_tokens > burst) rate_tokens = burst;
+    rate_refill_ms = now;
+}
+
+/**
+ * Backoff before the next attempt of `seg`: exponential in the retry count with
+ * equal jitter, so that many devices failing together do not retry together
+ */
+static uint64_t retry_delay_ms(download_segment_t* seg) {
+    uint64_t delay = retry_base_ms;
+    if (seg->error_class == ERROR_CLASS_DNS) delay *= 4; // The network is likely down
+    for (int i = 1; i < seg->retry_count && delay < retry_max_ms; i++) delay *= 2;
+    if (delay > retry_max_ms) delay = retry_max_ms;
+
+    uint32_t r = 0;
+    mg_random(&r, sizeof(r));
+    delay = delay / 2 + (delay / 2 > 0 ? r % (delay / 2 + 1) : 0);
+
+    if (seg->retry_after_ms > delay) {
+        delay = seg->retry_after_ms < retry_after_max_ms ? seg->retry_after_ms : retry_after_max_ms;
     }
+    return delay;
+}
 
-    free(tmp);
+/** mg_timer callback, the backoff of a failed range is over */
+static void retry_timer_fn(void* arg) {
+    download_segment_t* seg = (download_segment_t*)arg;
+    if (seg->state == SEGMENT_BACKOFF) seg->state = SEGMENT_PENDING;
 }
 
-/** Write buffered data to file */
-static void write_to_file() {
-    if (!file || !buffer) {
-        printf("\nInvalid file or buffer state\n");
-        exit(2);
+/** Parse Retry-After given as delta-seconds or HTTP-date, returns the delay in ms, 0 if invalid */
+static uint64_t parse_retry_after(const struct mg_str* value) {
+    static const char* const months = "JanFebMarAprMayJunJulAugSepOctNovDec";
+    char tmp[64];
+    if (value->len == 0 || value->len >= sizeof(tmp)) return 0;
+    memcpy(tmp, value->buf, value->len);
+    tmp[value->len] = '\0';
+
+    if (tmp[0] >= '0' && tmp[0] <= '9') {
+        bool success = false;
+        int64_t seconds = string_to_long(tmp, (int)value->len, &success);
+        return success && seconds > 0 ? (uint64_t)seconds * 1000 : 0;
     }
 
-    if (buffer_len > 0) {
-        size_t written = fwrite(buffer, 1, buffer_len, file);
-        if (written != (size_t)buffer_len) {
-            printf("\nWrite failed: expected %lld, wrote %zu\n",
-                buffer_len, written);
-            exit(3);
+    // IMF-fixdate, e.g. "Sun, 06 Nov 1994 08:49:37 GMT"
+    int day = 0, year = 0, hour = 0, minute = 0, second = 0;
+    char mon[4] = { 0 };
+    if (sscanf(tmp, "%*[^,], %d %3s %d %d:%d:%d", &day, mon, &year, &hour, &minute, &second) != 6) return 0;
+    const char* found = strstr(months, mon);
+    if (found == NULL || strlen(mon) != 3) return 0;
+    int month = (int)(found - months) / 3 + 1;
+
+    // Days since 1970-01-01 of a proleptic Gregorian date
+    int y = month <= 2 ? year - 1 : year;
+    int era = (y >= 0 ? y : y - 399) / 400;
+    int yoe = y - era * 400;
+    int doy = (153 * (month + (month > 2 ? -3 : 9)) + 2) / 5 + day - 1;
+    int doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+    int64_t days = (int64_t)era * 146097 + doe - 719468;
+
+    int64_t when = days * 86400 + hour * 3600 + minute * 60 + second;
+    int64_t now = (int64_t)time(NULL);
+    return when > now ? (uint64_t)(when - now) * 1000 : 0;
+}
+
+/** Assign the next unrequested range to `seg`, returns false if there is none */
+static bool assign_next_range(download_segment_t* seg) {
+    download_ctx_t* ctx = seg->ctx;
+    if (ctx->all_size <= 0 && ctx->size_probe_sent) return false; // Total size unknown until the first response
+
+    // Skip ranges an earlier attempt already wrote
+    int64_t hole_end = INT64_MAX;
+    for (int i = 0; i < ctx->done_ranges.count; i++) {
+        if (ctx->done_ranges.items[i].end < ctx->offset) continue;
+        if (ctx->done_ranges.items[i].start <= ctx->offset) {
+            ctx->offset = ctx->done_ranges.items[i].end + 1;
+            continue;
         }
-        fflush(file);
-        buffer_len = 0;
+        hole_end = ctx->done_ranges.items[i].start - 1;
+        break;
     }
+    if (ctx->all_size > 0 && ctx->offset >= ctx->all_size) return false;
+
+    seg->start = ctx->offset;
+    seg->end = ctx->offset + ctx->chunk_size - 1;
+    if (seg->end > hole_end) seg->end = hole_end;
+    if (ctx->all_size > 0 && seg->end >= ctx->all_size) seg->end = ctx->all_size - 1;
+    seg->retry_count = 0;
+    seg->state = SEGMENT_PENDING;
+    ctx->offset = seg->end + 1;
+    if (ctx->all_size <= 0) ctx->size_probe_sent = true;
+    return true;
 }
 
-/** Clean up resources */
-static void cleanup_resources() {
-    if (buffer) {
-        free(buffer);
-        buffer = NULL;
+/** Start requests for free slots and retry failed ones, returns the overall state */
+static int schedule_segments(download_ctx_t* ctx, struct mg_mgr* mgr) {
+    int active = 0;
+
+    for (int i = 0; i < ctx->jobs; i++) {
+        download_segment_t* seg = &ctx->segments[i];
+
+        if (seg->state == SEGMENT_RUNNING || seg->state == SEGMENT_BACKOFF) {
+            active++;
+            continue;
+        }
+
+        // Handle retry logic
+        if (seg->state == SEGMENT_ERROR) {
+            if (seg->error_class == ERROR_CLASS_NETWORK) ctx->metrics.network_errors++;
+            else if (seg->error_class == ERROR_CLASS_DNS) ctx->metrics.dns_errors++;
+            else if (seg->error_class == ERROR_CLASS_SERVER) ctx->metrics.server_errors++;
+
+            if (seg->error_class == ERROR_CLASS_FATAL) {
+                printf("\nRange %lld-%lld failed, error is not retryable\n", seg->start, seg->end);
+                return STATE_ERROR;
+            }
+            if (seg->retry_count++ >= max_retries) {
+                printf("\nRange %lld-%lld failed after %d retries\n", seg->start, seg->end, max_retries);
+                return STATE_ERROR;
+            }
+            ctx->metrics.retries++;
+
+            // Smaller requests make further retries cheaper on a bad link
+            if (adaptive_chunks && ctx->chunk_size / 2 >= min_size_per_piece) {
+                ctx->chunk_size /= 2;
+                printf("Chunk size decreased to %lld bytes\n", ctx->chunk_size);
+            }
+
+            uint64_t delay = retry_delay_ms(seg);
+            printf("\nRetrying range %lld-%lld in %llu ms (%d/%d)...\n", seg->start, seg->end, delay, seg->retry_count, max_retries);
+            seg->state = SEGMENT_BACKOFF;
+            if (mg_timer_add(mgr, delay, 0, retry_timer_fn, seg) == NULL) {
+                seg->state = SEGMENT_PENDING;
+            }
+            else {
+                active++;
+                continue;
+            }
+        }
+
+        if (seg->state != SEGMENT_PENDING && !assign_next_range(seg)) {
+            seg->state = SEGMENT_IDLE;
+            if (seg->conn != NULL) {
+                // Nothing left for this slot, release its kept-alive connection
+                seg->conn->is_draining = 1;
+                seg->conn = NULL;
+            }
+            continue;
+        }
+
+        // Adaptive mode may ask for less than the assigned range, the rest
+        // is fetched with the same slot as if the server sent a short range
+        seg->request_end = seg->end;
+        if (adaptive_chunks && seg->request_end - seg->start + 1 > ctx->chunk_size) {
+            seg->request_end = seg->start + ctx->chunk_size - 1;
+        }
+
+        // Slots that would exceed the batch connection limits wait for the next round
+        if (seg->conn == NULL && !connection_available(ctx)) {
+            seg->state = SEGMENT_PENDING;
+            active++;
+            continue;
+        }
+
+        printf("Downloading range: %lld-%lld (slot %d)\n", seg->start, seg->request_end, seg->id);
+        seg->state = SEGMENT_RUNNING;
+        seg->reused = seg->conn != NULL;
+        if (seg->reused) {
+            send_range_request(seg->conn, seg);
+        }
+        else {
+            seg->conn = stream_to_disk
+                ? mg_connect(mgr, ctx->url, http_download_callback_fn, seg)
+                : mg_http_connect(mgr, ctx->url, http_download_callback_fn, seg);
+            if (seg->conn == NULL) {
+                seg->state = SEGMENT_ERROR;
+                continue;
+            }
+            ctx->metrics.connections++;
+        }
+        active++;
+    }
+
+    if (active > 0) return STETE_RUNNING;
+    return (ctx->all_size <= 0 || ctx->downloaded >= ctx->all_size) ? STATE_SUCCESS : STATE_ERROR;
+}
+
+/**
+ * Drop everything written for an outdated remote file and fetch it again from the start.
+ * `seg` received the first response of the new file, the ranges of the other slots were
+ * assigned around the old journal and start over. Returns false if the response of `seg`
+ * does not start at 0 either, the slot then retries from 0
+ */
+static bool restart_download(download_segment_t* seg) {
+    download_ctx_t* ctx = seg->ctx;
+    discard_output(ctx);
+    ctx->journal_size = 0;
+    for (int i = 0; i < ctx->jobs; i++) {
+        download_segment_t* other = &ctx->segments[i];
+        if (other == seg) continue;
+        if (other->state == SEGMENT_RUNNING && other->conn != NULL) {
+            other->conn->is_closing = 1;
+            other->conn = NULL;
+        }
+        // A pending retry timer finds the slot idle and leaves it alone
+        other->in_body = false;
+        other->state = SEGMENT_IDLE;
+    }
+
+    bool from_start = seg->start == 0;
+    if (!from_start) {
+        seg->start = 0;
+        seg->end = ctx->chunk_size - 1;
+        if (ctx->all_size > 0 && seg->end >= ctx->all_size) seg->end = ctx->all_size - 1;
+    }
+    // The other slots continue after the range of `seg`, nothing is left after a whole file
+    ctx->offset = seg->end + 1;
+    // Until the size is known the request of `seg` is the only one
+    ctx->size_probe_sent = ctx->all_size <= 0;
+    return from_start;
+}
+
+/** Validate response headers for `seg`, fills the byte range the body covers */
+static bool check_segment_headers(download_segment_t* seg, struct mg_http_message* hm, int64_t* start, int64_t* end) {
+    download_ctx_t* ctx = seg->ctx;
+    int state_start = -1, state_end = -1;
+    for (size_t i = 0; i < hm->head.len; i++) {
+        if (hm->head.buf[i] == ' ') {
+            if (state_start < 0) {
+                state_start = i + 1;
+            }
+            else if (state_end < 0) {
+                state_end = i;
+                break;
+            }
+        }
+    }
+    bool get_state_success = false;
+    int resp_code = (int)string_to_long(hm->head.buf + state_start, state_end - state_start, &get_state_success);
+
+    // Check HTTP status code
+    if (resp_code != 200 && resp_code != 206) {
+        printf("\nHTTP error: %d\n", resp_code);
+        if (resp_code >= 500 || resp_code == 408 || resp_code == 429) {
+            struct mg_str* retry_after = mg_http_get_header(hm, "Retry-After");
+            seg->error_class = ERROR_CLASS_SERVER;
+            if (retry_after != NULL) seg->retry_after_ms = parse_retry_after(retry_after);
+        }
+        else {
+            if (resp_code == 416) {
+                printf("\nRange %lld-%lld is beyond the end of the remote file\n", seg->start, seg->request_end);
+                // A journal describing a bigger file is useless for the next attempt
+                if (resume_enabled && ctx->journal == NULL && ctx->journal_path != NULL) remove(ctx->journal_path);
+            }
+            seg->error_class = ERROR_CLASS_FATAL;
+        }
+        return false;
+    }
+
+    // Body length comes from Content-Length, it is ~0 if the header is missing.
+    // A chunked body is only streamed, its length is known once the last chunk arrived
+    struct mg_str* te = mg_http_get_header(hm, "Transfer-Encoding");
+    bool chunked = te != NULL && mg_strcasecmp(*te, mg_str("chunked")) == 0;
+    if (te != NULL && !chunked) {
+        printf("\nUnsupported Transfer-Encoding: %.*s\n", (int)te->len, te->buf);
+        seg->error_class = ERROR_CLASS_FATAL;
+        return false;
+    }
+    if (!chunked && hm->body.len == (size_t)-1) {
+        printf("\nResponse has no Content-Length\n");
+        return false;
+    }
+    int64_t body_len = chunked ? -1 : (int64_t)hm->body.len;
+
+    int64_t total = -1;
+    *start = 0;
+    *end = body_len - 1;
+
+    // Every attempt of a -gzip download starts over, possibly with another encoding
+    if (accept_encoding) {
+        discard_output(ctx);
+        ctx->all_size = 0;
+        if (!select_decoder(seg, hm)) return false;
+    }
+
+    // Handle full file response (no range support, or If-Range did not match)
+    if (resp_code == 200) {
+        if (seg->start != 0 && !(resume_enabled && ctx->journal == NULL)) {
+            printf("\nServer ignored range %lld-%lld\n", seg->start, seg->end);
+            return false;
+        }
+        seg->start = 0;
+        if (body_len >= 0) {
+            seg->end = body_len - 1;
+            ctx->offset = body_len;
+        }
+        // The decoded size of an encoded body is known once it is inflated
+        if (!ctx->decoding) total = body_len;
+    }
+    else {
+        // Parse Content-Range header
+        struct mg_str* range_hdr = mg_http_get_header(hm, "Content-Range");
+        bool success = false;
+        if (range_hdr != NULL) {
+            parse_content_range_value(range_hdr->buf, range_hdr->len, start, end, &total, &success);
+        }
+        if (!success || *start != seg->start || *end < *start || *end > seg->request_end ||
+            (body_len >= 0 && *end - *start + 1 != body_len)) {
+            printf("\nUnexpected Content-Range for range %lld-%lld\n", seg->start, seg->end);
+            return false;
+        }
+        printf("\nReceived bytes %lld-%lld/%lld\n", *start, *end, total);
+    }
+
+    if (total > 0) {
+        if (ctx->all_size > 0 && ctx->all_size != total) {
+            printf("\nRemote file size changed (%lld -> %lld)\n", ctx->all_size, total);
+            return false;
+        }
+        ctx->all_size = total;
+    }
+
+    // First response of a resumable download: check the journal still
+    // describes the remote file, then start recording
+    if (resume_enabled && ctx->journal == NULL) {
+        struct mg_str* etag_hdr = mg_http_get_header(hm, "ETag");
+        struct mg_str* modified_hdr = mg_http_get_header(hm, "Last-Modified");
+        bool keep = ctx->journal_size > 0 && resp_code == 206 && total == ctx->journal_size;
+        if (ctx->journal_size > 0 && !keep) {
+            printf("\nRemote file changed, restarting download\n");
+            if (!restart_download(seg)) return false;
+        }
+        ctx->etag[0] = ctx->last_modified[0] = '\0';
+        // Weak ETags are not allowed in If-Range
+        if (etag_hdr != NULL && etag_hdr->len < sizeof(ctx->etag) && !(etag_hdr->len > 1 && etag_hdr->buf[0] == 'W' && etag_hdr->buf[1] == '/')) {
+            memcpy(ctx->etag, etag_hdr->buf, etag_hdr->len);
+            ctx->etag[etag_hdr->len] = '\0';
+        }
+        if (modified_hdr != NULL && modified_hdr->len < sizeof(ctx->last_modified)) {
+            memcpy(ctx->last_modified, modified_hdr->buf, modified_hdr->len);
+            ctx->last_modified[modified_hdr->len] = '\0';
+        }
+        ctx->journal_size = ctx->all_size;
+        if (!open_journal(ctx, keep)) {
+            printf("\nFailed to open journal %s, download will not be resumable\n", ctx->journal_path);
+        }
+    }
+
+    // The first range was requested before the total size was known
+    if (ctx->all_size > 0 && seg->end >= ctx->all_size) seg->end = ctx->all_size - 1;
+    if (ctx->all_size > 0 && ctx->offset > ctx->all_size) ctx->offset = ctx->all_size;
+
+    if (ctx->all_size > 0 && ctx->output_size != ctx->all_size && !prepare_output(ctx, ctx->all_size)) {
+        return false;
+    }
+    return true;
+}
+
+/** Grow or shrink the chunk size of a download from the timing of a completed request */
+static void adapt_chunk_size(download_segment_t* seg, int64_t len) {
+    download_ctx_t* ctx = seg->ctx;
+    uint64_t now = mg_millis();
+    if (seg->first_byte_ms == 0) return;
+    uint64_t ttfb = seg->first_byte_ms - seg->sent_ms;
+    uint64_t transfer = now - seg->first_byte_ms;
+
+    // A short tail range says little about the link
+    if (len < ctx->chunk_size / 2) return;
+
+    int64_t size = ctx->chunk_size;
+    if (transfer < adaptive_fast_ms || transfer < 4 * ttfb) {
+        // Fast link, or request latency dominates the transfer time
+        size = ctx->chunk_size * 2;
+    }
+    else if (transfer > adaptive_slow_ms) {
+        size = ctx->chunk_size / 2;
+    }
+    if (size < min_size_per_piece) size = min_size_per_piece;
+    if (size > max_adaptive_size) size = max_adaptive_size;
+
+    if (size != ctx->chunk_size) {
+        printf("\nChunk size %lld -> %lld bytes (ttfb %llu ms, %llu KB/s)\n",
+            ctx->chunk_size, size, ttfb, transfer > 0 ? (uint64_t)len / transfer : (uint64_t)len);
+        ctx->chunk_size = size;
+    }
+}
+
+/** Mark bytes `start`-`end` of the current range as written */
+static void finish_segment_range(download_segment_t* seg, int64_t start, int64_t end) {
+    download_ctx_t* ctx = seg->ctx;
+    if (resume_enabled) {
+        record_done_range(ctx, start, end);
+        // Without an explicit interval every range is journaled as soon as it completes
+        if (sync_interval == 0) flush_output(ctx);
+    }
+    if (adaptive_chunks) adapt_chunk_size(seg, end - start + 1);
+    // Latency histogram, bucket 0 is below 1ms, bucket i holds [2^(i-1), 2^i) ms
+    uint64_t latency = mg_millis() - seg->sent_ms;
+    int bucket = 0;
+    while (latency > 0 && bucket < HTTP_DOWNLOAD_LATENCY_BUCKETS - 1) {
+        latency >>= 1;
+        bucket++;
+    }
+    ctx->metrics.chunk_latency[bucket]++;
+    if (end < seg->end) {
+        // Server returned a shorter range, fetch the rest with the same slot
+        seg->start = end + 1;
+        seg->state = SEGMENT_PENDING;
+    }
+    else {
+        seg->state = SEGMENT_DONE;
+    }
+}
+
+/** Validate a buffered response for `seg` and write its body, returns false on failure */
+static bool handle_segment_response(download_segment_t* seg, struct mg_http_message* hm) {
+    download_ctx_t* ctx = seg->ctx;
+    // mongoose delivers whatever was buffered if the connection closes early
+    struct mg_str* cl = mg_http_get_header(hm, "Content-Length");
+    bool cl_success = false;
+    if (cl != NULL && string_to_long(cl->buf, cl->len, &cl_success) != (int64_t)hm->body.len) {
+        printf("\nTruncated response for range %lld-%lld\n", seg->start, seg->end);
+        return false;
+    }
+
+    int64_t start = 0, end = -1;
+    if (!check_segment_headers(seg, hm, &start, &end)) {
+        return false;
+    }
+    if (!store_body_bytes(ctx, start, hm->body.buf, hm->body.len)) {
+        seg->error_class = ERROR_CLASS_FATAL;
+        return false;
+    }
+    ctx->downloaded += (int64_t)hm->body.len;
+    finish_segment_range(seg, start, end);
+    return true;
+}
+
+/** inflate_stream output callback, appends decoded bytes of `arg`'s response to the file */
+static bool write_decoded(const char* data, size_t len, void* arg) {
+    download_segment_t* seg = (download_segment_t*)arg;
+    download_ctx_t* ctx = seg->ctx;
+    if (!store_body_bytes(ctx, ctx->downloaded, data, len)) {
+        seg->error_class = ERROR_CLASS_FATAL;
+        return false;
+    }
+    ctx->downloaded += (int64_t)len;
+    return true;
+}
+
+/**
+ * Consume chunk size lines, chunk terminators and trailer fields at the start of `c->recv`.
+ * Stops at chunk data, at the end of the body or when a line is not complete yet.
+ * Returns false if the chunked framing is invalid
+ */
+static bool parse_chunk_framing(struct mg_connection* c, download_segment_t* seg) {
+    while (c->recv.len > 0 && seg->chunk_state != CHUNK_DATA && seg->chunk_state != CHUNK_DONE) {
+        const char* buf = (const char*)c->recv.buf;
+        const char* eol = (const char*)memchr(buf, '\n', c->recv.len);
+        if (eol == NULL) return c->recv.len <= MG_IO_SIZE; // Line not complete yet
+        size_t line_len = (size_t)(eol - buf) + 1;
+        if (line_len < 2 || buf[line_len - 2] != '\r') return false;
+
+        if (seg->chunk_state == CHUNK_SIZE) {
+            // Hex size, optionally followed by chunk extensions which are ignored
+            size_t digits = 0;
+            while (digits < line_len - 2 && ((buf[digits] >= '0' && buf[digits] <= '9') ||
+                (buf[digits] >= 'a' && buf[digits] <= 'f') || (buf[digits] >= 'A' && buf[digits] <= 'F'))) {
+                digits++;
+            }
+            char next = buf[digits];
+            if (digits == 0 || (next != '\r' && next != ';' && next != ' ' && next != '\t')) return false;
+            int64_t size = 0;
+            if (!mg_str_to_num(mg_str_n(buf, digits), 16, &size, sizeof(size)) || size < 0) return false;
+            seg->chunk_left = size;
+            seg->chunk_state = size > 0 ? CHUNK_DATA : CHUNK_TRAILER;
+        }
+        else if (seg->chunk_state == CHUNK_DATA_END) {
+            if (line_len != 2) return false;
+            seg->chunk_state = CHUNK_SIZE;
+        }
+        else if (line_len == 2) {
+            // Empty line after the trailer fields
+            seg->chunk_state = CHUNK_DONE;
+        }
+        mg_iobuf_del(&c->recv, 0, line_len);
+    }
+    return true;
+}
+
+/**
+ * Consume `c->recv` of a streaming connection: parse the response headers,
+ * then write body bytes to the file as they arrive and drop them from the buffer.
+ * A chunked body is decoded on the way, its length is known once the last chunk arrived.
+ * Returns false on failure.
+ */
+static bool stream_segment_response(struct mg_connection* c, download_segment_t* seg) {
+    download_ctx_t* ctx = seg->ctx;
+    while (c->recv.len > 0 && seg->state == SEGMENT_RUNNING) {
+        if (!seg->in_body) {
+            struct mg_http_message hm;
+            int n = mg_http_parse((char*)c->recv.buf, c->recv.len, &hm);
+            if (n < 0 || (n == 0 && c->recv.len > MG_IO_SIZE)) {
+                printf("\nInvalid response headers\n");
+                return false;
+            }
+            if (n == 0) break; // Headers not complete yet
+
+            int64_t start = 0, end = -1;
+            if (!check_segment_headers(seg, &hm, &start, &end)) {
+                return false;
+            }
+            struct mg_str* conn_hdr = mg_http_get_header(&hm, "Connection");
+            seg->server_closes = conn_hdr != NULL && mg_strcasecmp(*conn_hdr, mg_str("close")) == 0;
+            seg->chunked = mg_http_get_header(&hm, "Transfer-Encoding") != NULL;
+            seg->chunk_state = CHUNK_SIZE;
+            seg->body_start = start;
+            seg->write_pos = start;
+            seg->body_left = end >= start ? end - start + 1 : -1;
+            seg->in_body = true;
+            mg_iobuf_del(&c->recv, 0, (size_t)n);
+        }
+
+        size_t len = c->recv.len;
+        if (seg->chunked) {
+            if (!parse_chunk_framing(c, seg)) {
+                printf("\nInvalid chunked response\n");
+                return false;
+            }
+            len = seg->chunk_state == CHUNK_DATA ? c->recv.len : 0;
+            if ((int64_t)len > seg->chunk_left) len = (size_t)seg->chunk_left;
+            if (seg->body_left >= 0 && (int64_t)len > seg->body_left) {
+                printf("\nChunked response is longer than range %lld-%lld\n", seg->start, seg->end);
+                return false;
+            }
+        }
+        else if ((int64_t)len > seg->body_left) {
+            len = (size_t)seg->body_left;
+        }
+
+        if (len > 0) {
+            if (ctx->decoding) {
+                ctx->decode_result = inflate_stream_feed(ctx->decoder, (char*)c->recv.buf, len, write_decoded, seg);
+                if (ctx->decode_result == INFLATE_ERROR) {
+                    printf("\nFailed to decode response: %s\n", ctx->decoder->error);
+                    return false;
+                }
+            }
+            else {
+                if (!store_body_bytes(ctx, seg->write_pos, (char*)c->recv.buf, len)) {
+                    seg->error_class = ERROR_CLASS_FATAL;
+                    return false;
+                }
+                ctx->downloaded += (int64_t)len;
+            }
+            mg_iobuf_del(&c->recv, 0, len);
+            seg->write_pos += (int64_t)len;
+            if (seg->body_left > 0) seg->body_left -= (int64_t)len;
+            if (seg->chunked && (seg->chunk_left -= (int64_t)len) == 0) seg->chunk_state = CHUNK_DATA_END;
+
+            // Ranges may be large in this mode, so the deadline only covers stalls
+            *(uint64_t*)c->data = mg_millis() + s_transfer_timeout_ms;
+        }
+
+        if (seg->chunked ? seg->chunk_state != CHUNK_DONE : seg->body_left != 0) {
+            if (len == 0) break; // Rest of the body not received yet
+            continue;
+        }
+
+        seg->in_body = false;
+        if (seg->chunked && seg->body_left > 0) {
+            printf("\nChunked response ended before the end of range %lld-%lld\n", seg->start, seg->end);
+            return false;
+        }
+        if (ctx->decoding && ctx->decode_result != INFLATE_DONE) {
+            printf("\nEncoded response ended before the end of its stream\n");
+            return false;
+        }
+        if (ctx->decoding || seg->body_left < 0) {
+            // The size is only known now, and the offset either counted
+            // encoded bytes or was never set, nothing is left to request.
+            // A whole body starts at 0, its end is the size unless it was decoded
+            ctx->all_size = ctx->decoding ? ctx->downloaded : seg->write_pos;
+            ctx->offset = ctx->all_size;
+            seg->end = seg->write_pos - 1;
+        }
+        finish_segment_range(seg, seg->body_start, seg->write_pos - 1);
+    }
+    return true;
+}
+
+/** Take back the body bytes counted by a failed attempt, the retry fetches its whole range again */
+static void abandon_segment_body(download_segment_t* seg) {
+    download_ctx_t* ctx = seg->ctx;
+    // Decoded bytes are dropped along with the output by the next attempt
+    if (seg->in_body && !ctx->decoding) ctx->downloaded -= seg->write_pos - seg->body_start;
+    seg->in_body = false;
+}
+
+/** Close the connection of a finished request, or keep it for the next range */
+static void release_segment_connection(struct mg_connection* c, download_segment_t* seg, bool success, bool server_closes) {
+    if (!success) {
+        abandon_segment_body(seg);
+        seg->state = SEGMENT_ERROR;
+    }
+    if (!success || !keep_alive || server_closes) {
+        seg->conn = NULL;
+        c->is_closing = 1;
+    }
+}
+
+/** Send the GET request for the range currently assigned to `seg` */
+static void send_range_request(struct mg_connection* c, download_segment_t* seg) {
+    download_ctx_t* ctx = seg->ctx;
+    struct mg_str host = mg_url_host(ctx->url);
+    *(uint64_t*)c->data = mg_millis() + s_timeout_ms + s_transfer_timeout_ms;
+    seg->in_body = false;
+    seg->sent_ms = mg_millis();
+    seg->first_byte_ms = 0;
+    seg->error_class = ERROR_CLASS_NETWORK;
+    seg->retry_after_ms = 0;
+    ctx->metrics.requests++;
+    mg_printf(c,
+        "GET %s HTTP/1.1\r\n"
+        "Host: %.*s\r\n"
+        "Connection: %s\r\n",
+        mg_url_uri(ctx->url),
+        host.len, host.buf,
+        keep_alive ? "keep-alive" : "close");
+    if (accept_encoding) {
+        // A range would select bytes of the encoded body, so it is fetched whole
+        mg_printf(c, "Accept-Encoding: gzip, deflate\r\n");
+    }
+    else {
+        mg_printf(c, "Range: bytes=%lld-%lld\r\n", seg->start, seg->request_end);
+    }
+    if (resume_enabled && (ctx->etag[0] || ctx->last_modified[0])) {
+        // Server answers 200 with the whole new file if ours is outdated
+        mg_printf(c, "If-Range: %s\r\n", ctx->etag[0] ? ctx->etag : ctx->last_modified);
+    }
+    mg_printf(c, "\r\n");
+}
+
+/** Callback function for mongoose events */
+static void http_download_callback_fn(struct mg_connection* c, int ev, void* ev_data) {
+    download_segment_t* seg = (download_segment_t*)c->fn_data;
+    download_ctx_t* ctx = seg->ctx;
+
+    // Connection phases may complete before mg_connect returns, so they are
+    // timed for any connection of the download
+    if (ev == MG_EV_OPEN || ev == MG_EV_RESOLVE || ev == MG_EV_CONNECT || ev == MG_EV_TLS_HS) {
+        record_phase(ctx, c, ev);
+    }
+
+    switch (ev) {
+    case MG_EV_OPEN:
+        *(uint64_t*)c->data = mg_millis() + s_timeout_ms + s_transfer_timeout_ms;
+        break;
+
+    case MG_EV_CONNECT:
+        if (mg_url_is_ssl(ctx->url)) {
+            struct mg_tls_opts opts;
+            memset(&opts, 0, sizeof(opts));
+            opts.name = mg_url_host(ctx->url);
+            mg_tls_init(c, &opts);
+        }
+        send_range_request(c, seg);
+        break;
+
+    case MG_EV_HTTP_HDRS: {
+        // The HTTP handler runs before MG_EV_READ gets here, a small response may be complete already
+        struct mg_http_message* hm = (struct mg_http_message*)ev_data;
+        if (seg->conn != c) break;
+        record_first_byte(seg);
+
+        // A chunked body has to be buffered whole by mongoose, stream it instead.
+        // Consuming the headers makes mongoose detach its HTTP handler from the connection
+        if (mg_http_get_header(hm, "Transfer-Encoding") == NULL) break;
+        if (!stream_segment_response(c, seg)) {
+            release_segment_connection(c, seg, false, true);
+        }
+        else if (seg->state != SEGMENT_RUNNING) {
+            release_segment_connection(c, seg, true, seg->server_closes);
+        }
+        break;
+    }
+
+    case MG_EV_HTTP_MSG: {
+        struct mg_http_message* hm = (struct mg_http_message*)ev_data;
+        if (seg->conn != c) break;
+        bool success = handle_segment_response(seg, hm);
+
+        // Keep the connection for the next range unless the server is closing it
+        struct mg_str* conn_hdr = mg_http_get_header(hm, "Connection");
+        release_segment_connection(c, seg, success,
+            conn_hdr != NULL && mg_strcasecmp(*conn_hdr, mg_str("close")) == 0);
+        break;
+    }
+
+    case MG_EV_READ:
+        if (seg->conn == c) record_first_byte(seg);
+        record_received(ctx, *(long*)ev_data);
+
+        // Bytes read beyond the budget pause the socket until enough tokens are earned back,
+        // the sender is then held back by TCP flow control
+        if (load_rate_limit() > 0) {
+            rate_tokens -= *(long*)ev_data;
+            if (rate_tokens < 0) c->is_full = 1;
+            // A limited transfer may take long, the deadline only covers stalls
+            *(uint64_t*)c->data = mg_millis() + s_transfer_timeout_ms;
+        }
+
+        // Streaming connections are created without the HTTP protocol handler,
+        // or it was detached for a chunked response
+        if (c->pfn != NULL || seg->conn != c) break;
+        if (!stream_segment_response(c, seg)) {
+            release_segment_connection(c, seg, false, true);
+        }
+        else if (seg->state != SEGMENT_RUNNING) {
+            release_segment_connection(c, seg, true, seg->server_closes);
+        }
+        break;
+
+    case MG_EV_ERROR:
+        printf("\nError: %s\n", (char*)ev_data);
+        if (seg->conn == c) {
+            const char* err = (const char*)ev_data;
+            abandon_segment_body(seg);
+            seg->state = SEGMENT_ERROR;
+            seg->error_class = (strstr(err, "DNS") || strstr(err, "resolve")) ? ERROR_CLASS_DNS : ERROR_CLASS_NETWORK;
+        }
+        break;
+
+    case MG_EV_CLOSE:
+        if (seg->conn == c) {
+            if (seg->state == SEGMENT_RUNNING) {
+                // A kept-alive connection the server dropped before answering is
+                // reconnected without using up a retry, anything else is an error
+                seg->state = (seg->reused && !seg->in_body && c->recv.len == 0) ? SEGMENT_PENDING : SEGMENT_ERROR;
+                abandon_segment_body(seg);
+            }
+            seg->conn = NULL;
+        }
+        break;
+
+    case MG_EV_POLL:
+        if (c->is_full) {
+            if (rate_tokens >= 0 || load_rate_limit() <= 0) c->is_full = 0;
+            // Time spent paused by the rate limit is not a stall
+            *(uint64_t*)c->data = mg_millis() + s_transfer_timeout_ms;
+        }
+
+        // Idle kept-alive connections have no deadline
+        if (seg->conn == c && seg->state != SEGMENT_RUNNING) break;
+        if (mg_millis() > *(uint64_t*)c->data) {
+            mg_error(c, "Operation timed out");
+        }
+        break;
+    }
+}
+
+/** Note the arrival of the first response byte of the request in flight on `seg` */
+static void record_first_byte(download_segment_t* seg) {
+    download_ctx_t* ctx = seg->ctx;
+    if (seg->state != SEGMENT_RUNNING || seg->first_byte_ms != 0) return;
+    seg->first_byte_ms = mg_millis();
+    uint64_t ttfb = seg->first_byte_ms - seg->sent_ms;
+    if (ctx->ttfb_count++ == 0) ctx->metrics.ttfb_first_ms = ttfb;
+    if (ttfb > ctx->metrics.ttfb_max_ms) ctx->metrics.ttfb_max_ms = ttfb;
+    ctx->ttfb_sum_ms += ttfb;
+}
+
+/** Count `len` bytes read from the network in the current second of `ctx` */
+static void record_received(download_ctx_t* ctx, long len) {
+    uint64_t second = (mg_millis() - ctx->start_ms) / 1000;
+    int slot = (int)(second % METRICS_WINDOW);
+    if (ctx->window_second[slot] != second) {
+        ctx->window_second[slot] = second;
+        ctx->window_bytes[slot] = 0;
+    }
+    ctx->window_bytes[slot] += len;
+    ctx->metrics.received += len;
+}
+
+/**
+ * Time the phases of connection `c`: resolving starts at MG_EV_OPEN, connecting at
+ * MG_EV_RESOLVE and the TLS handshake at MG_EV_CONNECT.
+ * The start of the current phase is kept after the deadline in `c->data`
+ */
+static void record_phase(download_ctx_t* ctx, struct mg_connection* c, int ev) {
+    uint64_t* phase_ms = (uint64_t*)c->data + 1;
+    uint64_t now = mg_millis();
+    if (ev == MG_EV_RESOLVE) {
+        ctx->dns_sum_ms += now - *phase_ms;
+        ctx->dns_count++;
+    }
+    else if (ev == MG_EV_CONNECT) {
+        ctx->connect_sum_ms += now - *phase_ms;
+        ctx->connect_count++;
+    }
+    else if (ev == MG_EV_TLS_HS) {
+        ctx->tls_sum_ms += now - *phase_ms;
+        ctx->tls_count++;
+    }
+    *phase_ms = now;
+}
+
+/** Average received bytes per second over the last `seconds` full seconds */
+static int64_t window_rate(download_ctx_t* ctx, uint64_t now_second, int seconds) {
+    // The current second is still running, it is left out unless it is the only one
+    if (now_second == 0) {
+        uint64_t elapsed = mg_millis() - ctx->start_ms;
+        return elapsed > 0 ? ctx->metrics.received * 1000 / (int64_t)elapsed : 0;
+    }
+    if ((uint64_t)seconds > now_second) seconds = (int)now_second;
+
+    int64_t bytes = 0;
+    for (int i = 1; i <= seconds; i++) {
+        uint64_t second = now_second - i;
+        int slot = (int)(second % METRICS_WINDOW);
+        if (ctx->window_second[slot] == second) bytes += ctx->window_bytes[slot];
+    }
+    return bytes / seconds;
+}
+
+/** Complete the metrics snapshot of `ctx` and pass it to the metrics callback */
+static void report_metrics(download_ctx_t* ctx) {
+    http_download_metrics_t* m = &ctx->metrics;
+    uint64_t now_second;
+    m->downloaded = ctx->downloaded;
+    m->total = ctx->all_size > 0 ? ctx->all_size : 0;
+    m->elapsed_ms = mg_millis() - ctx->start_ms;
+    now_second = m->elapsed_ms / 1000;
+    m->rate_1s = window_rate(ctx, now_second, 1);
+    m->rate_10s = window_rate(ctx, now_second, 10);
+    m->rate_60s = window_rate(ctx, now_second, METRICS_WINDOW);
+    m->rate_avg = m->elapsed_ms > 0 ? m->received * 1000 / (int64_t)m->elapsed_ms : 0;
+    m->ttfb_avg_ms = ctx->ttfb_count > 0 ? ctx->ttfb_sum_ms / ctx->ttfb_count : 0;
+    m->dns_avg_ms = ctx->dns_count > 0 ? ctx->dns_sum_ms / ctx->dns_count : 0;
+    m->connect_avg_ms = ctx->connect_count > 0 ? ctx->connect_sum_ms / ctx->connect_count : 0;
+    m->tls_avg_ms = ctx->tls_count > 0 ? ctx->tls_sum_ms / ctx->tls_count : 0;
+    metrics_fn(m, metrics_arg);
+}
+
+/** Metrics callback of -metrics, prints one JSON object per line */
+static void print_metrics(const http_download_metrics_t* metrics, void* arg) {
+    char* json = http_download_metrics_json(metrics);
+    (void)arg; // Registered without one
+    if (json != NULL) {
+        printf("\nMetrics: %s\n", json);
+        free(json);
+    }
+}
+
+void http_download_set_metrics_callback(http_download_metrics_fn fn, void* arg, uint64_t interval_ms) {
+    metrics_fn = fn;
+    metrics_arg = arg;
+    metrics_interval_ms = interval_ms > 0 ? interval_ms : 1000;
+}
+
+char* http_download_metrics_json(const http_download_metrics_t* m) {
+    char latency[HTTP_DOWNLOAD_LATENCY_BUCKETS * 11 + 2];
+    size_t n = 0;
+    for (int i = 0; i < HTTP_DOWNLOAD_LATENCY_BUCKETS; i++) {
+        n += mg_snprintf(latency + n, sizeof(latency) - n, "%s%u", i > 0 ? "," : "", m->chunk_latency[i]);
+    }
+
+    return mg_mprintf(
+        "{"
+        "\"url\":%m,"
+        "\"path\":%m,"
+        "\"state\":\"%s\","
+        "\"downloaded\":%lld,"
+        "\"total\":%lld,"
+        "\"received\":%lld,"
+        "\"elapsed_ms\":%llu,"
+        "\"rate\":{\"1s\":%lld,\"10s\":%lld,\"60s\":%lld,\"avg\":%lld},"
+        "\"requests\":%d,"
+        "\"connections\":%d,"
+        "\"retries\":%d,"
+        "\"errors\":{\"network\":%d,\"dns\":%d,\"server\":%d},"
+        "\"ttfb_ms\":{\"first\":%llu,\"avg\":%llu,\"max\":%llu},"
+        "\"phase_ms\":{\"dns\":%llu,\"connect\":%llu,\"tls\":%llu},"
+        "\"chunk_latency_log2_ms\":[%s]"
+        "}",
+        MG_ESC(m->url != NULL ? m->url : ""), MG_ESC(m->path != NULL ? m->path : ""),
+        !m->finished ? "running" : m->success ? "success" : "error",
+        m->downloaded, m->total, m->received, m->elapsed_ms,
+        m->rate_1s, m->rate_10s, m->rate_60s, m->rate_avg,
+        m->requests, m->connections, m->retries,
+        m->network_errors, m->dns_errors, m->server_errors,
+        m->ttfb_first_ms, m->ttfb_avg_ms, m->ttfb_max_ms,
+        m->dns_avg_ms, m->connect_avg_ms, m->tls_avg_ms,
+        latency);
+}
+
+/** Set up `decoder` for the Content-Encoding of `hm`, returns false if it is not supported */
+static bool select_decoder(download_segment_t* seg, struct mg_http_message* hm) {
+    download_ctx_t* ctx = seg->ctx;
+    struct mg_str* encoding = mg_http_get_header(hm, "Content-Encoding");
+    ctx->decoding = false;
+    ctx->decode_result = INFLATE_NEED_INPUT;
+    if (encoding == NULL || mg_strcasecmp(*encoding, mg_str("identity")) == 0) {
+        return true;
+    }
+    if (mg_strcasecmp(*encoding, mg_str("gzip")) == 0 || mg_strcasecmp(*encoding, mg_str("x-gzip")) == 0) {
+        inflate_stream_init(ctx->decoder, INFLATE_FORMAT_GZIP);
+    }
+    else if (mg_strcasecmp(*encoding, mg_str("deflate")) == 0) {
+        // Meant to be zlib wrapped, some servers send raw deflate
+        inflate_stream_init(ctx->decoder, INFLATE_FORMAT_AUTO);
+    }
+    else {
+        printf("\nUnsupported Content-Encoding: %.*s\n", (int)encoding->len, encoding->buf);
+        seg->error_class = ERROR_CLASS_FATAL;
+        return false;
+    }
+    ctx->decoding = true;
+    return true;
+}
+
+/** Forget everything written so far and truncate the output */
+static void discard_output(download_ctx_t* ctx) {
+    ctx->done_ranges.count = 0;
+    ctx->unjournaled_ranges.count = 0;
+    ctx->downloaded = 0;
+    reset_hashes(ctx);
+    release_output_map(ctx);
+    ctx->output_size = 0;
+#if MG_ARCH == MG_ARCH_WIN32
+    _chsize_s(_fileno(ctx->file), 0);
+#else
+    if (ftruncate(fileno(ctx->file), 0) != 0) printf("\nFailed to truncate %s\n", ctx->download_path);
+#endif
+}
+
+/** Parse Content-Range header */
+static void parse_content_range_value(const char* str, int len,
+    int64_t* start_pos, int64_t* end_pos,
+    int64_t* all_size, bool* success) {
+    *success = false;
+    if (!str || len < 11 || !start_pos || !end_pos || !all_size) return;
+
+    // Create null-terminated copy for safety
+    char* tmp = (char*)malloc(len + 1);
+    if (!tmp) return;
+
+    memcpy(tmp, str, len);
+    tmp[len] = '\0';
+
+    // Parse different Content-Range formats
+    if (sscanf(tmp, "bytes %lld-%lld/%lld", start_pos, end_pos, all_size) == 3) {
+        *success = true;
+    }
+    else if (sscanf(tmp, "bytes %lld-%lld/*", start_pos, end_pos) == 2) {
+        *success = true;  // Server didn't provide total size
+    }
+
+    free(tmp);
+}
+
+/** Add a range to `list`, keeping it sorted and merged */
+static bool add_range(range_list_t* list, int64_t start, int64_t end) {
+    if (list->count == list->cap) {
+        int cap = list->cap > 0 ? list->cap * 2 : 16;
+        byte_range_t* items = (byte_range_t*)realloc(list->items, cap * sizeof(byte_range_t));
+        if (items == NULL) return false;
+        list->items = items;
+        list->cap = cap;
+    }
+
+    int i = list->count;
+    while (i > 0 && list->items[i - 1].start > start) {
+        list->items[i] = list->items[i - 1];
+        i--;
+    }
+    list->items[i].start = start;
+    list->items[i].end = end;
+    list->count++;
+
+    // Merge overlapping and adjacent neighbours
+    int n = 0;
+    for (int j = 1; j < list->count; j++) {
+        if (list->items[j].start <= list->items[n].end + 1) {
+            if (list->items[j].end > list->items[n].end) list->items[n].end = list->items[j].end;
+        }
+        else {
+            list->items[++n] = list->items[j];
+        }
+    }
+    list->count = n + 1;
+    return true;
+}
+
+/** Load size, validators and completed ranges of an earlier attempt, returns false if there is none */
+static bool load_journal(download_ctx_t* ctx) {
+    FILE* fp = ctx->journal_path ? fopen(ctx->journal_path, "r") : NULL;
+    if (!fp) return false;
+
+    char line[256];
+    while (fgets(line, sizeof(line), fp)) {
+        long long a = 0, b = 0;
+        line[strcspn(line, "\r\n")] = '\0';
+        if (sscanf(line, "size %lld", &a) == 1) {
+            ctx->journal_size = a;
+        }
+        else if (sscanf(line, "range %lld %lld", &a, &b) == 2 && a >= 0 && b >= a) {
+            add_range(&ctx->done_ranges, a, b);
+        }
+        else if (!strncmp(line, "etag ", 5)) {
+            snprintf(ctx->etag, sizeof(ctx->etag), "%s", line + 5);
+        }
+        else if (!strncmp(line, "modified ", 9)) {
+            snprintf(ctx->last_modified, sizeof(ctx->last_modified), "%s", line + 9);
+        }
+    }
+    fclose(fp);
+
+    if (ctx->journal_size <= 0) {
+        ctx->done_ranges.count = 0;
+        return false;
+    }
+    return true;
+}
+
+/** Open the journal, either appending to the loaded one or starting a new one */
+static bool open_journal(download_ctx_t* ctx, bool append) {
+    ctx->journal = ctx->journal_path ? fopen(ctx->journal_path, append ? "a" : "w") : NULL;
+    if (!ctx->journal) return false;
+    if (!append) {
+        fprintf(ctx->journal, "size %lld\n", ctx->journal_size);
+        if (ctx->etag[0]) fprintf(ctx->journal, "etag %s\n", ctx->etag);
+        if (ctx->last_modified[0]) fprintf(ctx->journal, "modified %s\n", ctx->last_modified);
+        sync_file(ctx->journal);
+    }
+    return true;
+}
+
+/** Remember a range as complete, it is journaled once its data has been synced */
+static void record_done_range(download_ctx_t* ctx, int64_t start, int64_t end) {
+    add_range(&ctx->done_ranges, start, end);
+    if (ctx->journal) add_range(&ctx->unjournaled_ranges, start, end);
+}
+
+/** Flush `fp` and ask the OS to commit it to storage */
+static void sync_file(FILE* fp) {
+    fflush(fp);
+#if MG_ARCH == MG_ARCH_WIN32
+    _commit(_fileno(fp));
+#else
+    fsync(fileno(fp));
+#endif
+}
+
+/** Restart both running hashes from the beginning of the file */
+static void reset_hashes(download_ctx_t* ctx) {
+    mg_sha256_init(&ctx->sha256_ctx);
+    ctx->crc32_value = 0;
+    ctx->hash_offset = 0;
+    ctx->unhashed_ranges.count = 0;
+}
+
+/** Feed the bytes at `hash_offset` to the enabled hashes */
+static void update_hashes(download_ctx_t* ctx, const char* data, size_t len) {
+    if (ctx->verify_sha256) mg_sha256_update(&ctx->sha256_ctx, (const unsigned char*)data, len);
+    if (ctx->verify_crc32) ctx->crc32_value = mg_crc32(ctx->crc32_value, data, len);
+    ctx->hash_offset += (int64_t)len;
+}
+
+/** Hash ranges that were written ahead of `hash_offset` and are now contiguous with it */
+static bool catch_up_hashes(download_ctx_t* ctx) {
+    char buf[4096];
+    while (ctx->unhashed_ranges.count > 0 && ctx->unhashed_ranges.items[0].start <= ctx->hash_offset) {
+        int64_t end = ctx->unhashed_ranges.items[0].end;
+        ctx->unhashed_ranges.count--;
+        memmove(ctx->unhashed_ranges.items, ctx->unhashed_ranges.items + 1, ctx->unhashed_ranges.count * sizeof(byte_range_t));
+
+        while (ctx->hash_offset <= end) {
+            size_t len = end - ctx->hash_offset + 1 < (int64_t)sizeof(buf) ? (size_t)(end - ctx->hash_offset + 1) : sizeof(buf);
+            if (!read_from_file(ctx, ctx->hash_offset, buf, len)) return false;
+            update_hashes(ctx, buf, len);
+        }
+    }
+    return true;
+}
+
+/** Write body bytes to the file and hash them, in-order bytes are hashed straight from `data` */
+static bool store_body_bytes(download_ctx_t* ctx, int64_t pos, const char* data, size_t len) {
+    if (!write_to_file(ctx, pos, data, len)) return false;
+
+    ctx->unsynced_bytes += (int64_t)len;
+    if (sync_interval > 0 && ctx->unsynced_bytes >= sync_interval && !flush_output(ctx)) return false;
+    if (!ctx->verify_sha256 && !ctx->verify_crc32) return true;
+
+    if (pos <= ctx->hash_offset && pos + (int64_t)len > ctx->hash_offset) {
+        size_t skip = (size_t)(ctx->hash_offset - pos);
+        update_hashes(ctx, data + skip, len - skip);
+    }
+    else if (pos > ctx->hash_offset && !add_range(&ctx->unhashed_ranges, pos, pos + len - 1)) {
+        return false;
+    }
+    return catch_up_hashes(ctx);
+}
+
+/** Compare the hashes of the complete file against the expected values */
+static bool verify_download(download_ctx_t* ctx) {
+    if (!catch_up_hashes(ctx)) return false;
+    int64_t size = ctx->all_size > 0 ? ctx->all_size : ctx->downloaded;
+    if (ctx->hash_offset != size) {
+        printf("\nVerification incomplete, hashed %lld of %lld bytes\n", ctx->hash_offset, size);
+        return false;
+    }
+
+    bool ok = true;
+    if (ctx->verify_sha256) {
+        unsigned char digest[32];
+        mg_sha256_final(digest, &ctx->sha256_ctx);
+        if (memcmp(digest, ctx->expected_sha256, sizeof(digest)) != 0) {
+            printf("\nSHA-256 mismatch, got ");
+            for (size_t i = 0; i < sizeof(digest); i++) printf("%02x", digest[i]);
+            printf("\n");
+            ok = false;
+        }
+    }
+    if (ctx->verify_crc32 && ctx->crc32_value != ctx->expected_crc32) {
+        printf("\nCRC32 mismatch, expected %08x, got %08x\n", ctx->expected_crc32, ctx->crc32_value);
+        ok = false;
+    }
+    if (ok) printf("\nIntegrity check passed\n");
+    return ok;
+}
+
+/** Decode `len` bytes from exactly `len * 2` hex digits */
+static bool parse_hex(const char* str, unsigned char* out, size_t len) {
+    if (str == NULL || strlen(str) != len * 2) return false;
+    for (size_t i = 0; i < len * 2; i++) {
+        char ch = str[i];
+        int v = (ch >= '0' && ch <= '9') ? ch - '0'
+            : (ch >= 'a' && ch <= 'f') ? ch - 'a' + 10
+            : (ch >= 'A' && ch <= 'F') ? ch - 'A' + 10 : -1;
+        if (v < 0) return false;
+        if (i % 2 == 0) out[i / 2] = (unsigned char)(v << 4);
+        else out[i / 2] |= (unsigned char)v;
+    }
+    return true;
+}
+
+/** Parse a CRC32 given as 8 hex digits, optionally prefixed with 0x */
+static bool parse_crc32(const char* str, uint32_t* out) {
+    unsigned char crc[4];
+    if (!strncmp(str, "0x", 2) || !strncmp(str, "0X", 2)) str += 2;
+    if (!parse_hex(str, crc, sizeof(crc))) return false;
+    *out = ((uint32_t)crc[0] << 24) | ((uint32_t)crc[1] << 16) | ((uint32_t)crc[2] << 8) | crc[3];
+    return true;
+}
+
+/**
+ * Preallocate the output to `size` bytes so that running out of space shows up
+ * before the transfer, then map it if -mmap was given
+ */
+static bool prepare_output(download_ctx_t* ctx, int64_t size) {
+    int fd = fileno(ctx->file);
+    release_output_map(ctx);
+
+#if MG_ARCH == MG_ARCH_WIN32
+    if (_chsize_s(fd, size) != 0) {
+        printf("\nFailed to preallocate %lld bytes\n", size);
+        return false;
+    }
+#else
+    bool allocated = false;
+#if defined(__linux__)
+    // Fails on filesystems without extent support instead of writing zeros
+    allocated = fallocate(fd, 0, 0, (off_t)size) == 0;
+#elif defined(_POSIX_ADVISORY_INFO) && _POSIX_ADVISORY_INFO > 0
+    allocated = posix_fallocate(fd, 0, (off_t)size) == 0;
+#endif
+    if (!allocated && ftruncate(fd, (off_t)size) != 0) {
+        printf("\nFailed to preallocate %lld bytes: %s\n", size, strerror(errno));
+        return false;
+    }
+
+    // A store into a hole of a mapping raises SIGBUS once the disk is full,
+    // while pwrite reports the error, so only allocated blocks are mapped
+    if (use_mmap && !allocated) {
+        printf("\nOutput could not be preallocated, using pwrite instead of a mapping\n");
+    }
+    else if (use_mmap) {
+        void* map = mmap(NULL, (size_t)size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (map == MAP_FAILED || (int64_t)(size_t)size != size) {
+            printf("\nFailed to map output file, falling back to pwrite\n");
+        }
+        else {
+            ctx->output_map = (char*)map;
+        }
+    }
+#endif
+    ctx->output_size = size;
+    return true;
+}
+
+/** Unmap the output file if it is mapped */
+static void release_output_map(download_ctx_t* ctx) {
+#if MG_ARCH == MG_ARCH_UNIX
+    if (ctx->output_map) {
+        munmap(ctx->output_map, (size_t)ctx->output_size);
+        ctx->output_map = NULL;
+    }
+#endif
+}
+
+/** Commit written data to storage, then journal the ranges it completed */
+static bool flush_output(download_ctx_t* ctx) {
+    if (!ctx->file || (ctx->unsynced_bytes == 0 && ctx->unjournaled_ranges.count == 0)) return true;
+
+#if MG_ARCH == MG_ARCH_WIN32
+    fflush(ctx->file);
+    bool synced = _commit(_fileno(ctx->file)) == 0;
+#else
+    if (ctx->output_map && msync(ctx->output_map, (size_t)ctx->output_size, MS_SYNC) != 0) {
+        printf("\nFailed to sync mapped output: %s\n", strerror(errno));
+        return false;
+    }
+#if defined(__linux__)
+    bool synced = fdatasync(fileno(ctx->file)) == 0;
+#else
+    bool synced = fsync(fileno(ctx->file)) == 0;
+#endif
+#endif
+    if (!synced) {
+        printf("\nFailed to sync %s\n", ctx->download_path);
+        return false;
+    }
+    ctx->unsynced_bytes = 0;
+
+    if (ctx->journal && ctx->unjournaled_ranges.count > 0) {
+        for (int i = 0; i < ctx->unjournaled_ranges.count; i++) {
+            fprintf(ctx->journal, "range %lld %lld\n", ctx->unjournaled_ranges.items[i].start, ctx->unjournaled_ranges.items[i].end);
+        }
+        sync_file(ctx->journal);
+    }
+    ctx->unjournaled_ranges.count = 0;
+    return true;
+}
+
+/** Read `len` bytes at absolute position `pos` of the output file */
+static bool read_from_file(download_ctx_t* ctx, int64_t pos, char* data, size_t len) {
+    if (ctx->output_map && pos + (int64_t)len <= ctx->output_size) {
+        memcpy(data, ctx->output_map + pos, len);
+        return true;
+    }
+
+#if MG_ARCH == MG_ARCH_WIN32
+    if (_fseeki64(ctx->file, pos, SEEK_SET) != 0 || fread(data, 1, len, ctx->file) != len) {
+        printf("\nRead failed at %lld, %zu bytes\n", pos, len);
+        return false;
+    }
+#else
+    int fd = fileno(ctx->file);
+    while (len > 0) {
+        ssize_t n = pread(fd, data, len, (off_t)pos);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) {
+            printf("\nRead failed at %lld: %s\n", pos, n < 0 ? strerror(errno) : "end of file");
+            return false;
+        }
+        data += n;
+        pos += n;
+        len -= (size_t)n;
+    }
+#endif
+    return true;
+}
+
+/** Write `len` bytes at absolute position `pos` of the output file */
+static bool write_to_file(download_ctx_t* ctx, int64_t pos, const char* data, size_t len) {
+    if (!ctx->file) {
+        printf("\nInvalid file state\n");
+        return false;
+    }
+
+    if (ctx->output_map && pos + (int64_t)len <= ctx->output_size) {
+        memcpy(ctx->output_map + pos, data, len);
+        return true;
+    }
+
+#if MG_ARCH == MG_ARCH_WIN32
+    if (_fseeki64(ctx->file, pos, SEEK_SET) != 0 || fwrite(data, 1, len, ctx->file) != len) {
+        printf("\nWrite failed at %lld, %zu bytes\n", pos, len);
+        return false;
+    }
+#else
+    int fd = fileno(ctx->file);
+    while (len > 0) {
+        ssize_t n = pwrite(fd, data, len, (off_t)pos);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) {
+            printf("\nWrite failed at %lld: %s\n", pos, strerror(errno));
+            return false;
+        }
+        data += n;
+        pos += n;
+        len -= (size_t)n;
+    }
+#endif
+    return true;
+}
+
+/** Release everything owned by `ctx` */
+static void free_download(download_ctx_t* ctx) {
+    release_output_map(ctx);
+
+    if (ctx->url) {
+        free(ctx->url);
+        ctx->url = NULL;
+    }
+
+    if (ctx->download_path) {
+        free(ctx->download_path);
+        ctx->download_path = NULL;
+    }
+
+    if (ctx->journal) {
+        fclose(ctx->journal);
+        ctx->journal = NULL;
+    }
+
+    if (ctx->journal_path) {
+        free(ctx->journal_path);
+        ctx->journal_path = NULL;
+    }
+
+    if (ctx->done_ranges.items) {
+        free(ctx->done_ranges.items);
+        memset(&ctx->done_ranges, 0, sizeof(ctx->done_ranges));
+    }
+
+    if (ctx->unhashed_ranges.items) {
+        free(ctx->unhashed_ranges.items);
+        memset(&ctx->unhashed_ranges, 0, sizeof(ctx->unhashed_ranges));
+    }
+
+    if (ctx->unjournaled_ranges.items) {
+        free(ctx->unjournaled_ranges.items);
+        memset(&ctx->unjournaled_ranges, 0, sizeof(ctx->unjournaled_ranges));
+    }
+
+    if (ctx->segments) {
+        free(ctx->segments);
+        ctx->segments = NULL;
+    }
+
+    if (ctx->decoder) {
+        free(ctx->decoder);
+        ctx->decoder = NULL;
     }
 
-    if (file) {
-        fclose(file);
-        file = NULL;
+    if (ctx->file) {
+        fclose(ctx->file);
+        ctx->file = NULL;
     }
 }
 
@@ -340,9 +2219,28 @@ static void cleanup_resources() {
 static void print_http_download_usage() {
     printf("HTTP Download Tool\n");
     printf("Usage:\n");
-    printf("  -u <url>       Download URL (required)\n");
-    printf("  -p <path>      Output file path (required)\n");
+    printf("  -u <url>       Download URL (required unless -m is given)\n");
+    printf("  -p <path>      Output file path (required unless -m is given)\n");
+    printf("  -m <file>      Batch manifest, one \"<url> <path> [sha256=<hex>] [crc32=<hex>]\" per line\n");
+    printf("  -rate <bytes>  Limit the bandwidth of all downloads to bytes per second (default: 0, no limit)\n");
+    printf("  -metrics <ms>  Print download metrics as JSON at this interval\n");
+    printf("  -c <n>         Connections open at once over all downloads (default: 0, no limit)\n");
+    printf("  -hc <n>        Connections open at once to one host (default: 0, no limit)\n");
     printf("  -t <timeout>   Connection timeout in ms (default: 10000)\n");
     printf("  -s <size>      Chunk size in bytes (default: 1048576)\n");
+    printf("  -j <jobs>      Range requests in flight at once (default: 1)\n");
+    printf("  -retries <n>   Retries per range (default: 3)\n");
+    printf("  -backoff <ms>  First retry delay, doubled on each retry with jitter (default: 1000)\n");
+    printf("  -k             Keep connections alive and reuse them for successive ranges\n");
+    printf("  -stream        Write data to disk as it arrives, chunk size no longer limits memory\n");
+    printf("  -r             Resume an interrupted download, progress is kept in <path>.journal\n");
+    printf("  -adaptive      Resize chunks from measured throughput and latency\n");
+    printf("  -mmap          Write into a shared mapping of the preallocated file\n");
+    printf("  -gzip          Accept gzip/deflate encoded responses and inflate them, implies -stream and -j 1\n");
+    printf("  -sync <bytes>  Sync data to storage after this many bytes (default: 0, only at the end)\n");
+    printf("  -sha256 <hex>  Verify the downloaded file against this SHA-256\n");
+    printf("  -crc32 <hex>   Verify the downloaded file against this CRC32\n");
+    printf("  -smin <size>   Adaptive minimum chunk size in bytes (default: 65536)\n");
+    printf("  -smax <size>   Adaptive maximum chunk size in bytes (default: 8388608)\n");
     printf("  -h             Show this help\n");
 }
@@ -7,7 +7,58 @@
 #include <stdlib.h>
 #include "util.h"
 
+#define HTTP_DOWNLOAD_LATENCY_BUCKETS 16
+
+/** Snapshot of the metrics of one download, see http_download_set_metrics_callback */
+typedef struct http_download_metrics {
+    const char* url;
+    const char* path;
+    bool finished;                // Last report of this download
+    bool success;                 // Download completed and verified, valid once finished
+    int64_t downloaded;           // Bytes written to the file
+    int64_t total;                // Size of the file, 0 while unknown
+    int64_t received;             // Bytes read from the network, headers included
+    uint64_t elapsed_ms;          // Time since the download started
+    int64_t rate_1s;              // Received bytes per second over the last second
+    int64_t rate_10s;             // ... over the last 10 seconds
+    int64_t rate_60s;             // ... over the last minute
+    int64_t rate_avg;             // ... since the download started
+    int requests;                 // Requests sent
+    int connections;              // Connections opened, the other requests reused one
+    int retries;                  // Failed requests that were retried
+    int network_errors;           // Failed requests: reset, timeout or invalid response
+    int dns_errors;               // Failed requests: name resolution
+    int server_errors;            // Failed requests: 5xx, 408 or 429
+    uint64_t ttfb_first_ms;       // Time to first byte of the first request
+    uint64_t ttfb_avg_ms;         // Time to first byte averaged over all requests
+    uint64_t ttfb_max_ms;
+    uint64_t dns_avg_ms;          // Connection phases, averaged over the connections that went through them
+    uint64_t connect_avg_ms;      // TCP handshake
+    uint64_t tls_avg_ms;          // TLS handshake, 0 for plain HTTP
+    // Completed requests by time from sending to the last byte: bucket 0 is below 1ms,
+    // bucket i covers [2^(i-1), 2^i) ms and the last one everything above
+    uint32_t chunk_latency[HTTP_DOWNLOAD_LATENCY_BUCKETS];
+} http_download_metrics_t;
+
+/** Receives a metrics snapshot, called from the thread that runs the download */
+typedef void (*http_download_metrics_fn)(const http_download_metrics_t* metrics, void* arg);
+
 /** Main entry point */
 extern int http_download_main(int argc, char* argv[]);
 
+/**
+ * Limit the bandwidth of all downloads to `bytes_per_sec`, 0 removes the limit.
+ * Safe to call from another thread while a download runs, e.g. to make room for a live stream.
+ */
+extern void http_download_set_rate_limit(long bytes_per_sec);
+
+/**
+ * Report the metrics of every download to `fn` each `interval_ms`, and once more when it finishes.
+ * NULL removes the callback. Set it before http_download_main is called.
+ */
+extern void http_download_set_metrics_callback(http_download_metrics_fn fn, void* arg, uint64_t interval_ms);
+
+/** Format `metrics` as a JSON object, returns a string to be freed with free(), NULL if out of memory */
+extern char* http_download_metrics_json(const http_download_metrics_t* metrics);
+
 #endif // PROTO_HTTP_DOWNLOAD_H
\ No newline at end of file
@@ -0,0 +1,1069 @@
+#include "http_file_upload.h"
+#include "deflate_stream.h"
+
+// Plain HTTP bodies go from the file to the socket with sendfile(2), without passing through user space
+#if MG_ARCH == MG_ARCH_UNIX && defined(__linux__)
+#include <sys/sendfile.h>
+#define UPLOAD_SENDFILE 1
+#else
+#define UPLOAD_SENDFILE 0
+#endif
+
+static const char* s_url = null; // URL to upload file to, set by -u
+static const char* s_file_path = null; // Path to the file to upload, set by -p
+static const char* s_method = "PUT"; // Request method of every piece, set by -m
+static uint64_t s_timeout_ms = 10000; // Timeout in milliseconds for connection, default is 10 seconds, set by -t
+static uint64_t s_transfer_timeout_ms = 30000; // Timeout in milliseconds without any progress once connected
+static int64_t max_upload_size_per_piece = 1 * 1024 * 1024; // Maximum size of each upload piece in bytes, default is 1MB, set by -s
+static int max_retries = 3; // Retries per piece, set by -retries
+static uint64_t retry_base_ms = 1000; // First retry delay, doubled on every retry
+static const uint64_t retry_max_ms = 60000; // Retry delay cap
+static int max_parallel_jobs = 1; // Pieces uploaded at once, set by -j
+static const char* s_complete_url = null; // Receives the part list once every piece is uploaded, set by -complete
+static bool s_tus = false; // Resumable tus upload instead of Content-Range pieces, set by -protocol tus
+static const char* s_checkpoint_path = null; // Sidecar file of a tus upload, set by -checkpoint, <file_path>.upload by default
+static int s_compress = -1; // DEFLATE_FORMAT_* every piece is compressed with, -1 for none, set by -compress
+
+// Body bytes are read from the file only when the send buffer runs low,
+// so memory use does not depend on the piece size
+#define UPLOAD_READ_SIZE 16384   // Bytes read from the file at once
+#define UPLOAD_SEND_WINDOW 32768 // Body bytes queued in the send buffer at most
+#define UPLOAD_SENDFILE_SIZE 262144 // Bytes passed to sendfile per write event at most
+
+// Upload states
+#define UPLOAD_RUNNING 0
+#define UPLOAD_SUCCESS 1
+#define UPLOAD_ERROR   2
+
+// Part states, the complete request goes through the same states
+#define PART_PENDING 0 // Request for the part not sent yet
+#define PART_SENDING 1 // Request in flight, body being streamed
+#define PART_WAITING 2 // Failed, retried once `retry_at_ms` is reached
+#define PART_DONE    3 // Accepted by the server
+
+// Requests of a tus upload, see https://tus.io/protocols/resumable-upload
+#define TUS_CREATE 0 // POST to the -u endpoint, the server answers with the upload URL
+#define TUS_PROBE  1 // HEAD on the upload URL, the server answers with the committed Upload-Offset
+#define TUS_PATCH  2 // PATCH of the next piece at Upload-Offset
+
+/** One piece of the file, uploaded with its own request */
+typedef struct {
+	int64_t start;                // First byte of the part
+	int64_t end;                  // Last byte of the part (inclusive), start - 1 for an empty file
+	int state;                    // PART_* value
+	int retry_count;              // Failed attempts of the part
+	uint64_t retry_at_ms;         // mg_millis() when a failed part is sent again
+	uint32_t crc32;               // CRC32 of the part as sent, so after compression, complete once it is sent
+	int64_t encoded_size;         // Bytes of the part after compression
+	char etag[80];                // ETag the server answered the part with, empty if none
+} upload_part_t;
+
+struct upload_ctx;
+
+/** Connection slot, up to `jobs` of them upload a part each at once */
+typedef struct {
+	struct upload_ctx* ctx;       // Upload the slot belongs to
+	int part;                     // Index of the part being uploaded, -1 if none
+	int64_t sent;                 // Body bytes of the part queued for sending
+	struct mg_connection* conn;   // Connection of the slot, kept for the next part if the server allows
+	deflate_stream_t* deflater;   // Compressor of the part body, only with -compress
+	bool body_done;               // Last chunk of a compressed body queued
+} upload_slot_t;
+
+/** State of one file upload */
+typedef struct upload_ctx {
+	int state;                    // UPLOAD_* value
+	FILE* file;
+	int64_t all_size;             // Total size of the file to upload, in bytes
+	int64_t uploaded;             // Bytes the server accepted so far
+	char upload_id[33];           // Random id sent with every part, tells the server which parts belong together
+
+	upload_part_t* parts;
+	int part_count;
+	int parts_done;
+	upload_slot_t* slots;
+	int jobs;
+
+	// Final request listing the parts, only with -complete
+	upload_part_t complete;       // Only state, retry_count and retry_at_ms are used
+	struct mg_connection* complete_conn;
+	struct mg_iobuf complete_body;
+
+	// tus upload, only with -protocol tus. `uploaded` is the offset the server committed,
+	// and parts[0] is reused for the range of the current PATCH
+	int tus_step;                 // TUS_* value, the next request of the slot
+	char tus_url[512];            // Upload URL created by the server, empty before TUS_CREATE succeeded
+	char checkpoint_path[512];    // Sidecar file keeping `tus_url` across process restarts
+	int64_t mtime;                // Modification time of the file, a changed file is not resumed
+} upload_ctx_t;
+
+static upload_ctx_t s_upload;
+static char compress_buffer[UPLOAD_READ_SIZE]; // File bytes on their way into a deflater
+
+
+static void print_file_upload_usage();
+static bool open_upload_file(upload_ctx_t* ctx);
+static bool prepare_upload(upload_ctx_t* ctx);
+static void schedule_upload(upload_ctx_t* ctx, struct mg_mgr* mgr);
+static bool retry_due(upload_part_t* part);
+static const char* piece_url(upload_ctx_t* ctx);
+static void send_piece_request(struct mg_connection* c, upload_slot_t* slot);
+static bool fill_piece_body(struct mg_connection* c, upload_slot_t* slot);
+static bool compress_piece_body(struct mg_connection* c, upload_slot_t* slot);
+static bool send_compressed_chunk(const char* data, size_t len, void* arg);
+#if UPLOAD_SENDFILE
+static bool sendfile_piece_body(struct mg_connection* c, upload_slot_t* slot);
+#endif
+static bool read_upload_file(upload_ctx_t* ctx, int64_t pos, char* data, size_t len);
+static void fail_piece(upload_slot_t* slot, struct mg_connection* c);
+static bool retry_part(upload_ctx_t* ctx, upload_part_t* part, const char* what);
+static void send_complete_request(struct mg_connection* c, upload_ctx_t* ctx);
+static void free_upload(upload_ctx_t* ctx);
+static void http_upload_callback_fn(struct mg_connection* c, int ev, void* ev_data);
+static void http_complete_callback_fn(struct mg_connection* c, int ev, void* ev_data);
+static void schedule_tus_upload(upload_ctx_t* ctx, struct mg_mgr* mgr);
+static void send_tus_request(struct mg_connection* c, upload_slot_t* slot);
+static void handle_tus_response(struct mg_connection* c, upload_slot_t* slot, struct mg_http_message* hm);
+static bool resolve_tus_url(upload_ctx_t* ctx, struct mg_str location);
+static void load_tus_checkpoint(upload_ctx_t* ctx);
+static void save_tus_checkpoint(upload_ctx_t* ctx);
+
+int http_file_upload_main(int argc, char* argv[]) {
+	for (int i = 1; i < argc; i++) {
+		if (!strcmp("-h", argv[i]) || !strcmp("-help", argv[i]) || !strcmp("-?", argv[i])) {
+			print_file_upload_usage();
+			return 0;
+		}
+		else if (i + 1 >= argc) {
+			// Every option below takes a value
+			printf("Missing value for option: %s\n", argv[i]);
+			print_file_upload_usage();
+			return 1;
+		}
+		else if (!strcmp("-u", argv[i])) {
+			s_url = argv[++i];
+		}
+		else if (!strcmp("-p", argv[i])) {
+			s_file_path = argv[++i];
+		}
+		else if (!strcmp("-m", argv[i])) {
+			s_method = argv[++i];
+			if (strcmp(s_method, "PUT") && strcmp(s_method, "POST")) {
+				printf("Invalid method: must be PUT or POST, but received: %s\n", s_method);
+				return 1;
+			}
+		}
+		else if (!strcmp("-t", argv[i])) {
+			const char* value = argv[++i];
+			bool success = false;
+			s_timeout_ms = string_to_long(value, strlen(value), &success);
+			if (!success || s_timeout_ms <= 0) {
+				printf("Invalid timeout value: must be an integer and bigger than 0, but received: %s\n", value);
+				return 1;
+			}
+		}
+		else if (!strcmp("-s", argv[i])) {
+			const char* value = argv[++i];
+			bool success = false;
+			max_upload_size_per_piece = string_to_long(value, strlen(value), &success);
+			if (!success || max_upload_size_per_piece <= 0) {
+				printf("Invalid size value: must be an integer and bigger than 0, but received: %s\n", value);
+				return 1;
+			}
+		}
+		else if (!strcmp("-j", argv[i])) {
+			const char* value = argv[++i];
+			bool success = false;
+			max_parallel_jobs = (int)string_to_long(value, strlen(value), &success);
+			if (!success || max_parallel_jobs <= 0) {
+				printf("Invalid jobs value: must be an integer and bigger than 0, but received: %s\n", value);
+				return 1;
+			}
+		}
+		else if (!strcmp("-complete", argv[i])) {
+			s_complete_url = argv[++i];
+		}
+		else if (!strcmp("-protocol", argv[i])) {
+			const char* value = argv[++i];
+			if (!strcmp(value, "tus")) {
+				s_tus = true;
+			}
+			else if (!strcmp(value, "range")) {
+				s_tus = false;
+			}
+			else {
+				printf("Invalid protocol: must be range or tus, but received: %s\n", value);
+				return 1;
+			}
+		}
+		else if (!strcmp("-compress", argv[i])) {
+			const char* value = argv[++i];
+			if (!strcmp(value, "gzip")) {
+				s_compress = DEFLATE_FORMAT_GZIP;
+			}
+			else if (!strcmp(value, "deflate")) {
+				s_compress = DEFLATE_FORMAT_ZLIB;
+			}
+			else {
+				printf("Invalid compression: must be gzip or deflate, but received: %s\n", value);
+				return 1;
+			}
+		}
+		else if (!strcmp("-checkpoint", argv[i])) {
+			s_checkpoint_path = argv[++i];
+		}
+		else if (!strcmp("-retries", argv[i])) {
+			const char* value = argv[++i];
+			bool success = false;
+			max_retries = (int)string_to_long(value, strlen(value), &success);
+			if (!success || max_retries < 0) {
+				printf("Invalid retries value: must be a non-negative integer, but received: %s\n", value);
+				return 1;
+			}
+		}
+		else {
+			printf("Unknown option: %s\n", argv[i]);
+			print_file_upload_usage();
+			return 1;
+		}
+	}
+
+	if (s_url == null || s_file_path == null) {
+		printf("URL or file path is not set.\n");
+		print_file_upload_usage();
+		return 1;
+	}
+	if (s_tus && s_complete_url != null) {
+		printf("-complete cannot be used with -protocol tus, the server completes the upload by itself.\n");
+		return 1;
+	}
+	if (s_tus && s_compress >= 0) {
+		printf("-compress cannot be used with -protocol tus, Upload-Offset counts the bytes sent.\n");
+		return 1;
+	}
+
+	upload_ctx_t* ctx = &s_upload;
+	memset(ctx, 0, sizeof(*ctx));
+	if (!open_upload_file(ctx) || !prepare_upload(ctx)) {
+		free_upload(ctx);
+		return 1;
+	}
+	if (s_tus) {
+		load_tus_checkpoint(ctx);
+		printf("ready to upload file: %s, %lld bytes, checkpoint %s\n", s_file_path, ctx->all_size, ctx->checkpoint_path);
+	}
+	else {
+		printf("ready to upload file: %s, %lld bytes in %d parts, upload id %s\n", s_file_path, ctx->all_size, ctx->part_count, ctx->upload_id);
+	}
+
+	struct mg_mgr mgr;
+	mg_mgr_init(&mgr);
+
+	while (ctx->state == UPLOAD_RUNNING) {
+		schedule_upload(ctx, &mgr);
+		if (ctx->state != UPLOAD_RUNNING) break;
+		mg_mgr_poll(&mgr, 100);
+
+		int64_t sent = ctx->uploaded;
+		for (int i = 0; i < ctx->jobs; i++) sent += ctx->slots[i].sent;
+		printf("Progress: %.1f%%\r", ctx->all_size > 0 ? (double)sent / ctx->all_size * 100 : 0.0);
+		fflush(stdout);
+	}
+
+	for (int i = 0; i < ctx->jobs; i++) {
+		if (ctx->slots[i].conn != null) {
+			ctx->slots[i].conn->is_draining = 1;
+			ctx->slots[i].conn = (struct mg_connection*)null;
+		}
+	}
+	if (ctx->complete_conn != null) {
+		ctx->complete_conn->is_closing = 1;
+		ctx->complete_conn = (struct mg_connection*)null;
+	}
+	mg_mgr_free(&mgr);
+
+	int ret = 0;
+	if (ctx->state != UPLOAD_SUCCESS) {
+		printf("\nUpload failed: %s, uploaded: %lld of %lld bytes\n", s_file_path, ctx->uploaded, ctx->all_size);
+		ret = 1;
+	}
+	else if (s_compress >= 0) {
+		int64_t encoded = 0;
+		for (int i = 0; i < ctx->part_count; i++) encoded += ctx->parts[i].encoded_size;
+		printf("\nFile uploaded successfully, uploaded: %lld bytes, %lld bytes compressed.\n", ctx->uploaded, encoded);
+	}
+	else {
+		printf("\nFile uploaded successfully, uploaded: %lld bytes.\n", ctx->uploaded);
+	}
+	free_upload(ctx);
+	return ret;
+}
+
+/** Open the source file for reading and get its size */
+static bool open_upload_file(upload_ctx_t* ctx) {
+	ctx->file = fopen(s_file_path, "rb");
+	if (!ctx->file) {
+		printf("Failed to open file for reading: %s\n", s_file_path);
+		return false;
+	}
+#if MG_ARCH == MG_ARCH_WIN32
+	struct _stat64 st;
+	if (_fstat64(_fileno(ctx->file), &st) != 0) {
+#else
+	struct stat st;
+	if (fstat(fileno(ctx->file), &st) != 0) {
+#endif
+		printf("Failed to get the size of file: %s\n", s_file_path);
+		fclose(ctx->file);
+		ctx->file = (FILE*)null;
+		return false;
+	}
+	ctx->all_size = (int64_t)st.st_size;
+	ctx->mtime = (int64_t)st.st_mtime;
+	return true;
+}
+
+/** Split the file into parts and allocate the connection slots */
+static bool prepare_upload(upload_ctx_t* ctx) {
+	// An empty file is still sent once, as one empty part, so that it exists on the server.
+	// A tus upload sends one piece after the other from the committed offset, in parts[0]
+	int64_t count = ctx->all_size > 0 && !s_tus ? (ctx->all_size + max_upload_size_per_piece - 1) / max_upload_size_per_piece : 1;
+	if (count > INT_MAX) {
+		printf("Too many parts, increase the piece size\n");
+		return false;
+	}
+	ctx->part_count = (int)count;
+	ctx->parts = (upload_part_t*)calloc(ctx->part_count, sizeof(upload_part_t));
+	ctx->jobs = max_parallel_jobs < ctx->part_count ? max_parallel_jobs : ctx->part_count;
+	ctx->slots = (upload_slot_t*)calloc(ctx->jobs, sizeof(upload_slot_t));
+	if (ctx->parts == null || ctx->slots == null) {
+		printf("Failed to allocate upload parts\n");
+		return false;
+	}
+	for (int i = 0; i < ctx->part_count; i++) {
+		ctx->parts[i].start = (int64_t)i * max_upload_size_per_piece;
+		ctx->parts[i].end = ctx->parts[i].start + max_upload_size_per_piece - 1;
+		if (ctx->parts[i].end >= ctx->all_size) ctx->parts[i].end = ctx->all_size - 1;
+	}
+	for (int i = 0; i < ctx->jobs; i++) {
+		ctx->slots[i].ctx = ctx;
+		ctx->slots[i].part = -1;
+		if (s_compress < 0) continue;
+		ctx->slots[i].deflater = (deflate_stream_t*)malloc(sizeof(deflate_stream_t));
+		if (ctx->slots[i].deflater == null) {
+			printf("Failed to allocate the compressor\n");
+			return false;
+		}
+	}
+
+	unsigned char id[16];
+	mg_random(id, sizeof(id));
+	for (size_t i = 0; i < sizeof(id); i++) {
+		mg_snprintf(ctx->upload_id + i * 2, 3, "%02x", id[i]);
+	}
+	return true;
+}
+
+/** Start due parts on free slots, then the complete request once every part is done */
+static void schedule_upload(upload_ctx_t* ctx, struct mg_mgr* mgr) {
+	if (s_tus) {
+		schedule_tus_upload(ctx, mgr);
+		return;
+	}
+
+	int next = 0;
+	for (int i = 0; i < ctx->jobs; i++) {
+		upload_slot_t* slot = &ctx->slots[i];
+		if (slot->part >= 0) continue;
+
+		// Parts are started in file order, a failed one once its backoff is over
+		while (next < ctx->part_count && !(ctx->parts[next].state == PART_PENDING ||
+			(ctx->parts[next].state == PART_WAITING && retry_due(&ctx->parts[next])))) {
+			next++;
+		}
+		if (next == ctx->part_count) {
+			if (slot->conn != null) {
+				// Nothing left for this slot, release its kept connection
+				slot->conn->is_draining = 1;
+				slot->conn = (struct mg_connection*)null;
+			}
+			continue;
+		}
+
+		slot->part = next;
+		slot->sent = 0;
+		ctx->parts[next].state = PART_SENDING;
+		next++;
+		if (slot->conn != null) {
+			send_piece_request(slot->conn, slot);
+			continue;
+		}
+		slot->conn = mg_http_connect(mgr, s_url, http_upload_callback_fn, slot);
+		if (slot->conn == null) {
+			printf("\nFailed to connect to %s\n", s_url);
+			fail_piece(slot, (struct mg_connection*)null);
+		}
+	}
+
+	if (ctx->state != UPLOAD_RUNNING || ctx->parts_done < ctx->part_count) return;
+	if (s_complete_url == null || ctx->complete.state == PART_DONE) {
+		ctx->state = UPLOAD_SUCCESS;
+		return;
+	}
+	if (ctx->complete.state == PART_PENDING || (ctx->complete.state == PART_WAITING && retry_due(&ctx->complete))) {
+		ctx->complete.state = PART_SENDING;
+		ctx->complete_conn = mg_http_connect(mgr, s_complete_url, http_complete_callback_fn, ctx);
+		if (ctx->complete_conn == null) {
+			printf("\nFailed to connect to %s\n", s_complete_url);
+			retry_part(ctx, &ctx->complete, "complete request");
+		}
+	}
+}
+
+/** Check the backoff of a failed part is over */
+static bool retry_due(upload_part_t* part) {
+	return mg_millis() >= part->retry_at_ms;
+}
+
+/** URL the piece connections of `ctx` are made to */
+static const char* piece_url(upload_ctx_t* ctx) {
+	return s_tus && ctx->tus_step != TUS_CREATE ? ctx->tus_url : s_url;
+}
+
+/** Send the request headers of the part of `slot`, the body follows as the send buffer drains */
+static void send_piece_request(struct mg_connection* c, upload_slot_t* slot) {
+	upload_ctx_t* ctx = slot->ctx;
+	upload_part_t* part = &ctx->parts[slot->part];
+	struct mg_str host = mg_url_host(s_url);
+	if (s_tus) {
+		send_tus_request(c, slot);
+		return;
+	}
+	*(uint64_t*)c->data = mg_millis() + s_transfer_timeout_ms;
+	part->crc32 = 0;
+	part->encoded_size = 0;
+	// Part number and upload id let the server assemble parts that arrive in any order
+	mg_printf(c,
+		"%s %s HTTP/1.1\r\n"
+		"Host: %.*s\r\n"
+		"Content-Type: application/octet-stream\r\n"
+		"X-Upload-Id: %s\r\n"
+		"X-Part-Number: %d\r\n",
+		s_method, mg_url_uri(s_url), (int)host.len, host.buf, ctx->upload_id, slot->part + 1);
+	if (slot->deflater != null) {
+		// The compressed size is only known at the end, so the body is chunked,
+		// and its CRC32 follows in the trailer
+		deflate_stream_init(slot->deflater, s_compress);
+		slot->body_done = false;
+		mg_printf(c,
+			"Content-Encoding: %s\r\n"
+			"Transfer-Encoding: chunked\r\n"
+			"Trailer: X-Content-CRC32\r\n",
+			s_compress == DEFLATE_FORMAT_GZIP ? "gzip" : "deflate");
+	}
+	else {
+		mg_printf(c, "Content-Length: %lld\r\n", part->end - part->start + 1);
+	}
+	if (ctx->all_size > 0) {
+		mg_printf(c, "Content-Range: bytes %lld-%lld/%lld\r\n", part->start, part->end, ctx->all_size);
+	}
+	else {
+		mg_printf(c, "Content-Range: bytes */0\r\n");
+	}
+	mg_printf(c, "\r\n");
+	if (!fill_piece_body(c, slot)) {
+		fail_piece(slot, c);
+	}
+}
+
+/** Queue body bytes of the part of `slot` until the send window is full, returns false on read failure */
+static bool fill_piece_body(struct mg_connection* c, upload_slot_t* slot) {
+	upload_ctx_t* ctx = slot->ctx;
+	upload_part_t* part = &ctx->parts[slot->part];
+	int64_t len = part->end - part->start + 1;
+	if (slot->deflater != null) return compress_piece_body(c, slot);
+#if UPLOAD_SENDFILE
+	// The part CRC32 needs the bytes in user space, so the zero copy path is only taken without -complete.
+	// Nor over TLS, where the bytes must be encrypted
+	if (!mg_url_is_ssl(piece_url(ctx)) && s_complete_url == null) return sendfile_piece_body(c, slot);
+#endif
+	while (slot->sent < len && c->send.len < UPLOAD_SEND_WINDOW) {
+		size_t n = UPLOAD_READ_SIZE;
+		if ((int64_t)n > len - slot->sent) n = (size_t)(len - slot->sent);
+		// Read straight into the send buffer, it stops growing once it holds a full window
+		if (c->send.size < c->send.len + n && !mg_iobuf_resize(&c->send, c->send.len + n)) {
+			printf("\nOut of memory for the send buffer\n");
+			return false;
+		}
+		if (!read_upload_file(ctx, part->start + slot->sent, (char*)c->send.buf + c->send.len, n)) return false;
+		part->crc32 = mg_crc32(part->crc32, (char*)c->send.buf + c->send.len, n);
+		c->send.len += n;
+		slot->sent += (int64_t)n;
+		part->encoded_size += (int64_t)n;
+	}
+	return true;
+}
+
+/** Compress file bytes of the part of `slot` into body chunks until the send window is full */
+static bool compress_piece_body(struct mg_connection* c, upload_slot_t* slot) {
+	upload_ctx_t* ctx = slot->ctx;
+	upload_part_t* part = &ctx->parts[slot->part];
+	int64_t len = part->end - part->start + 1;
+	while (!slot->body_done && c->send.len < UPLOAD_SEND_WINDOW) {
+		size_t n = sizeof(compress_buffer);
+		if ((int64_t)n > len - slot->sent) n = (size_t)(len - slot->sent);
+		if (n > 0 && !read_upload_file(ctx, part->start + slot->sent, compress_buffer, n)) return false;
+		slot->sent += (int64_t)n;
+		bool last = slot->sent == len;
+		if (deflate_stream_feed(slot->deflater, compress_buffer, n, last, send_compressed_chunk, slot) != DEFLATE_OK) {
+			printf("\nCompression of part %d failed\n", slot->part + 1);
+			return false;
+		}
+		if (last) {
+			mg_printf(c, "0\r\nX-Content-CRC32: %08lx\r\n\r\n", (unsigned long)part->crc32);
+			slot->body_done = true;
+		}
+	}
+	return true;
+}
+
+/** Send compressor output of a part as one body chunk */
+static bool send_compressed_chunk(const char* data, size_t len, void* arg) {
+	upload_slot_t* slot = (upload_slot_t*)arg;
+	upload_part_t* part = &slot->ctx->parts[slot->part];
+	part->crc32 = mg_crc32(part->crc32, data, len);
+	part->encoded_size += (int64_t)len;
+	mg_http_write_chunk(slot->conn, data, len);
+	return true;
+}
+
+#if UPLOAD_SENDFILE
+/** Pass body bytes of the part of `slot` from the file to the socket with sendfile, returns false on failure */
+static bool sendfile_piece_body(struct mg_connection* c, upload_slot_t* slot) {
+	upload_ctx_t* ctx = slot->ctx;
+	upload_part_t* part = &ctx->parts[slot->part];
+	int64_t len = part->end - part->start + 1;
+	size_t budget = UPLOAD_SENDFILE_SIZE;
+	if (c->send.len > 0) return true; // Headers must leave first, MG_EV_WRITE comes back once they did
+
+	while (slot->sent < len && budget > 0) {
+		off_t offset = (off_t)(part->start + slot->sent);
+		size_t n = budget;
+		if ((int64_t)n > len - slot->sent) n = (size_t)(len - slot->sent);
+		ssize_t r = sendfile((int)(size_t)c->fd, fileno(ctx->file), &offset, n);
+		if (r < 0 && errno == EINTR) continue;
+		if (r < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) break;
+		if (r <= 0) {
+			printf("\nsendfile failed at %lld: %s\n", part->start + slot->sent, r < 0 ? strerror(errno) : "end of file");
+			return false;
+		}
+		slot->sent += (int64_t)r;
+		part->encoded_size += (int64_t)r;
+		budget -= (size_t)r;
+	}
+	if (slot->sent < len) {
+		// mongoose only polls a socket for writing while its send buffer holds data,
+		// so the next body byte is queued to get MG_EV_WRITE once the socket drains
+		char next;
+		if (!read_upload_file(ctx, part->start + slot->sent, &next, 1)) return false;
+		mg_send(c, &next, 1);
+		slot->sent++;
+		part->encoded_size++;
+	}
+	return true;
+}
+#endif
+
+/** Read `len` bytes at absolute position `pos` of the source file */
+static bool read_upload_file(upload_ctx_t* ctx, int64_t pos, char* data, size_t len) {
+#if MG_ARCH == MG_ARCH_WIN32
+	if (_fseeki64(ctx->file, pos, SEEK_SET) != 0 || fread(data, 1, len, ctx->file) != len) {
+		printf("\nRead failed at %lld, %zu bytes\n", pos, len);
+		return false;
+	}
+#else
+	int fd = fileno(ctx->file);
+	while (len > 0) {
+		ssize_t n = pread(fd, data, len, (off_t)pos);
+		if (n < 0 && errno == EINTR) continue;
+		if (n <= 0) {
+			printf("\nRead failed at %lld: %s\n", pos, n < 0 ? strerror(errno) : "end of file");
+			return false;
+		}
+		data += n;
+		pos += n;
+		len -= (size_t)n;
+	}
+#endif
+	return true;
+}
+
+/** Drop the connection of a failed part and schedule its retry, or fail the upload */
+static void fail_piece(upload_slot_t* slot, struct mg_connection* c) {
+	upload_ctx_t* ctx = slot->ctx;
+	upload_part_t* part = &ctx->parts[slot->part];
+	if (c != null) c->is_closing = 1;
+	slot->conn = (struct mg_connection*)null;
+	slot->part = -1;
+	slot->sent = 0;
+	// What the server kept of a failed PATCH is unknown, ask before sending more
+	if (s_tus && ctx->tus_url[0]) ctx->tus_step = TUS_PROBE;
+
+	char what[64];
+	if (s_tus) {
+		mg_snprintf(what, sizeof(what), "piece at %lld", ctx->uploaded);
+	}
+	else {
+		mg_snprintf(what, sizeof(what), "part %d", (int)(part - ctx->parts) + 1);
+	}
+	retry_part(ctx, part, what);
+}
+
+/** Schedule the retry of a failed request, returns false and fails the upload once the retries are used up */
+static bool retry_part(upload_ctx_t* ctx, upload_part_t* part, const char* what) {
+	if (part->retry_count++ >= max_retries) {
+		printf("\nUpload of %s failed after %d retries\n", what, max_retries);
+		ctx->state = UPLOAD_ERROR;
+		return false;
+	}
+	uint64_t delay = retry_base_ms;
+	for (int i = 1; i < part->retry_count && delay < retry_max_ms; i++) delay *= 2;
+	if (delay > retry_max_ms) delay = retry_max_ms;
+	printf("\nRetrying %s in %llu ms (%d/%d)...\n", what, delay, part->retry_count, max_retries);
+	part->retry_at_ms = mg_millis() + delay;
+	part->state = PART_WAITING;
+	return true;
+}
+
+/** Send the part list as JSON, with the size, offset and CRC32 of every part */
+static void send_complete_request(struct mg_connection* c, upload_ctx_t* ctx) {
+	struct mg_iobuf* body = &ctx->complete_body;
+	struct mg_str host = mg_url_host(s_complete_url);
+	body->len = 0;
+	body->align = 256;
+	mg_xprintf(mg_pfn_iobuf, body, "{\"uploadId\":\"%s\",\"size\":%lld,\"parts\":[", ctx->upload_id, ctx->all_size);
+	for (int i = 0; i < ctx->part_count; i++) {
+		upload_part_t* part = &ctx->parts[i];
+		mg_xprintf(mg_pfn_iobuf, body, "%s{\"partNumber\":%d,\"offset\":%lld,\"size\":%lld,\"crc32\":\"%08lx\"",
+			i > 0 ? "," : "", i + 1, part->start, part->end - part->start + 1, (unsigned long)part->crc32);
+		if (s_compress >= 0) mg_xprintf(mg_pfn_iobuf, body, ",\"encodedSize\":%lld", part->encoded_size);
+		if (part->etag[0]) mg_xprintf(mg_pfn_iobuf, body, ",\"etag\":%m", MG_ESC(part->etag));
+		mg_xprintf(mg_pfn_iobuf, body, "}");
+	}
+	mg_xprintf(mg_pfn_iobuf, body, "]}");
+
+	*(uint64_t*)c->data = mg_millis() + s_transfer_timeout_ms;
+	mg_printf(c,
+		"POST %s HTTP/1.1\r\n"
+		"Host: %.*s\r\n"
+		"Content-Type: application/json\r\n"
+		"Content-Length: %lu\r\n"
+		"Connection: close\r\n"
+		"\r\n",
+		mg_url_uri(s_complete_url), (int)host.len, host.buf, (unsigned long)body->len);
+	mg_send(c, body->buf, body->len);
+}
+
+/** Release everything owned by `ctx` */
+static void free_upload(upload_ctx_t* ctx) {
+	if (ctx->file) {
+		fclose(ctx->file);
+		ctx->file = (FILE*)null;
+	}
+	if (ctx->parts) {
+		free(ctx->parts);
+		ctx->parts = (upload_part_t*)null;
+	}
+	if (ctx->slots) {
+		for (int i = 0; i < ctx->jobs; i++) free(ctx->slots[i].deflater);
+		free(ctx->slots);
+		ctx->slots = (upload_slot_t*)null;
+	}
+	mg_iobuf_free(&ctx->complete_body);
+}
+
+/* callback for upload connection */
+static void http_upload_callback_fn(struct mg_connection* c, int ev, void* ev_data) {
+	upload_slot_t* slot = (upload_slot_t*)c->fn_data;
+	upload_ctx_t* ctx = slot->ctx;
+
+	if (ev == MG_EV_OPEN) {
+		*(uint64_t*)c->data = mg_millis() + s_timeout_ms;
+	}
+	else if (ev == MG_EV_CONNECT) {
+		const char* url = piece_url(ctx);
+		if (mg_url_is_ssl(url)) {
+			struct mg_tls_opts opts;
+			memset(&opts, 0, sizeof(opts));
+			opts.name = mg_url_host(url);
+			mg_tls_init(c, &opts);
+		}
+		if (slot->conn == c) send_piece_request(c, slot);
+	}
+	else if (ev == MG_EV_WRITE) {
+		if (slot->conn != c || slot->part < 0) return;
+		if (s_tus && ctx->tus_step != TUS_PATCH) return; // Only PATCH has a body
+		*(uint64_t*)c->data = mg_millis() + s_transfer_timeout_ms;
+		if (!fill_piece_body(c, slot)) fail_piece(slot, c);
+	}
+	else if (ev == MG_EV_HTTP_HDRS) {
+		// A HEAD response may announce a Content-Length without a body, so the probe is
+		// answered by its headers, and its connection is not reused
+		if (s_tus && ctx->tus_step == TUS_PROBE && slot->conn == c && slot->part >= 0) {
+			handle_tus_response(c, slot, (struct mg_http_message*)ev_data);
+		}
+	}
+	else if (ev == MG_EV_HTTP_MSG) {
+		struct mg_http_message* hm = (struct mg_http_message*)ev_data;
+		if (slot->conn != c || slot->part < 0) return;
+		if (s_tus) {
+			handle_tus_response(c, slot, hm);
+			return;
+		}
+		upload_part_t* part = &ctx->parts[slot->part];
+		int status = mg_http_status(hm);
+		int64_t len = part->end - part->start + 1;
+
+		// 308 is how resumable upload servers acknowledge a piece that is not the last one
+		if ((status < 200 || status >= 300) && status != 308) {
+			printf("\nHTTP error %d for part %d: %.*s\n", status, slot->part + 1, (int)hm->body.len, hm->body.buf);
+			fail_piece(slot, c);
+			return;
+		}
+		if (slot->sent < len || c->send.len > 0 || (slot->deflater != null && !slot->body_done)) {
+			// Answered before the body was complete, the server did not take the part
+			printf("\nServer answered %d before part %d was sent\n", status, slot->part + 1);
+			fail_piece(slot, c);
+			return;
+		}
+
+		struct mg_str* etag = mg_http_get_header(hm, "ETag");
+		if (etag != NULL && etag->len < sizeof(part->etag)) {
+			memcpy(part->etag, etag->buf, etag->len);
+			part->etag[etag->len] = '\0';
+		}
+		part->state = PART_DONE;
+		ctx->uploaded += len;
+		ctx->parts_done++;
+		slot->part = -1;
+		slot->sent = 0;
+		struct mg_str* conn_hdr = mg_http_get_header(hm, "Connection");
+		if (conn_hdr != NULL && mg_strcasecmp(*conn_hdr, mg_str("close")) == 0) {
+			c->is_draining = 1;
+			slot->conn = (struct mg_connection*)null;
+		}
+	}
+	else if (ev == MG_EV_ERROR) {
+		printf("\nError: %s\n", (char*)ev_data);
+		if (slot->conn == c && slot->part >= 0) fail_piece(slot, c);
+	}
+	else if (ev == MG_EV_CLOSE) {
+		if (slot->conn == c) {
+			slot->conn = (struct mg_connection*)null;
+			// A kept connection closed by the server between parts is simply reopened
+			if (slot->part >= 0) fail_piece(slot, (struct mg_connection*)null);
+		}
+	}
+	else if (ev == MG_EV_POLL) {
+		if (slot->conn == c && slot->part < 0) return; // Idle kept connection
+		if (mg_millis() > *(uint64_t*)c->data) {
+			mg_error(c, "Operation timed out");
+		}
+	}
+}
+
+/* callback for the complete request connection */
+static void http_complete_callback_fn(struct mg_connection* c, int ev, void* ev_data) {
+	upload_ctx_t* ctx = (upload_ctx_t*)c->fn_data;
+
+	if (ev == MG_EV_OPEN) {
+		// Sent from within mg_http_connect, before `complete_conn` is set
+		*(uint64_t*)c->data = mg_millis() + s_timeout_ms;
+		return;
+	}
+	if (ctx->complete_conn != c) return;
+
+	if (ev == MG_EV_CONNECT) {
+		if (mg_url_is_ssl(s_complete_url)) {
+			struct mg_tls_opts opts;
+			memset(&opts, 0, sizeof(opts));
+			opts.name = mg_url_host(s_complete_url);
+			mg_tls_init(c, &opts);
+		}
+		send_complete_request(c, ctx);
+	}
+	else if (ev == MG_EV_HTTP_MSG) {
+		struct mg_http_message* hm = (struct mg_http_message*)ev_data;
+		int status = mg_http_status(hm);
+		c->is_draining = 1;
+		ctx->complete_conn = (struct mg_connection*)null;
+		if (status >= 200 && status < 300) {
+			ctx->complete.state = PART_DONE;
+		}
+		else {
+			printf("\nHTTP error %d for complete request: %.*s\n", status, (int)hm->body.len, hm->body.buf);
+			retry_part(ctx, &ctx->complete, "complete request");
+		}
+	}
+	else if (ev == MG_EV_ERROR) {
+		printf("\nError: %s\n", (char*)ev_data);
+	}
+	else if (ev == MG_EV_CLOSE) {
+		ctx->complete_conn = (struct mg_connection*)null;
+		retry_part(ctx, &ctx->complete, "complete request");
+	}
+	else if (ev == MG_EV_POLL) {
+		if (mg_millis() > *(uint64_t*)c->data) {
+			mg_error(c, "Operation timed out");
+		}
+	}
+}
+
+/** Send the next tus request, or the next piece once the upload URL and offset are known */
+static void schedule_tus_upload(upload_ctx_t* ctx, struct mg_mgr* mgr) {
+	upload_slot_t* slot = &ctx->slots[0];
+	upload_part_t* part = &ctx->parts[0];
+	if (slot->part >= 0 || (part->state == PART_WAITING && !retry_due(part))) return;
+
+	if (ctx->tus_step == TUS_PATCH && ctx->uploaded >= ctx->all_size) {
+		// Upload complete, nothing left to resume
+		remove(ctx->checkpoint_path);
+		ctx->state = UPLOAD_SUCCESS;
+		return;
+	}
+	if (ctx->tus_step == TUS_PATCH) {
+		part->start = ctx->uploaded;
+		part->end = part->start + max_upload_size_per_piece - 1;
+		if (part->end >= ctx->all_size) part->end = ctx->all_size - 1;
+	}
+	slot->part = 0;
+	slot->sent = 0;
+	part->state = PART_SENDING;
+	if (slot->conn != null) {
+		send_piece_request(slot->conn, slot);
+		return;
+	}
+	const char* url = ctx->tus_step == TUS_CREATE ? s_url : ctx->tus_url;
+	slot->conn = mg_http_connect(mgr, url, http_upload_callback_fn, slot);
+	if (slot->conn == null) {
+		printf("\nFailed to connect to %s\n", url);
+		fail_piece(slot, (struct mg_connection*)null);
+	}
+}
+
+/** Send the request of the current tus step */
+static void send_tus_request(struct mg_connection* c, upload_slot_t* slot) {
+	upload_ctx_t* ctx = slot->ctx;
+	upload_part_t* part = &ctx->parts[0];
+	const char* url = ctx->tus_step == TUS_CREATE ? s_url : ctx->tus_url;
+	struct mg_str host = mg_url_host(url);
+	*(uint64_t*)c->data = mg_millis() + s_transfer_timeout_ms;
+	if (ctx->tus_step == TUS_CREATE) {
+		mg_printf(c,
+			"POST %s HTTP/1.1\r\n"
+			"Host: %.*s\r\n"
+			"Tus-Resumable: 1.0.0\r\n"
+			"Upload-Length: %lld\r\n"
+			"Content-Length: 0\r\n"
+			"\r\n",
+			mg_url_uri(url), (int)host.len, host.buf, ctx->all_size);
+	}
+	else if (ctx->tus_step == TUS_PROBE) {
+		mg_printf(c,
+			"HEAD %s HTTP/1.1\r\n"
+			"Host: %.*s\r\n"
+			"Tus-Resumable: 1.0.0\r\n"
+			"\r\n",
+			mg_url_uri(url), (int)host.len, host.buf);
+	}
+	else {
+		mg_printf(c,
+			"PATCH %s HTTP/1.1\r\n"
+			"Host: %.*s\r\n"
+			"Tus-Resumable: 1.0.0\r\n"
+			"Content-Type: application/offset+octet-stream\r\n"
+			"Content-Length: %lld\r\n"
+			"Upload-Offset: %lld\r\n"
+			"\r\n",
+			mg_url_uri(url), (int)host.len, host.buf, part->end - part->start + 1, part->start);
+		if (!fill_piece_body(c, slot)) fail_piece(slot, c);
+	}
+}
+
+/** Handle the response to the current tus request */
+static void handle_tus_response(struct mg_connection* c, upload_slot_t* slot, struct mg_http_message* hm) {
+	upload_ctx_t* ctx = slot->ctx;
+	upload_part_t* part = &ctx->parts[0];
+	int status = mg_http_status(hm);
+	struct mg_str* offset_hdr = mg_http_get_header(hm, "Upload-Offset");
+	int64_t offset = -1;
+	if (offset_hdr != NULL && !mg_str_to_num(*offset_hdr, 10, &offset, sizeof(offset))) offset = -1;
+
+	if (ctx->tus_step == TUS_CREATE) {
+		struct mg_str* location = mg_http_get_header(hm, "Location");
+		if (status < 200 || status >= 300 || location == NULL || !resolve_tus_url(ctx, *location)) {
+			printf("\nHTTP error %d for upload creation: %.*s\n", status, (int)hm->body.len, hm->body.buf);
+			fail_piece(slot, c);
+			return;
+		}
+		printf("\nUpload created at %s\n", ctx->tus_url);
+		ctx->uploaded = 0;
+		ctx->tus_step = TUS_PATCH;
+		save_tus_checkpoint(ctx);
+		// The upload URL may be on another host than the creation endpoint
+		c->is_draining = 1;
+		slot->conn = (struct mg_connection*)null;
+	}
+	else if (ctx->tus_step == TUS_PROBE) {
+		c->is_draining = 1;
+		slot->conn = (struct mg_connection*)null;
+		if (status == 404 || status == 410) {
+			printf("\nUpload %s is gone from the server, starting over\n", ctx->tus_url);
+			ctx->tus_url[0] = '\0';
+			ctx->uploaded = 0;
+			ctx->tus_step = TUS_CREATE;
+			remove(ctx->checkpoint_path);
+		}
+		else if (status < 200 || status >= 300 || offset < 0 || offset > ctx->all_size) {
+			printf("\nHTTP error %d for upload offset: %.*s\n", status, offset_hdr ? (int)offset_hdr->len : 0, offset_hdr ? offset_hdr->buf : "");
+			fail_piece(slot, c);
+			return;
+		}
+		else {
+			if (offset != ctx->uploaded) printf("\nServer has %lld bytes of the upload, resuming there\n", offset);
+			ctx->uploaded = offset;
+			ctx->tus_step = TUS_PATCH;
+			save_tus_checkpoint(ctx);
+		}
+	}
+	else {
+		int64_t len = part->end - part->start + 1;
+		if (status == 409) {
+			// Our offset is not the server's, fail_piece probes it again
+			printf("\nServer rejected offset %lld\n", part->start);
+			fail_piece(slot, c);
+			return;
+		}
+		if (status < 200 || status >= 300 || slot->sent < len || c->send.len > 0 || offset < part->start || offset > part->start + len) {
+			printf("\nHTTP error %d for piece at %lld: %.*s\n", status, part->start, (int)hm->body.len, hm->body.buf);
+			fail_piece(slot, c);
+			return;
+		}
+		ctx->uploaded = offset;
+		save_tus_checkpoint(ctx);
+		struct mg_str* conn_hdr = mg_http_get_header(hm, "Connection");
+		if (conn_hdr != NULL && mg_strcasecmp(*conn_hdr, mg_str("close")) == 0) {
+			c->is_draining = 1;
+			slot->conn = (struct mg_connection*)null;
+		}
+	}
+	// Every accepted request is progress, so retries only count failures in a row
+	part->retry_count = 0;
+	part->state = PART_PENDING;
+	slot->part = -1;
+	slot->sent = 0;
+}
+
+/** Store the upload URL from a Location header, which may be relative to the -u endpoint */
+static bool resolve_tus_url(upload_ctx_t* ctx, struct mg_str location) {
+	size_t size = sizeof(ctx->tus_url);
+	if (location.len == 0) return false;
+	if (mg_match(location, mg_str("#://#"), NULL)) {
+		return mg_snprintf(ctx->tus_url, size, "%.*s", (int)location.len, location.buf) < size;
+	}
+
+	// "/x" replaces the path of the endpoint, "x" its last segment
+	const char* host = strstr(s_url, "://");
+	host = host != null ? host + 3 : s_url;
+	const char* path = strchr(host, '/');
+	size_t base = path != null ? (size_t)(path - s_url) : strlen(s_url);
+	const char* separator = "";
+	if (location.buf[0] != '/') {
+		if (path == null) separator = "/";
+		for (const char* p = path; p != null && *p != '\0' && *p != '?'; p++) {
+			if (*p == '/') base = (size_t)(p - s_url) + 1;
+		}
+	}
+	return mg_snprintf(ctx->tus_url, size, "%.*s%s%.*s", (int)base, s_url, separator, (int)location.len, location.buf) < size;
+}
+
+/** Pick up the upload URL of an earlier run from the sidecar file, if it was for the same file and endpoint */
+static void load_tus_checkpoint(upload_ctx_t* ctx) {
+	if (s_checkpoint_path != null) {
+		mg_snprintf(ctx->checkpoint_path, sizeof(ctx->checkpoint_path), "%s", s_checkpoint_path);
+	}
+	else {
+		mg_snprintf(ctx->checkpoint_path, sizeof(ctx->checkpoint_path), "%s.upload", s_file_path);
+	}
+	ctx->tus_step = TUS_CREATE;
+
+	// One "key value" pair per line, as written by save_tus_checkpoint
+	FILE* file = fopen(ctx->checkpoint_path, "r");
+	if (!file) return;
+	char line[600];
+	bool same_file = true;
+	int64_t offset = 0;
+	char url[sizeof(ctx->tus_url)] = "";
+	while (fgets(line, sizeof(line), file)) {
+		line[strcspn(line, "\r\n")] = '\0';
+		char* value = strchr(line, ' ');
+		if (value == null) continue;
+		*value++ = '\0';
+		int64_t number = 0;
+		bool is_number = mg_str_to_num(mg_str(value), 10, &number, sizeof(number));
+		if (!strcmp(line, "endpoint")) same_file = same_file && !strcmp(value, s_url);
+		else if (!strcmp(line, "size")) same_file = same_file && is_number && number == ctx->all_size;
+		else if (!strcmp(line, "mtime")) same_file = same_file && is_number && number == ctx->mtime;
+		else if (!strcmp(line, "offset") && is_number) offset = number;
+		else if (!strcmp(line, "url")) mg_snprintf(url, sizeof(url), "%s", value);
+	}
+	fclose(file);
+
+	if (!same_file || url[0] == '\0') {
+		printf("Ignoring checkpoint %s, it belongs to another file or endpoint\n", ctx->checkpoint_path);
+		return;
+	}
+	// The saved offset is only a hint, the server is asked for the committed one
+	mg_snprintf(ctx->tus_url, sizeof(ctx->tus_url), "%s", url);
+	ctx->uploaded = offset;
+	ctx->tus_step = TUS_PROBE;
+	printf("Resuming upload %s, %lld bytes were committed last time\n", ctx->tus_url, offset);
+}
+
+/** Write the upload URL and committed offset to the sidecar file */
+static void save_tus_checkpoint(upload_ctx_t* ctx) {
+	char tmp[sizeof(ctx->checkpoint_path) + 4];
+	mg_snprintf(tmp, sizeof(tmp), "%s.tmp", ctx->checkpoint_path);
+	FILE* file = fopen(tmp, "w");
+	if (!file) {
+		printf("\nFailed to write checkpoint: %s\n", tmp);
+		return;
+	}
+	fprintf(file, "endpoint %s\nsize %lld\nmtime %lld\nurl %s\noffset %lld\n",
+		s_url, ctx->all_size, ctx->mtime, ctx->tus_url, ctx->uploaded);
+	bool success = fclose(file) == 0;
+	// Replaced in one step, so a crash leaves either the old or the new checkpoint
+#if MG_ARCH == MG_ARCH_WIN32
+	if (success) remove(ctx->checkpoint_path);
+#endif
+	if (!success || rename(tmp, ctx->checkpoint_path) != 0) {
+		printf("\nFailed to write checkpoint: %s\n", ctx->checkpoint_path);
+		remove(tmp);
+	}
+}
+
+static void print_file_upload_usage() {
+	printf("Usage: http_file_upload -u <url> -p <file_path> [-t <timeout_ms>] [-s <size>] [-m <PUT|POST>] [-j <jobs>]\n");
+	printf("Options:\n");
+	printf("  -u <url>          Required. Set the URL to upload the file to.\n");
+	printf("  -p <file_path>    Required. Set the path to the file to upload.\n");
+	printf("  -t <timeout_ms>   Set the timeout in milliseconds (default: 10000 ms).\n");
+	printf("  -s <size>         Set the size of each upload piece in bytes (default: 1048576).\n");
+	printf("  -m <PUT|POST>     Set the request method of the pieces (default: PUT).\n");
+	printf("  -j <jobs>         Set the number of pieces uploaded at once (default: 1).\n");
+	printf("  -complete <url>   Optional. POST the part list with per-part CRC32 to this URL after the last piece.\n");
+	printf("  -compress <z>     Optional. Compress every piece with gzip or deflate, the CRC32 covers the compressed bytes.\n");
+	printf("  -retries <n>      Set the retries per piece (default: 3).\n");
+	printf("  -protocol <p>     range: Content-Range pieces (default); tus: resumable tus upload, -u is the creation endpoint.\n");
+	printf("  -checkpoint <f>   Sidecar file of a tus upload, to resume it after a restart (default: <file_path>.upload).\n");
+}
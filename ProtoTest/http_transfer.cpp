@@ -0,0 +1,473 @@
+#include "http_transfer.h"
+#include "util.h"
+
+#if MG_ARCH == MG_ARCH_WIN32
+#include <io.h>
+#endif
+
+hecsion::HttpTransfer::HttpTransfer(
+	struct mg_mgr* mgr,
+	Direction direction,
+	string url,
+	string path
+) {
+	this->mgr = mgr;
+	this->direction = direction;
+	this->url = url;
+	this->path = path;
+	this->method = "PUT";
+	this->piece_size = 1 * 1024 * 1024;
+	this->timeout_ms = 10000;
+	this->transfer_timeout_ms = 30000;
+	this->max_retries = 3;
+	this->retry_base_ms = 1000;
+	this->file = null;
+	this->offset = 0;
+	this->total = -1;
+	this->piece_start = 0;
+	this->piece_end = -1;
+	this->piece_sent = 0;
+	this->pieces_done = 0;
+	this->retry_count = 0;
+	this->retry_at_ms = 0;
+	this->in_flight = false;
+	this->stream_left = -1;
+	this->conn = null;
+	this->timer = null;
+	this->state = STATE_IDLE;
+	this->callback = nullptr;
+	this->progress = nullptr;
+	this->data_callback = nullptr;
+}
+
+hecsion::HttpTransfer::~HttpTransfer()
+{
+	release_connection();
+	if (file != null) fclose(file);
+	if (timer != null) {
+		mg_timer_free(&mgr->timers, timer);
+		free(timer);
+	}
+}
+
+void hecsion::HttpTransfer::set_piece_size(int64_t size)
+{
+	if (size > 0) this->piece_size = size;
+}
+
+void hecsion::HttpTransfer::set_timeout(uint64_t connect_ms, uint64_t transfer_ms)
+{
+	this->timeout_ms = connect_ms;
+	this->transfer_timeout_ms = transfer_ms;
+}
+
+void hecsion::HttpTransfer::set_retries(int retries, uint64_t base_ms)
+{
+	this->max_retries = retries;
+	this->retry_base_ms = base_ms;
+}
+
+void hecsion::HttpTransfer::set_method(string method)
+{
+	this->method = method;
+}
+
+void hecsion::HttpTransfer::set_progress(std::function<void(int64_t, int64_t)> progress)
+{
+	this->progress = std::move(progress);
+}
+
+void hecsion::HttpTransfer::set_data_callback(std::function<bool(int64_t, const char*, size_t)> data_callback)
+{
+	this->data_callback = std::move(data_callback);
+}
+
+bool hecsion::HttpTransfer::start(std::function<void(bool, const char*)> callback)
+{
+	if (state == STATE_RUNNING) {
+		MG_INFO(("Transfer of %s is running already", path.c_str()));
+		return false;
+	}
+	if (direction == DOWNLOAD) {
+		file = fopen(path.c_str(), "wb");
+		total = -1;
+	}
+	else {
+		size_t size = 0;
+		int flags = mg_fs_posix.st(path.c_str(), &size, null);
+		file = (flags != 0 && !(flags & MG_FS_DIR)) ? fopen(path.c_str(), "rb") : null;
+		total = (int64_t)size;
+	}
+	if (file == null) {
+		MG_INFO(("Failed to open file: %s", path.c_str()));
+		return false;
+	}
+	this->callback = std::move(callback);
+	this->offset = 0;
+	this->pieces_done = 0;
+	this->retry_count = 0;
+	this->retry_at_ms = 0;
+	this->error.clear();
+	this->state = STATE_RUNNING;
+	// The timer runs retries once their delay is over, pieces follow each other without it
+	if (timer == null) timer = mg_timer_add(mgr, 100, MG_TIMER_REPEAT, timer_callback, this);
+	schedule();
+	return true;
+}
+
+void hecsion::HttpTransfer::cancel()
+{
+	if (state == STATE_RUNNING) finish(false, "Transfer cancelled");
+}
+
+bool hecsion::HttpTransfer::is_running() const
+{
+	return state == STATE_RUNNING;
+}
+
+int64_t hecsion::HttpTransfer::transferred() const
+{
+	return offset;
+}
+
+int64_t hecsion::HttpTransfer::size() const
+{
+	return total;
+}
+
+void hecsion::HttpTransfer::schedule()
+{
+	if (state != STATE_RUNNING || in_flight || mg_millis() < retry_at_ms) return;
+	in_flight = true;
+	stream_left = -1;
+	if (conn != null) {
+		// Kept from the last piece
+		send_request(conn);
+		return;
+	}
+	conn = mg_http_connect(mgr, url.c_str(), http_callback_fn, this);
+	if (conn == null) fail_piece("Failed to connect", false);
+}
+
+void hecsion::HttpTransfer::send_request(struct mg_connection* c)
+{
+	struct mg_str host = mg_url_host(url.c_str());
+	*(uint64_t*)c->data = mg_millis() + transfer_timeout_ms;
+	piece_start = offset;
+	piece_end = offset + piece_size - 1;
+	if (total >= 0 && piece_end >= total) piece_end = total - 1;
+
+	if (direction == DOWNLOAD) {
+		mg_printf(c,
+			"GET %s HTTP/1.1\r\n"
+			"Host: %.*s\r\n"
+			"Range: bytes=%lld-%lld\r\n"
+			"\r\n",
+			mg_url_uri(url.c_str()), (int)host.len, host.buf, piece_start, piece_end);
+		return;
+	}
+
+	piece_sent = 0;
+	if (!seek_file(file, piece_start)) {
+		fail_piece("Failed to read file", true);
+		return;
+	}
+	mg_printf(c,
+		"%s %s HTTP/1.1\r\n"
+		"Host: %.*s\r\n"
+		"Content-Type: application/octet-stream\r\n"
+		"Content-Length: %lld\r\n",
+		method.c_str(), mg_url_uri(url.c_str()), (int)host.len, host.buf, piece_end - piece_start + 1);
+	if (total > 0) {
+		mg_printf(c, "Content-Range: bytes %lld-%lld/%lld\r\n\r\n", piece_start, piece_end, total);
+	}
+	else {
+		mg_printf(c, "Content-Range: bytes */0\r\n\r\n");
+	}
+	if (!fill_body(c)) fail_piece("Failed to read file", true);
+}
+
+bool hecsion::HttpTransfer::fill_body(struct mg_connection* c)
+{
+	int64_t len = piece_end - piece_start + 1;
+	while (piece_sent < len && c->send.len < SEND_WINDOW) {
+		// Read straight into the send buffer
+		size_t n = len - piece_sent < (int64_t)READ_SIZE ? (size_t)(len - piece_sent) : READ_SIZE;
+		if (c->send.size < c->send.len + n && !mg_iobuf_resize(&c->send, c->send.len + n)) return false;
+		if (fread(c->send.buf + c->send.len, 1, n, file) != n) return false;
+		c->send.len += n;
+		piece_sent += n;
+	}
+	return true;
+}
+
+void hecsion::HttpTransfer::handle_download_response(struct mg_http_message* hm)
+{
+	int status = mg_http_status(hm);
+	char range[96] = { 0 };
+	struct mg_str* content_range = mg_http_get_header(hm, "Content-Range");
+	if (content_range != NULL) mg_snprintf(range, sizeof(range), "%.*s", (int)content_range->len, content_range->buf);
+
+	if (status == 416) {
+		// Nothing left past `offset`, which is the case for an empty file
+		long long all = -1;
+		if (sscanf(range, "bytes */%lld", &all) == 1 && all == offset) {
+			total = offset;
+			piece_done(hm);
+		}
+		else {
+			fail_piece("Range is beyond the end of the remote file", true);
+		}
+		return;
+	}
+	if (status != 200 && status != 206) {
+		char reason[48];
+		mg_snprintf(reason, sizeof(reason), "HTTP error %d", status);
+		fail_piece(reason, !(status >= 500 || status == 408 || status == 429));
+		return;
+	}
+	if (hm->body.len == (size_t)-1) {
+		fail_piece("Response has no Content-Length", false);
+		return;
+	}
+
+	if (status == 206) {
+		long long start = -1, end = -1, all = -1;
+		int fields = sscanf(range, "bytes %lld-%lld/%lld", &start, &end, &all);
+		if (fields < 2 || start != piece_start || end - start + 1 != (long long)hm->body.len) {
+			fail_piece("Invalid Content-Range", false);
+			return;
+		}
+		if (fields == 3) total = all;
+	}
+	else {
+		// The server does not do ranges and sent the whole file
+		piece_start = 0;
+		total = (int64_t)hm->body.len;
+	}
+	if (!seek_file(file, piece_start) || fwrite(hm->body.buf, 1, hm->body.len, file) != hm->body.len) {
+		fail_piece("Failed to write file", true);
+		return;
+	}
+	if (data_callback != nullptr && !data_callback(piece_start, hm->body.buf, hm->body.len)) {
+		fail_piece("Data rejected", true);
+		return;
+	}
+	offset = piece_start + (int64_t)hm->body.len;
+	piece_done(hm);
+}
+
+void hecsion::HttpTransfer::start_whole_file(struct mg_connection* c, struct mg_http_message* hm)
+{
+	// Only a body of known length is streamed, mongoose buffers a chunked one as before
+	if (mg_http_get_header(hm, "Content-Length") == NULL || mg_http_get_header(hm, "Transfer-Encoding") != NULL) return;
+	if (!seek_file(file, 0)) {
+		fail_piece("Failed to write file", true);
+		return;
+	}
+	piece_start = 0;
+	offset = 0;
+	total = (int64_t)hm->body.len;
+	stream_left = total;
+	// Consuming the headers detaches the HTTP handler, the body then arrives with MG_EV_READ
+	mg_iobuf_del(&c->recv, 0, (size_t)(hm->body.buf - (char*)c->recv.buf));
+}
+
+void hecsion::HttpTransfer::stream_whole_file(struct mg_connection* c)
+{
+	size_t len = (int64_t)c->recv.len < stream_left ? c->recv.len : (size_t)stream_left;
+	if (len > 0) {
+		if (fwrite(c->recv.buf, 1, len, file) != len) {
+			fail_piece("Failed to write file", true);
+			return;
+		}
+		if (data_callback != nullptr && !data_callback(offset, (char*)c->recv.buf, len)) {
+			fail_piece("Data rejected", true);
+			return;
+		}
+		mg_iobuf_del(&c->recv, 0, len);
+		offset += (int64_t)len;
+		stream_left -= (int64_t)len;
+	}
+	if (stream_left > 0) return;
+	stream_left = -1;
+	// Without its HTTP handler the connection cannot take another request
+	release_connection();
+	piece_done(null);
+}
+
+void hecsion::HttpTransfer::handle_upload_response(struct mg_connection* c, struct mg_http_message* hm)
+{
+	int status = mg_http_status(hm);
+	// 308 is how resumable upload servers acknowledge a piece that is not the last one
+	if ((status < 200 || status >= 300) && status != 308) {
+		char reason[48];
+		mg_snprintf(reason, sizeof(reason), "HTTP error %d", status);
+		fail_piece(reason, !(status >= 500 || status == 408 || status == 429));
+		return;
+	}
+	if (piece_sent < piece_end - piece_start + 1 || c->send.len > 0) {
+		// Answered before the body was complete, the server did not take the piece
+		fail_piece("Server answered before the piece was sent", false);
+		return;
+	}
+	offset = piece_end + 1;
+	piece_done(hm);
+}
+
+void hecsion::HttpTransfer::piece_done(struct mg_http_message* hm)
+{
+	in_flight = false;
+	retry_count = 0;
+	pieces_done++;
+	// A streamed response comes without `hm`, its connection is released already
+	struct mg_str* conn_hdr = hm != null ? mg_http_get_header(hm, "Connection") : null;
+	if (conn_hdr != NULL && mg_strcasecmp(*conn_hdr, mg_str("close")) == 0) release_connection();
+	if (progress != nullptr) progress(offset, total);
+
+	bool complete = direction == DOWNLOAD ? total >= 0 && offset >= total : offset >= total && pieces_done > 0;
+	if (complete) {
+		finish(true, null);
+	}
+	else {
+		schedule();
+	}
+}
+
+void hecsion::HttpTransfer::fail_piece(const char* reason, bool fatal)
+{
+	release_connection();
+	in_flight = false;
+	if (fatal || retry_count >= max_retries) {
+		finish(false, reason);
+		return;
+	}
+	uint64_t delay = retry_base_ms;
+	for (int i = 0; i < retry_count && delay < RETRY_MAX_MS; i++) delay *= 2;
+	if (delay > RETRY_MAX_MS) delay = RETRY_MAX_MS;
+	retry_count++;
+	MG_INFO(("%s at %lld of %s, retrying in %llu ms (%d/%d)", reason, offset, path.c_str(), delay, retry_count, max_retries));
+	retry_at_ms = mg_millis() + delay;
+}
+
+void hecsion::HttpTransfer::release_connection()
+{
+	if (conn == null) return;
+	// Events still pending on the connection are not ours anymore
+	conn->is_closing = 1;
+	conn->fn_data = null;
+	conn = null;
+}
+
+void hecsion::HttpTransfer::finish(bool success, const char* message)
+{
+	release_connection();
+	in_flight = false;
+	if (file != null) {
+		// A downloaded file is on the disk before its callback runs, it may be booted from next
+		bool written = true;
+		if (direction == DOWNLOAD && success) {
+#if MG_ARCH == MG_ARCH_WIN32
+			written = fflush(file) == 0 && _commit(_fileno(file)) == 0;
+#else
+			written = fflush(file) == 0 && fsync(fileno(file)) == 0;
+#endif
+		}
+		if ((fclose(file) != 0 || !written) && success) {
+			success = false;
+			message = "Failed to write file";
+		}
+		file = null;
+	}
+	state = success ? STATE_DONE : STATE_ERROR;
+	error = message != null ? message : "";
+	if (success) {
+		MG_INFO(("Transfer of %s done, %lld bytes", path.c_str(), offset));
+	}
+	else {
+		MG_INFO(("Transfer of %s failed: %s", path.c_str(), error.c_str()));
+	}
+
+	// Taken out first, the callback may start the transfer again with another one
+	std::function<void(bool, const char*)> done = std::move(callback);
+	callback = nullptr;
+	string reason = error;
+	if (done != nullptr) done(success, success ? null : reason.c_str());
+}
+
+void hecsion::HttpTransfer::timer_callback(void* arg)
+{
+	hecsion::HttpTransfer* transfer = (hecsion::HttpTransfer*)arg;
+	transfer->schedule();
+}
+
+bool hecsion::HttpTransfer::seek_file(FILE* file, int64_t pos)
+{
+#if MG_ARCH == MG_ARCH_WIN32
+	return _fseeki64(file, pos, SEEK_SET) == 0;
+#else
+	return fseeko(file, (off_t)pos, SEEK_SET) == 0;
+#endif
+}
+
+void hecsion::HttpTransfer::http_callback_fn(mg_connection* c, int ev, void* ev_data)
+{
+	hecsion::HttpTransfer* transfer = (hecsion::HttpTransfer*)c->fn_data;
+	if (transfer == null) return; // Released by the transfer
+	if (ev == MG_EV_OPEN) {
+		// Sent from within mg_http_connect, before `conn` is set
+		*(uint64_t*)c->data = mg_millis() + transfer->timeout_ms;
+		return;
+	}
+	if (transfer->conn != c) return;
+
+	if (ev == MG_EV_CONNECT) {
+		if (mg_url_is_ssl(transfer->url.c_str())) {
+			struct mg_tls_opts opts;
+			memset(&opts, 0, sizeof(opts));
+			opts.name = mg_url_host(transfer->url.c_str());
+			mg_tls_init(c, &opts);
+		}
+		if (transfer->in_flight) transfer->send_request(c);
+	}
+	else if (ev == MG_EV_WRITE) {
+		if (!transfer->in_flight || transfer->direction != UPLOAD) return;
+		*(uint64_t*)c->data = mg_millis() + transfer->transfer_timeout_ms;
+		if (!transfer->fill_body(c)) transfer->fail_piece("Failed to read file", true);
+	}
+	else if (ev == MG_EV_HTTP_HDRS) {
+		// The whole file of a server that ignores `Range` may not fit the receive buffer, it is written as it arrives
+		struct mg_http_message* hm = (struct mg_http_message*)ev_data;
+		if (transfer->in_flight && transfer->direction == DOWNLOAD && mg_http_status(hm) == 200) {
+			transfer->start_whole_file(c, hm);
+		}
+	}
+	else if (ev == MG_EV_READ) {
+		// A download piece arrives in many reads before it is a whole message
+		if (transfer->in_flight) *(uint64_t*)c->data = mg_millis() + transfer->transfer_timeout_ms;
+		if (transfer->in_flight && transfer->stream_left >= 0) transfer->stream_whole_file(c);
+	}
+	else if (ev == MG_EV_HTTP_MSG) {
+		struct mg_http_message* hm = (struct mg_http_message*)ev_data;
+		if (!transfer->in_flight) return;
+		if (transfer->direction == DOWNLOAD) {
+			transfer->handle_download_response(hm);
+		}
+		else {
+			transfer->handle_upload_response(c, hm);
+		}
+	}
+	else if (ev == MG_EV_ERROR) {
+		if (transfer->in_flight) transfer->fail_piece((char*)ev_data, false);
+	}
+	else if (ev == MG_EV_CLOSE) {
+		transfer->conn = null;
+		// A kept connection closed by the server between pieces is simply reopened
+		if (transfer->in_flight) transfer->fail_piece("Connection closed", false);
+	}
+	else if (ev == MG_EV_POLL) {
+		if (transfer->in_flight && mg_millis() > *(uint64_t*)c->data) {
+			mg_error(c, "Operation timed out");
+		}
+	}
+}
@@ -0,0 +1,153 @@
+#pragma once
+#ifndef HECSION_HTTP_TRANSFER
+#define HECSION_HTTP_TRANSFER
+
+#include "mongoose.h"
+#include <cstdio>
+#include <cstdint>
+#include <string>
+#include <functional>
+
+using namespace std;
+
+namespace hecsion {
+
+	/**
+	 * One file download or upload that keeps all of its state in the object, so any number
+	 * of them run at once on an `mg_mgr` owned by the caller, next to an MqttOtaTask.
+	 * The file goes piece by piece over a kept connection: a download GETs it by `Range`,
+	 * an upload PUTs or POSTs it with `Content-Range`, as http_download and http_file_upload do.
+	 */
+	class HttpTransfer {
+	public:
+		enum Direction {
+			DOWNLOAD,	// `url` is saved to `path`
+			UPLOAD		// `path` is sent to `url`
+		};
+
+	private:
+		static const char STATE_IDLE    = 0;
+		static const char STATE_RUNNING = 1;
+		static const char STATE_DONE    = 2;
+		static const char STATE_ERROR   = 3;
+
+		static const size_t SEND_WINDOW = 32768;	// Upload body bytes queued in the send buffer at most
+		static const size_t READ_SIZE   = 16384;	// Bytes read from the file at once
+		static const uint64_t RETRY_MAX_MS = 60000;	// Retry delay cap
+
+	private:
+		struct mg_mgr* mgr;
+		Direction direction;
+		string url;
+		string path;
+		string method;				// Request method of upload pieces, PUT or POST
+		int64_t piece_size;
+		uint64_t timeout_ms;		// Connect timeout
+		uint64_t transfer_timeout_ms;	// Timeout without progress once connected
+		int max_retries;			// Retries of one piece
+		uint64_t retry_base_ms;		// First retry delay, doubled on every retry up to RETRY_MAX_MS
+
+		FILE* file;
+		int64_t offset;				// Bytes of the file done
+		int64_t total;				// Size of the file, -1 while a download does not know it
+		int64_t piece_start;		// Piece of the request in flight
+		int64_t piece_end;
+		int64_t piece_sent;			// Upload body bytes of the piece queued so far
+		int pieces_done;
+		int retry_count;
+		uint64_t retry_at_ms;
+		bool in_flight;				// A request is on its way or waiting for a connection
+		int64_t stream_left;		// Bytes still expected of a whole file response written as it arrives, -1 if none
+		struct mg_connection* conn;	// Kept for the next piece while the server allows
+		struct mg_timer* timer;		// Starts requests and retries, lives as long as the object
+		char state;
+		string error;
+
+		std::function<void(bool, const char*)> callback;
+		std::function<void(int64_t, int64_t)> progress;
+		std::function<bool(int64_t, const char*, size_t)> data_callback;
+
+	public:
+		/**
+		 * Constructor for HttpTransfer, nothing is sent before `start`.
+		 *
+		 * @param [in] mgr : Event manager the transfer runs on, polled by the caller. It must outlive the transfer
+		 * @param [in] direction : DOWNLOAD or UPLOAD
+		 * @param [in] url : URL to download from or to upload to
+		 * @param [in] path : File to write a download to, or to read an upload from
+		 */
+		HttpTransfer(struct mg_mgr* mgr, Direction direction, string url, string path);
+
+		/**
+		 * Stop a running transfer without calling the callback.
+		 */
+		~HttpTransfer();
+
+		/** Bytes per request (default is 1 MB) */
+		void set_piece_size(int64_t size);
+
+		/** Connect timeout, and timeout without progress once connected (default is 10000 ms and 30000 ms) */
+		void set_timeout(uint64_t connect_ms, uint64_t transfer_ms);
+
+		/** Retries of one piece before the transfer fails, and the first retry delay (default is 3 and 1000 ms) */
+		void set_retries(int retries, uint64_t base_ms);
+
+		/** Request method of upload pieces, PUT or POST (default is PUT) */
+		void set_method(string method);
+
+		/** Called with the bytes done and the total, -1 while unknown, after every piece */
+		void set_progress(std::function<void(int64_t, int64_t)> progress);
+
+		/**
+		 * Called with every piece of a download once it is written, in file order, so it can be checked
+		 * or hashed as it arrives. The offset goes back to 0 if a server that ignores `Range` sends
+		 * the whole file again. Returning false fails the transfer.
+		 */
+		void set_data_callback(std::function<bool(int64_t, const char*, size_t)> data_callback);
+
+		/**
+		 * Start the transfer, it advances while the caller polls `mgr`.
+		 *
+		 * @param [in] callback : Called once from the event loop when the transfer is over.
+		 *		`success` tells whether the whole file was transferred, otherwise `message` says why.
+		 *		The transfer may be started again from there, but must not be deleted inside it.
+		 * @return false if the file cannot be opened or a transfer is running already.
+		 */
+		bool start(std::function<void(bool, const char*)> callback);
+
+		/**
+		 * Stop the transfer, the callback is called with `success` false.
+		 */
+		void cancel();
+
+		bool is_running() const;
+
+		/** Bytes of the file done so far */
+		int64_t transferred() const;
+
+		/** Size of the file, -1 while a download does not know it yet */
+		int64_t size() const;
+
+	private:
+		void schedule();
+		void send_request(struct mg_connection* c);
+		bool fill_body(struct mg_connection* c);
+		void handle_download_response(struct mg_http_message* hm);
+		void start_whole_file(struct mg_connection* c, struct mg_http_message* hm);
+		void stream_whole_file(struct mg_connection* c);
+		void handle_upload_response(struct mg_connection* c, struct mg_http_message* hm);
+		void piece_done(struct mg_http_message* hm);
+		void fail_piece(const char* reason, bool fatal);
+		void release_connection();
+		void finish(bool success, const char* message);
+
+	private:
+		static void http_callback_fn(struct mg_connection* c, int ev, void* ev_data);
+
+		static void timer_callback(void* arg);
+
+		static bool seek_file(FILE* file, int64_t pos);
+	};
+}
+
+#endif // !HECSION_HTTP_TRANSFER
@@ -0,0 +1,444 @@
+#include "inflate_stream.h"
+#include "mongoose.h"
+#include <string.h>
+
+// Decoder states
+#define ST_AUTO_HEADER  0   // Decide between zlib and raw deflate
+#define ST_ZLIB_HEADER  1
+#define ST_GZIP_HEADER  2   // 10 byte fixed gzip header
+#define ST_GZIP_XLEN    3
+#define ST_GZIP_EXTRA   4
+#define ST_GZIP_NAME    5
+#define ST_GZIP_COMMENT 6
+#define ST_GZIP_HCRC    7
+#define ST_BLOCK        8   // Block header
+#define ST_STORED_LEN   9
+#define ST_STORED       10
+#define ST_DYN_HEADER   11
+#define ST_DYN_CLEN     12  // Code length code lengths
+#define ST_DYN_LENS     13  // Literal/length and distance code lengths
+#define ST_CODES        14  // Compressed data of a block
+#define ST_TRAILER      15
+#define ST_DONE         16
+#define ST_ERROR        17
+
+// gzip header flags
+#define GZIP_FHCRC    0x02
+#define GZIP_FEXTRA   0x04
+#define GZIP_FNAME    0x08
+#define GZIP_FCOMMENT 0x10
+
+// Results of a single decoding step
+#define STEP_OK    0
+#define STEP_MORE  1  // Not enough input, the step is repeated with more
+#define STEP_ERROR 2
+
+static const short length_base[29] = {
+    3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+    35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258 };
+static const short length_extra[29] = {
+    0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+    3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0 };
+static const short dist_base[30] = {
+    1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193,
+    257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577 };
+static const short dist_extra[30] = {
+    0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6,
+    7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13 };
+static const short clen_order[19] = { 16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15 };
+
+/** Move input bytes into the bit buffer while there is room, a step never needs more than 48 bits */
+static void refill(inflate_stream_t* s, const unsigned char** in, size_t* len) {
+    while (s->bit_count <= 56 && *len > 0) {
+        s->bit_buf |= (uint64_t)**in << s->bit_count;
+        s->bit_count += 8;
+        (*in)++;
+        (*len)--;
+    }
+}
+
+/** Take `n` bits, returns false if the buffer holds fewer */
+static bool take_bits(inflate_stream_t* s, int n, uint32_t* value) {
+    if (s->bit_count < n) return false;
+    *value = (uint32_t)(s->bit_buf & ((1ULL << n) - 1));
+    s->bit_buf >>= n;
+    s->bit_count -= n;
+    return true;
+}
+
+/** Drop bits up to the next byte boundary */
+static void align_to_byte(inflate_stream_t* s) {
+    int n = s->bit_count & 7;
+    s->bit_buf >>= n;
+    s->bit_count -= n;
+}
+
+/** Build a canonical code from `n` lengths, returns <0 if over-subscribed, >0 if incomplete */
+static int build_huffman(inflate_huffman_t* h, const short* lens, int n) {
+    short offs[16];
+    memset(h->count, 0, sizeof(h->count));
+    for (int i = 0; i < n; i++) h->count[lens[i]]++;
+    if (h->count[0] == n) return 0; // No codes, complete but unusable
+
+    int left = 1;
+    for (int len = 1; len < 16; len++) {
+        left <<= 1;
+        left -= h->count[len];
+        if (left < 0) return left;
+    }
+
+    offs[1] = 0;
+    for (int len = 1; len < 15; len++) offs[len + 1] = offs[len] + h->count[len];
+    for (int i = 0; i < n; i++) {
+        if (lens[i] != 0) h->symbol[offs[lens[i]]++] = (short)i;
+    }
+    return left;
+}
+
+/** Decode one symbol, returns STEP_MORE if the code is not complete in the buffer */
+static int decode_symbol(inflate_stream_t* s, const inflate_huffman_t* h, int* symbol) {
+    int code = 0, first = 0, index = 0;
+    for (int len = 1; len < 16; len++) {
+        if (len > s->bit_count) return STEP_MORE;
+        code |= (int)(s->bit_buf >> (len - 1)) & 1;
+        int count = h->count[len];
+        if (code - count < first) {
+            *symbol = h->symbol[index + (code - first)];
+            s->bit_buf >>= len;
+            s->bit_count -= len;
+            return STEP_OK;
+        }
+        index += count;
+        first += count;
+        first <<= 1;
+        code <<= 1;
+    }
+    return STEP_ERROR;
+}
+
+/** Pass window bytes not yet seen by the caller to `out`, updating the trailer check */
+static bool flush_window(inflate_stream_t* s, inflate_output_fn out, void* arg) {
+    size_t n = s->window_pos - s->flushed_pos;
+    if (n == 0) return true;
+    const unsigned char* data = s->window + s->flushed_pos;
+    if (s->format == INFLATE_FORMAT_GZIP) {
+        s->check = mg_crc32(s->check, (const char*)data, n);
+    }
+    else if (s->format == INFLATE_FORMAT_ZLIB) {
+        uint32_t a = s->check & 0xffff, b = s->check >> 16;
+        for (size_t i = 0; i < n; i++) {
+            a = (a + data[i]) % 65521;
+            b = (b + a) % 65521;
+        }
+        s->check = (b << 16) | a;
+    }
+    s->flushed_pos = s->window_pos;
+    return out((const char*)data, n, arg);
+}
+
+/** Append a decoded byte to the window, flushing it once it is full */
+static bool put_byte(inflate_stream_t* s, unsigned char c, inflate_output_fn out, void* arg) {
+    s->window[s->window_pos++] = c;
+    s->total_out++;
+    if (s->window_pos == INFLATE_WINDOW_SIZE) {
+        if (!flush_window(s, out, arg)) return false;
+        s->window_pos = s->flushed_pos = 0;
+    }
+    return true;
+}
+
+/** Fail the stream with `reason` */
+static int fail(inflate_stream_t* s, const char* reason) {
+    s->error = reason;
+    s->state = ST_ERROR;
+    return STEP_ERROR;
+}
+
+/** Build the fixed codes of a type 1 block */
+static void build_fixed(inflate_stream_t* s) {
+    int i = 0;
+    for (; i < 144; i++) s->lens[i] = 8;
+    for (; i < 256; i++) s->lens[i] = 9;
+    for (; i < 280; i++) s->lens[i] = 7;
+    for (; i < 288; i++) s->lens[i] = 8;
+    build_huffman(&s->lencode, s->lens, 288);
+    for (i = 0; i < 30; i++) s->lens[i] = 5;
+    build_huffman(&s->distcode, s->lens, 30);
+}
+
+/** Switch to the next block header, or the trailer after the last block */
+static void end_block(inflate_stream_t* s) {
+    s->state = s->last_block ? ST_TRAILER : ST_BLOCK;
+    s->index = 0;
+}
+
+/** Decode a literal, or a length/distance pair and copy its match */
+static int step_codes(inflate_stream_t* s, inflate_output_fn out, void* arg) {
+    int symbol = 0, r;
+    if ((r = decode_symbol(s, &s->lencode, &symbol)) != STEP_OK) {
+        return r == STEP_MORE ? r : fail(s, "invalid literal/length code");
+    }
+    if (symbol < 256) {
+        return put_byte(s, (unsigned char)symbol, out, arg) ? STEP_OK : fail(s, "output failed");
+    }
+    if (symbol == 256) {
+        end_block(s);
+        return STEP_OK;
+    }
+
+    symbol -= 257;
+    if (symbol >= 29) return fail(s, "invalid length symbol");
+    uint32_t extra = 0;
+    if (!take_bits(s, length_extra[symbol], &extra)) return STEP_MORE;
+    uint32_t len = length_base[symbol] + extra;
+
+    if ((r = decode_symbol(s, &s->distcode, &symbol)) != STEP_OK) {
+        return r == STEP_MORE ? r : fail(s, "invalid distance code");
+    }
+    if (symbol >= 30) return fail(s, "invalid distance symbol");
+    if (!take_bits(s, dist_extra[symbol], &extra)) return STEP_MORE;
+    uint32_t dist = dist_base[symbol] + extra;
+    if (dist > s->total_out) return fail(s, "distance too far back");
+
+    // The match may overlap the bytes it produces
+    uint32_t from = (s->window_pos + INFLATE_WINDOW_SIZE - dist) % INFLATE_WINDOW_SIZE;
+    while (len-- > 0) {
+        if (!put_byte(s, s->window[from], out, arg)) return fail(s, "output failed");
+        from = (from + 1) % INFLATE_WINDOW_SIZE;
+    }
+    return STEP_OK;
+}
+
+/** Read one unit of the current state, the caller rolls the bit buffer back on STEP_MORE */
+static int step(inflate_stream_t* s, inflate_output_fn out, void* arg) {
+    uint32_t v = 0;
+    int r;
+
+    switch (s->state) {
+    case ST_AUTO_HEADER:
+        // A zlib header is a multiple of 31 with method 8, which raw deflate rarely starts with
+        if (s->bit_count < 16) return STEP_MORE;
+        v = (uint32_t)(s->bit_buf & 0xffff);
+        s->format = ((v & 0x0f) == 8 && (((v & 0xff) << 8) | (v >> 8)) % 31 == 0) ? INFLATE_FORMAT_ZLIB : INFLATE_FORMAT_RAW;
+        s->check = s->format == INFLATE_FORMAT_ZLIB ? 1 : 0;
+        s->state = s->format == INFLATE_FORMAT_ZLIB ? ST_ZLIB_HEADER : ST_BLOCK;
+        return STEP_OK;
+
+    case ST_ZLIB_HEADER:
+        if (!take_bits(s, 16, &v)) return STEP_MORE;
+        if ((v & 0x0f) != 8 || (((v & 0xff) << 8) | (v >> 8)) % 31 != 0) return fail(s, "invalid zlib header");
+        if (v & 0x2000) return fail(s, "zlib preset dictionary not supported");
+        s->state = ST_BLOCK;
+        return STEP_OK;
+
+    case ST_GZIP_HEADER:
+        if (!take_bits(s, 8, &v)) return STEP_MORE;
+        s->header[s->index++] = (unsigned char)v;
+        if (s->index < (int)sizeof(s->header)) return STEP_OK;
+        if (s->header[0] != 0x1f || s->header[1] != 0x8b || s->header[2] != 8) return fail(s, "invalid gzip header");
+        s->state = ST_GZIP_XLEN;
+        return STEP_OK;
+
+    case ST_GZIP_XLEN:
+        if (s->header[3] & GZIP_FEXTRA) {
+            if (!take_bits(s, 16, &v)) return STEP_MORE;
+            s->left = v;
+        }
+        s->state = ST_GZIP_EXTRA;
+        return STEP_OK;
+
+    case ST_GZIP_EXTRA:
+        if (s->left > 0) {
+            if (!take_bits(s, 8, &v)) return STEP_MORE;
+            s->left--;
+            return STEP_OK;
+        }
+        s->state = ST_GZIP_NAME;
+        return STEP_OK;
+
+    case ST_GZIP_NAME:
+    case ST_GZIP_COMMENT:
+        // Zero terminated strings, present if their flag is set
+        if (s->header[3] & (s->state == ST_GZIP_NAME ? GZIP_FNAME : GZIP_FCOMMENT)) {
+            if (!take_bits(s, 8, &v)) return STEP_MORE;
+            if (v != 0) return STEP_OK;
+        }
+        s->state++;
+        return STEP_OK;
+
+    case ST_GZIP_HCRC:
+        if (s->header[3] & GZIP_FHCRC) {
+            if (!take_bits(s, 16, &v)) return STEP_MORE;
+        }
+        s->state = ST_BLOCK;
+        return STEP_OK;
+
+    case ST_BLOCK:
+        if (!take_bits(s, 3, &v)) return STEP_MORE;
+        s->last_block = (v & 1) != 0;
+        switch (v >> 1) {
+        case 0:
+            align_to_byte(s);
+            s->state = ST_STORED_LEN;
+            break;
+        case 1:
+            build_fixed(s);
+            s->state = ST_CODES;
+            break;
+        case 2:
+            s->state = ST_DYN_HEADER;
+            break;
+        default:
+            return fail(s, "invalid block type");
+        }
+        return STEP_OK;
+
+    case ST_STORED_LEN:
+        if (!take_bits(s, 32, &v)) return STEP_MORE;
+        if ((v & 0xffff) != (~v >> 16)) return fail(s, "stored block length mismatch");
+        s->left = v & 0xffff;
+        s->state = ST_STORED;
+        return STEP_OK;
+
+    case ST_STORED:
+        if (s->left > 0) {
+            if (!take_bits(s, 8, &v)) return STEP_MORE;
+            s->left--;
+            return put_byte(s, (unsigned char)v, out, arg) ? STEP_OK : fail(s, "output failed");
+        }
+        end_block(s);
+        return STEP_OK;
+
+    case ST_DYN_HEADER:
+        if (!take_bits(s, 14, &v)) return STEP_MORE;
+        s->nlen = (int)(v & 0x1f) + 257;
+        s->ndist = (int)((v >> 5) & 0x1f) + 1;
+        s->ncode = (int)(v >> 10) + 4;
+        if (s->nlen > 286 || s->ndist > 30) return fail(s, "bad dynamic block counts");
+        s->index = 0;
+        s->state = ST_DYN_CLEN;
+        return STEP_OK;
+
+    case ST_DYN_CLEN:
+        if (s->index < s->ncode) {
+            if (!take_bits(s, 3, &v)) return STEP_MORE;
+            s->lens[clen_order[s->index++]] = (short)v;
+            return STEP_OK;
+        }
+        for (; s->index < 19; s->index++) s->lens[clen_order[s->index]] = 0;
+        if (build_huffman(&s->lencode, s->lens, 19) != 0) return fail(s, "incomplete code length code");
+        s->index = 0;
+        s->state = ST_DYN_LENS;
+        return STEP_OK;
+
+    case ST_DYN_LENS: {
+        if (s->index < s->nlen + s->ndist) {
+            int symbol = 0;
+            if ((r = decode_symbol(s, &s->lencode, &symbol)) != STEP_OK) {
+                return r == STEP_MORE ? r : fail(s, "invalid code length code");
+            }
+            if (symbol < 16) {
+                s->lens[s->index++] = (short)symbol;
+                return STEP_OK;
+            }
+            short len = 0;
+            uint32_t repeat = 0;
+            if (symbol == 16) {
+                if (s->index == 0) return fail(s, "repeat without a previous length");
+                len = s->lens[s->index - 1];
+                if (!take_bits(s, 2, &repeat)) return STEP_MORE;
+                repeat += 3;
+            }
+            else if (symbol == 17) {
+                if (!take_bits(s, 3, &repeat)) return STEP_MORE;
+                repeat += 3;
+            }
+            else {
+                if (!take_bits(s, 7, &repeat)) return STEP_MORE;
+                repeat += 11;
+            }
+            if (s->index + (int)repeat > s->nlen + s->ndist) return fail(s, "too many code lengths");
+            while (repeat-- > 0) s->lens[s->index++] = len;
+            return STEP_OK;
+        }
+        if (s->lens[256] == 0) return fail(s, "no end of block code");
+
+        // Incomplete codes are only allowed for a single length 1 code
+        int err = build_huffman(&s->lencode, s->lens, s->nlen);
+        if (err < 0 || (err > 0 && s->nlen - s->lencode.count[0] != 1)) return fail(s, "bad literal/length code");
+        err = build_huffman(&s->distcode, s->lens + s->nlen, s->ndist);
+        if (err < 0 || (err > 0 && s->ndist - s->distcode.count[0] != 1)) return fail(s, "bad distance code");
+        s->state = ST_CODES;
+        return STEP_OK;
+    }
+
+    case ST_CODES:
+        return step_codes(s, out, arg);
+
+    case ST_TRAILER:
+        align_to_byte(s);
+        if (s->format == INFLATE_FORMAT_GZIP) {
+            // CRC-32, then the size modulo 2^32, both little endian
+            if (!take_bits(s, 32, &v)) return STEP_MORE;
+            if (s->index++ == 0) {
+                if (!flush_window(s, out, arg)) return fail(s, "output failed");
+                return v == s->check ? STEP_OK : fail(s, "gzip CRC-32 mismatch");
+            }
+            if (v != (uint32_t)s->total_out) return fail(s, "gzip length mismatch");
+        }
+        else if (s->format == INFLATE_FORMAT_ZLIB) {
+            if (!take_bits(s, 32, &v)) return STEP_MORE;
+            if (!flush_window(s, out, arg)) return fail(s, "output failed");
+            v = ((v & 0xff) << 24) | ((v & 0xff00) << 8) | ((v >> 8) & 0xff00) | (v >> 24);
+            if (v != s->check) return fail(s, "zlib Adler-32 mismatch");
+        }
+        s->state = ST_DONE;
+        return STEP_OK;
+    }
+    return fail(s, "invalid state");
+}
+
+void inflate_stream_init(inflate_stream_t* s, int format) {
+    s->format = format;
+    s->error = NULL;
+    s->bit_buf = 0;
+    s->bit_count = 0;
+    s->last_block = false;
+    s->left = 0;
+    s->index = 0;
+    s->total_out = 0;
+    s->window_pos = s->flushed_pos = 0;
+    s->check = format == INFLATE_FORMAT_ZLIB ? 1 : 0;
+    switch (format) {
+    case INFLATE_FORMAT_GZIP: s->state = ST_GZIP_HEADER; break;
+    case INFLATE_FORMAT_ZLIB: s->state = ST_ZLIB_HEADER; break;
+    case INFLATE_FORMAT_AUTO: s->state = ST_AUTO_HEADER; break;
+    default: s->state = ST_BLOCK; break;
+    }
+}
+
+int inflate_stream_feed(inflate_stream_t* s, const char* in, size_t len, inflate_output_fn out, void* arg) {
+    const unsigned char* p = (const unsigned char*)in;
+
+    // Anything after the end of the stream is ignored
+    while (s->state != ST_ERROR && s->state != ST_DONE) {
+        refill(s, &p, &len);
+        uint64_t bit_buf = s->bit_buf;
+        int bit_count = s->bit_count;
+        int r = step(s, out, arg);
+        if (r == STEP_ERROR) return INFLATE_ERROR;
+        if (r == STEP_MORE) {
+            // All input is in the bit buffer by now, wait for more
+            s->bit_buf = bit_buf;
+            s->bit_count = bit_count;
+            break;
+        }
+    }
+
+    if (s->state == ST_ERROR) return INFLATE_ERROR;
+    if (!flush_window(s, out, arg)) {
+        fail(s, "output failed");
+        return INFLATE_ERROR;
+    }
+    return s->state == ST_DONE ? INFLATE_DONE : INFLATE_NEED_INPUT;
+}
@@ -0,0 +1,71 @@
+#ifndef PROTO_INFLATE_STREAM_H
+#define PROTO_INFLATE_STREAM_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Container around the deflate data
+#define INFLATE_FORMAT_RAW  0  // Bare deflate blocks (RFC 1951)
+#define INFLATE_FORMAT_ZLIB 1  // zlib header and Adler-32 trailer (RFC 1950)
+#define INFLATE_FORMAT_GZIP 2  // gzip member with CRC-32 trailer (RFC 1952)
+#define INFLATE_FORMAT_AUTO 3  // zlib if the stream starts with a zlib header, raw otherwise
+
+// Results of inflate_stream_feed
+#define INFLATE_NEED_INPUT  0  // All input consumed, stream not finished yet
+#define INFLATE_DONE        1  // End of stream reached and its trailer verified
+#define INFLATE_ERROR      -1  // Corrupt data, or the output callback failed
+
+#define INFLATE_WINDOW_SIZE 32768
+
+/** Receives decoded bytes in order, returns false to abort decoding */
+typedef bool (*inflate_output_fn)(const char* data, size_t len, void* arg);
+
+/** Canonical Huffman code */
+typedef struct inflate_huffman {
+    short count[16];   // Number of codes of each length
+    short symbol[288]; // Symbols ordered by code
+} inflate_huffman_t;
+
+/**
+ * Incremental inflate state, input may be split at any byte.
+ * About 34KB, so allocate it rather than putting it on the stack.
+ */
+typedef struct inflate_stream {
+    int format;
+    int state;
+    const char* error;          // Reason of an INFLATE_ERROR
+    uint64_t bit_buf;           // Input bits not consumed yet, LSB first
+    int bit_count;
+    bool last_block;
+    uint32_t left;              // Bytes left in a stored block or gzip header field
+    int index;                  // Position in the block or gzip header being read
+    int nlen, ndist, ncode;     // Dynamic block code counts
+    short lens[320];            // Code lengths of a dynamic block
+    unsigned char header[10];   // gzip fixed header
+    inflate_huffman_t lencode;
+    inflate_huffman_t distcode;
+    uint32_t check;             // CRC-32 or Adler-32 of the output
+    uint64_t total_out;
+    unsigned char window[INFLATE_WINDOW_SIZE];
+    uint32_t window_pos;        // Next write position in `window`
+    uint32_t flushed_pos;       // Bytes before this position were passed to the output callback
+} inflate_stream_t;
+
+/** Reset `s` for a new stream of `format` */
+extern void inflate_stream_init(inflate_stream_t* s, int format);
+
+/**
+ * Decode `len` bytes of `in`, passing the output to `out` as it is produced.
+ * Returns INFLATE_NEED_INPUT, INFLATE_DONE or INFLATE_ERROR.
+ */
+extern int inflate_stream_feed(inflate_stream_t* s, const char* in, size_t len, inflate_output_fn out, void* arg);
+
+#ifdef __cplusplus
+}
+#endif
+#endif // PROTO_INFLATE_STREAM_H
@@ -3,6 +3,10 @@
 #include <functional>
 
 int main(int argc, char* argv[]) {
+	// An image is only applied if it hashes to the published value, the version to report comes with it:
+	// ProtoTest <sha256> <version>
+	const char* expected_sha256 = argc > 2 ? argv[1] : "";
+	const char* expected_version = argc > 2 ? argv[2] : "";
 	hecsion::MqttOtaTask task(
 //		-user bWFzdGVyLeiAs+acuua1i+ivlQ==
 //		-password 595911d4-341d-436a-9611-2e8791e8bf44
@@ -13,37 +17,35 @@ int main(int argc, char* argv[]) {
 		"E01_ZC_WEBRTC_20250102_1740", // version
 		1 // qos
 	);
-	task.connect([&] (bool can_update, const char* ota_url) {
-		if (can_update) {
-			printf("OTA update available at: %s\n", ota_url);
-			size_t len = strlen(ota_url);
-			char* ota_url_copy = (char*)malloc(len);
-			if (ota_url_copy == nullptr) {
-				printf("Failed to allocate memory for OTA URL copy.\n");
-
-				task.send_ota_state_message(false, "E01_ZC_WEBRTC_20250102_1740"); // Assuming the current version is the same
-				return;
+	task.set_updater(
+		"/opt/ota/slot_a.bin", // slot A
+		"/opt/ota/slot_b.bin", // slot B
+		"/opt/ota/boot_slot", // read by the boot script to pick the slot
+		[&] (const char* slot, const char* sha256) -> string {
+			printf("OTA image in %s, sha256: %s\n", slot, sha256);
+			if (expected_sha256[0] == '\0' || mg_strcasecmp(mg_str(sha256), mg_str(expected_sha256)) != 0) {
+				printf("OTA image rejected, expected sha256: %s\n", expected_sha256[0] ? expected_sha256 : "none given");
+				return "";
 			}
-			memset(ota_url_copy, 0, len);
-			memcpy(ota_url_copy, ota_url, 4);
-			memcpy(ota_url_copy + 4, ota_url + 5, len - 5);
-			printf("OTA URL copy: %s\n", ota_url_copy);
-			void* res = malloc(1);
-			if (!((int64_t)res / 10 % 2)) {
-				printf("OTA update failed with success code: %d\n", res);
-				task.send_ota_state_message(true, "E01_ZC_WEBRTC_20250102_1740"); // Assuming the update is successful
+			return expected_version;
+		},
+		[&] (bool success, const char* version) {
+			if (success) {
+				printf("OTA update %s applied, it runs after a restart.\n", version);
 			}
 			else {
-				printf("OTA update failed with error code: %d\n", res);
-				task.send_ota_state_message(false, "E01_ZC_WEBRTC_20250102_1740"); // Assuming the current version is the same
-			}
-			if (res != NULL) {
-				free(res);
+				printf("OTA update failed, staying on %s.\n", version);
 			}
+			task.disconnect();
+		}
+	);
+	task.connect([&] (bool can_update, const char* ota_url) {
+		if (can_update) {
+			printf("OTA update available at: %s\n", ota_url);
 		}
 		else {
 			printf("No OTA update available.\n");
 		}
 	});
 	return 0;
-}
\ No newline at end of file
+}
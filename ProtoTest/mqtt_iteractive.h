@@ -4,6 +4,7 @@
 #include "mqtt_iteractive.h"
 #include "util.h"
 #include "json.h"
+#include "upload_queue.h"
 
 #include "mongoose.h"
 #include <time.h>
@@ -68,6 +69,8 @@ extern "C" {
 	 *	                  -avail_disk <size>    Optional. Set the available disk space in bytes (default is 0).
 	 *	                  -voltage <value>      Optional. Set the voltage level (default is 0).
      *                    -upload <interval>    Optional. Set the upload interval in milliseconds (default is 180000 ms).
+	 *                    -spool <dir>          Optional. Spool directory of the upload queue, needs -spool_url.
+	 *                    -spool_url <url>      Optional. URL the upload queue posts spooled files to, needs -spool.
 	 *                    -h, -help, -?         Show this help message.
 	 * @return 0 on success, or non-zero value on error.
 	 */
@@ -117,6 +120,7 @@ extern "C" {
     static int voltage = 0;                  // Voltage level as a string, used for report_property message
 
     static struct mg_connection* s_conn;              // Client connection
+    static volatile sig_atomic_t s_signo = 0;         // Signal that stops the event loop, 0 while running
 
 #define IS_KEY(json_obj, key) (strncmp(json_obj->name->string, key, json_obj->name->string_size) == 0)
 #define IS_VALUE_TYPE(json_obj, target_type) (json_obj->value->type == target_type)
@@ -475,6 +479,10 @@ extern "C" {
         send_pub_message(&msg);
     }
 
+    static void signal_handler(int signo) {
+        s_signo = signo;
+    }
+
     static void print_mqtt_main_usage() {
         printf("Usage: mqtt_main [options]\n");
         printf("Options:\n");
@@ -495,11 +503,15 @@ extern "C" {
         printf("  -avail_disk <size>    Optional. Set the available disk space in bytes (default is 0).\n");
         printf("  -voltage <value>      Optional. Set the voltage level (default is 0).\n");
 		printf("  -upload <interval>    Optional. Set the upload interval in milliseconds (default is 180000 ms).\n");
+        printf("  -spool <dir>          Optional. Spool directory of the upload queue, needs -spool_url.\n");
+        printf("  -spool_url <url>      Optional. URL the upload queue posts spooled files to, needs -spool.\n");
         printf("  -h, -help, -?         Show this help message.\n");
     }
 
     int mqtt_interactive_main(int argc, char* argv[]) {
         int64_t upload_interval = 3 * 60 * 1000L;
+        upload_queue_opts_t spool_opts;
+        memset(&spool_opts, 0, sizeof(spool_opts));
         for (int i = 1; i < argc - 1; i++) {
             if (!strcmp("-user", argv[i])) {
                 user = argv[++i];  // Set user account
@@ -583,6 +595,12 @@ extern "C" {
 					return 1;
 				}
 			}
+            else if (!strcmp("-spool", argv[i])) {
+                spool_opts.spool_dir = argv[++i];  // Set upload queue spool directory
+            }
+            else if (!strcmp("-spool_url", argv[i])) {
+                spool_opts.url = argv[++i];  // Set upload queue URL
+            }
             else {
                 printf("Unknown option: %s\n", argv[i]);
                 print_mqtt_main_usage();
@@ -604,7 +622,16 @@ extern "C" {
         mg_mgr_init(&mgr);
         mg_timer_add(&mgr, 3000, MG_TIMER_REPEAT | MG_TIMER_RUN_NOW, timer_reconn_fn, &mgr);
         mg_timer_add(&mgr, upload_interval, MG_TIMER_REPEAT | MG_TIMER_RUN_NOW, timer_upload_fun, null);
-        while (1) mg_mgr_poll(&mgr, 1000);  // Event loop, 1s timeout
+        // Logs, snapshots and crash dumps put into the spool by other processes are sent from this loop
+        if ((spool_opts.spool_dir || spool_opts.url) && !upload_queue_init(&mgr, &spool_opts)) {
+            mg_mgr_free(&mgr);
+            return 1;
+        }
+        // SIGINT or SIGTERM end the loop, so files still in the spool are closed cleanly
+        signal(SIGINT, signal_handler);
+        signal(SIGTERM, signal_handler);
+        while (s_signo == 0) mg_mgr_poll(&mgr, 1000);  // Event loop, 1s timeout
+        upload_queue_free();
         mg_mgr_free(&mgr);                  // Finished, cleanup
 
         return 0;
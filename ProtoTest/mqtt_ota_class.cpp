@@ -1,6 +1,9 @@
 #include "mqtt_ota_class.h"
 #include "util.h"
-#include "json.h"
+
+#if MG_ARCH == MG_ARCH_WIN32
+#include <io.h>
+#endif
 
 hecsion::MqttOtaTask::MqttOtaTask(
 	string user, 
@@ -9,6 +12,17 @@ hecsion::MqttOtaTask::MqttOtaTask(
 	string name, 
 	string version, 
 	int qos
+) : MqttOtaTask(null, user, password, sn, name, version, qos) {
+}
+
+hecsion::MqttOtaTask::MqttOtaTask(
+	struct mg_mgr* mgr,
+	string user,
+	string password,
+	string sn,
+	string name,
+	string version,
+	int qos
 ) {
 	this->user = user;
 	this->password = password;
@@ -17,122 +31,246 @@ hecsion::MqttOtaTask::MqttOtaTask(
 	this->version = version;
 	this->qos = qos;
 	this->callback = nullptr;
-	this->client_id = mg_mprintf(client_id_fmt, name.c_str(), sn.c_str());
-	this->mqtt_pub_topic = mg_mprintf(mqtt_sub_topic_fmt, client_id.c_str());
-	this->mqtt_result_sub_topic = mg_mprintf(mqtt_result_pub_topic_fmt, client_id.c_str());
-	this->mqtt_on_success_pub_topic = mg_mprintf(mqtt_on_success_pub_topic_fmt, client_id.c_str());
-	this->mqtt_on_fail_pub_topic = mg_mprintf(mqtt_on_fail_pub_topic_fmt, client_id.c_str());
+	this->verify = nullptr;
+	this->update_done = nullptr;
+	this->update_slot = 'b';
+	this->hashed_size = 0;
+	this->client_id = take_string(mg_mprintf(client_id_fmt, name.c_str(), sn.c_str()));
+	this->mqtt_pub_topic = take_string(mg_mprintf(mqtt_sub_topic_fmt, client_id.c_str()));
+	this->mqtt_result_sub_topic = take_string(mg_mprintf(mqtt_result_pub_topic_fmt, client_id.c_str()));
+	this->mqtt_on_success_pub_topic = take_string(mg_mprintf(mqtt_on_success_pub_topic_fmt, client_id.c_str()));
+	this->mqtt_on_fail_pub_topic = take_string(mg_mprintf(mqtt_on_fail_pub_topic_fmt, client_id.c_str()));
+	// The messages differ in the version only, so the rest is formatted once here
+	this->message_head = take_string(mg_mprintf(
+		"{"
+			"\"messageType\": \"OTA\","
+			"\"clientId\":%m,"
+			"\"messageId\":null,"
+			"\"properties\":{"
+				"\"deviceSN\":%m,"
+				"\"deviceName\":%m,"
+				"\"otaVersion\":",
+		MG_ESC(this->client_id.c_str()), MG_ESC(this->sn.c_str()), MG_ESC(this->name.c_str())
+	));
+	this->message_tail = take_string(mg_mprintf(
+				",\"userName\":%m"
+			"}"
+		"}", MG_ESC(this->user.c_str())
+	));
+	memset(&this->message_buf, 0, sizeof(this->message_buf));
+	this->message_buf.align = 256;
 	this->mqtt_url = "mqtt://36.137.92.217:1007";
 	this->mqtt_conn = null;
-	this->state = STATE_RUNNING;
-	mg_mgr_init(&mgr);
+	this->state = STATE_DONE;
+	this->reconnect_timer = null;
+	this->command_conn = null;
+	this->command_id = 0;
+	this->owns_mgr = mgr == null;
+	if (this->owns_mgr) {
+		mg_mgr_init(&own_mgr);
+		this->mgr = &own_mgr;
+	}
+	else {
+		this->mgr = mgr;
+	}
 }
 
 hecsion::MqttOtaTask::~MqttOtaTask()
 {
-	mg_mgr_free(&mgr);
+	// Its timer is on the manager, and it must not report anything from here
+	transfer.reset();
+	if (owns_mgr) {
+		mg_mgr_free(&own_mgr);
+	}
+	else {
+		// The manager goes on without the task
+		this->callback = nullptr;
+		stop();
+		if (reconnect_timer != null) {
+			mg_timer_free(&mgr->timers, reconnect_timer);
+			free(reconnect_timer);
+		}
+	}
+	mg_iobuf_free(&message_buf);
 }
 
 void hecsion::MqttOtaTask::connect(std::function<void(bool, const char*)> callback)
+{
+	start(std::move(callback));
+	while (this->state == STATE_RUNNING) poll(1000);
+	// Let the last messages out, such as the state of an update reported right before `disconnect`
+	for (uint64_t until = mg_millis() + 1000; mg_millis() < until;) {
+		struct mg_connection* c = mgr->conns;
+		while (c != null && !c->is_draining) c = c->next;
+		if (c == null) break;
+		mg_mgr_poll(mgr, 50);
+	}
+}
+
+void hecsion::MqttOtaTask::start(std::function<void(bool, const char*)> callback)
 {
 	this->callback = std::move(callback);
 	this->state = STATE_RUNNING;
-	struct mg_mqtt_opts opts;
-	memset(&opts, 0, sizeof(opts));
-	opts.clean = true;
-	opts.user = mg_str(this->user.c_str());
-	opts.pass = mg_str(this->password.c_str());
-	opts.qos = this->qos;
-	opts.topic = mg_str(this->mqtt_result_sub_topic.c_str());
-	opts.client_id = mg_str(this->client_id.c_str());
-	mg_timer_add(&mgr, 3000, MG_TIMER_REPEAT | MG_TIMER_RUN_NOW, reconnect_callback, this);
-	if (this->mqtt_conn == null) this->mqtt_conn = mg_mqtt_connect(&mgr, this->mqtt_url.c_str(), &opts, hecsion::MqttOtaTask::mqtt_callback_fn, this);
-
-	while (this->state == STATE_RUNNING) mg_mgr_poll(&mgr, 1000);
+	// The timer connects at once and reconnects whenever the connection is lost
+	if (reconnect_timer == null) {
+		reconnect_timer = mg_timer_add(mgr, 3000, MG_TIMER_REPEAT | MG_TIMER_RUN_NOW, reconnect_callback, this);
+	}
+	if (this->mqtt_conn == null) reconnect_callback(this);
+
+	// Commands of other threads wake the poll at once through the socket pair of the manager.
+	// They are addressed to a connection of the task that stays while it runs, unlike the MQTT one
+	if (command_conn == null) {
+		if (mgr->pipe == MG_INVALID_SOCKET) mg_wakeup_init(mgr);
+		command_conn = mg_listen(mgr, "udp://127.0.0.1:0", command_callback_fn, this);
+		if (mgr->pipe == MG_INVALID_SOCKET || command_conn == null) {
+			MG_ERROR(("Commands from other threads are not available"));
+		}
+		else {
+			command_id = command_conn->id;
+		}
+	}
+}
+
+bool hecsion::MqttOtaTask::poll(int timeout_ms)
+{
+	mg_mgr_poll(mgr, timeout_ms);
+	return this->state == STATE_RUNNING;
+}
+
+bool hecsion::MqttOtaTask::is_running() const
+{
+	return this->state == STATE_RUNNING;
+}
+
+size_t hecsion::MqttOtaTask::socket_fds(long* fds, bool* writes, size_t count) const
+{
+	size_t n = 0;
+	for (struct mg_connection* c = mgr->conns; c != null; c = c->next) {
+		if (c->fd == null) continue;
+		if (n < count) {
+			fds[n] = (long)(size_t)c->fd;
+			if (writes != null) writes[n] = c->is_connecting || c->send.len > 0;
+		}
+		n++;
+	}
+	return n;
 }
 
 void hecsion::MqttOtaTask::disconnect()
 {
 	this->state = STATE_DONE;
 	this->callback = nullptr;
+	stop();
 }
 
-void hecsion::MqttOtaTask::send_ota_request_pub_message() {
-	if (mqtt_conn == null) {
-		MG_INFO(("MQTT connection is not established.\n"));
-		return;
+/** Close the connection and drop the reconnect timer, so that nothing of the task is left on the manager */
+void hecsion::MqttOtaTask::stop()
+{
+	// Reported as failed while the connection is still there
+	if (is_updating()) transfer->cancel();
+	if (mqtt_conn != null) {
+		mqtt_conn->is_draining = 1;
+		mqtt_conn->fn_data = null;
+		mqtt_conn = null;
 	}
-	const char* msg = mg_mprintf(
-		"{"
-			"\"messageType\": \"OTA\","
-			"\"clientId\":\"%s\","
-			"\"messageId\":null,"
-			"\"properties\":{"
-				"\"deviceSN\":\"%s\","
-				"\"deviceName\":\"%s\","
-				"\"otaVersion\":\"%s\","
-				"\"userName\":\"%s\""
-			"}"
-		"}", this->client_id.c_str(), this->sn.c_str(), this->name.c_str(), this->version.c_str(), this->user.c_str()
-	);
-	struct mg_mqtt_opts pub_opts;
-	memset(&pub_opts, 0, sizeof(pub_opts));
-	pub_opts.topic = mg_str(mqtt_pub_topic.c_str());
-	pub_opts.message = mg_str(msg);
-	pub_opts.qos = qos;
-	pub_opts.retain = false;
-	pub_opts.user = mg_str(user.c_str());
-	pub_opts.pass = mg_str(password.c_str());
-	pub_opts.client_id = mg_str(client_id.c_str());
-	mg_mqtt_pub(mqtt_conn, &pub_opts);
-	MG_INFO(("sent message: ### %s ### to topic *** %s ***", msg, mqtt_pub_topic.c_str()));
+	command_id = 0;
+	if (command_conn != null) {
+		command_conn->is_closing = 1;
+		command_conn->fn_data = null;
+		command_conn = null;
+	}
+}
+
+bool hecsion::MqttOtaTask::post_disconnect()
+{
+	command_t command;
+	memset(&command, 0, sizeof(command));
+	command.type = COMMAND_DISCONNECT;
+	return post_command(&command);
+}
+
+bool hecsion::MqttOtaTask::post_ota_state_message(bool success, const char* ver)
+{
+	command_t command;
+	memset(&command, 0, sizeof(command));
+	if (ver == null || strlen(ver) >= sizeof(command.version)) return false;
+	command.type = COMMAND_STATE;
+	command.success = success;
+	strcpy(command.version, ver);
+	return post_command(&command);
+}
+
+bool hecsion::MqttOtaTask::post_check()
+{
+	command_t command;
+	memset(&command, 0, sizeof(command));
+	command.type = COMMAND_CHECK;
+	return post_command(&command);
+}
+
+/** Send `command` to the command connection, mg_wakeup is the only call here that touches the manager */
+bool hecsion::MqttOtaTask::post_command(const command_t* command)
+{
+	unsigned long id = command_id;
+	if (id == 0) return false;
+	return mg_wakeup(mgr, id, command, sizeof(*command));
+}
+
+void hecsion::MqttOtaTask::send_ota_request_pub_message() {
+	publish_ota_message(mqtt_pub_topic, this->version.c_str());
 }
 
-void hecsion::MqttOtaTask::send_ota_state_message(bool success, string ver)
+void hecsion::MqttOtaTask::send_ota_state_message(bool success, const string& ver)
+{
+	send_ota_state_message(success, ver.c_str());
+}
+
+void hecsion::MqttOtaTask::send_ota_state_message(bool success, const char* ver)
+{
+	publish_ota_message(success ? mqtt_on_success_pub_topic : mqtt_on_fail_pub_topic, ver);
+}
+
+/** Publish the OTA message carrying `ver` to `topic`, with no allocation once `message_buf` is big enough */
+void hecsion::MqttOtaTask::publish_ota_message(const string& topic, const char* ver)
 {
 	if (mqtt_conn == null) {
 		MG_INFO(("MQTT connection is not established.\n"));
 		return;
 	}
-	const char* msg = mg_mprintf(
-		"{"
-			"\"messageType\": \"OTA\","
-			"\"clientId\":\"%s\","
-			"\"messageId\":null,"
-			"\"properties\":{"
-				"\"deviceSN\":\"%s\","
-				"\"deviceName\":\"%s\","
-				"\"otaVersion\":\"%s\","
-				"\"userName\": %s"
-			"}"
-		"}", this->client_id.c_str(), this->sn.c_str(), this->name.c_str(), ver.c_str(), this->user.c_str()
-	);
+	message_buf.len = 0;
+	mg_xprintf(mg_pfn_iobuf, &message_buf, "%s%m%s", message_head.c_str(), MG_ESC(ver), message_tail.c_str());
 	struct mg_mqtt_opts pub_opts;
 	memset(&pub_opts, 0, sizeof(pub_opts));
-	pub_opts.topic = mg_str(success ? mqtt_on_success_pub_topic.c_str() : mqtt_on_fail_pub_topic.c_str());
-	pub_opts.message = mg_str(msg);
+	pub_opts.topic = mg_str_n(topic.c_str(), topic.size());
+	pub_opts.message = mg_str_n((const char*)message_buf.buf, message_buf.len);
 	pub_opts.qos = qos;
 	pub_opts.retain = false;
-	pub_opts.user = mg_str(user.c_str());
-	pub_opts.pass = mg_str(password.c_str());
-	pub_opts.client_id = mg_str(client_id.c_str());
 	mg_mqtt_pub(mqtt_conn, &pub_opts);
-	MG_INFO(("sent message: ### %s ### to topic *** %s ***", msg, success ? mqtt_on_success_pub_topic.c_str() : mqtt_on_fail_pub_topic.c_str()));
+	MG_INFO(("sent message: ### %.*s ### to topic *** %s ***", (int)message_buf.len, message_buf.buf, topic.c_str()));
 }
 
 void hecsion::MqttOtaTask::process_received_data(const mg_str* data)
 {
 	ota_response_t response;
-	bool success = parse_response(data->buf, data->len, &response);
+	bool success = parse_response(*data, &response);
 	if (!success) {
 		MG_INFO(("Failed to parse response data: %.*s", (int)data->len, data->buf));
 		return;
 	}
 	if (response.code == 200) {
-		MG_INFO(("OTA update available: %s", response.properties.remoteUrl ? response.properties.remoteUrl : "No URL provided"));
-		if (response.properties.hasNew && response.properties.remoteUrl) {
+		MG_INFO(("OTA update available: %.*s", (int)response.properties.remoteUrl.len, response.properties.remoteUrl.buf ? response.properties.remoteUrl.buf : "No URL provided"));
+		if (response.properties.hasNew && response.properties.remoteUrl.buf != null) {
+			// The callback takes a C string, so only the URL is copied, into a buffer kept for the next reply
+			struct mg_str url = response.properties.remoteUrl;
+			if (!unescape_string(url, remote_url)) {
+				MG_INFO(("Invalid remoteUrl: %.*s", (int)url.len, url.buf));
+				return;
+			}
 			if (callback != nullptr) {
-				callback(true, response.properties.remoteUrl);
+				callback(true, remote_url.c_str());
+			}
+			if (!slot_a.empty() && this->state == STATE_RUNNING) {
+				start_update(remote_url.c_str());
 			}
 		}
 		else {
@@ -143,101 +281,295 @@ void hecsion::MqttOtaTask::process_received_data(const mg_str* data)
 		}
 	}
 	else {
-		MG_INFO(("OTA command failed with code: %d, message: %s", response.code, response.message ? response.message : "No message"));
+		MG_INFO(("OTA command failed with code: %d, message: %.*s", response.code, (int)response.message.len, response.message.buf ? response.message.buf : "No message"));
 		this->state = STATE_ERROR;
+		stop();
+	}
+}
+
+void hecsion::MqttOtaTask::set_updater(
+	string slot_a,
+	string slot_b,
+	string boot_slot_file,
+	std::function<string(const char*, const char*)> verify,
+	std::function<void(bool, const char*)> done
+) {
+	this->slot_a = slot_a;
+	this->slot_b = slot_b;
+	this->boot_slot_file = boot_slot_file;
+	this->verify = std::move(verify);
+	this->update_done = std::move(done);
+}
+
+bool hecsion::MqttOtaTask::is_updating() const
+{
+	return transfer != nullptr && transfer->is_running();
+}
+
+/** Download the image at `url` into the slot that does not boot now, see `set_updater` */
+void hecsion::MqttOtaTask::start_update(const char* url)
+{
+	if (is_updating()) {
+		MG_INFO(("OTA update is being downloaded already"));
 		return;
 	}
+	char boot_slot = 'a';
+	FILE* fp = fopen(boot_slot_file.c_str(), "rb");
+	if (fp != null) {
+		if (fgetc(fp) == 'b') boot_slot = 'b';
+		fclose(fp);
+	}
+	this->update_slot = boot_slot == 'a' ? 'b' : 'a';
+	const string& slot = update_slot == 'a' ? slot_a : slot_b;
+	MG_INFO(("Downloading OTA update %s to slot %c: %s", url, update_slot, slot.c_str()));
+
+	mg_sha256_init(&image_hash);
+	hashed_size = 0;
+	transfer.reset(new HttpTransfer(mgr, HttpTransfer::DOWNLOAD, url, slot));
+	transfer->set_data_callback([this](int64_t offset, const char* data, size_t len) {
+		if (offset == 0) {
+			mg_sha256_init(&image_hash);
+			hashed_size = 0;
+		}
+		else if (offset != hashed_size) {
+			return false;
+		}
+		mg_sha256_update(&image_hash, (const unsigned char*)data, len);
+		hashed_size += (int64_t)len;
+		return true;
+	});
+	bool started = transfer->start([this](bool success, const char* message) {
+		finish_update(success, message);
+	});
+	if (!started) {
+		finish_update(false, "Failed to open the slot");
+	}
 }
 
-#ifndef IS_KEY
-#define IS_KEY(json_obj, key) (strncmp(json_obj->name->string, key, json_obj->name->string_size) == 0)
-#endif
+/** Verify the downloaded image, boot its slot next and report the result */
+void hecsion::MqttOtaTask::finish_update(bool success, const char* message)
+{
+	string new_version;
+	if (success) {
+		unsigned char digest[32];
+		char hex[sizeof(digest) * 2 + 1];
+		mg_sha256_final(digest, &image_hash);
+		mg_snprintf(hex, sizeof(hex), "%M", mg_print_hex, (int)sizeof(digest), digest);
+		const string& slot = update_slot == 'a' ? slot_a : slot_b;
+		MG_INFO(("OTA image in slot %c: %lld bytes, sha256 %s", update_slot, (long long)hashed_size, hex));
+		if (hashed_size != transfer->transferred()) {
+			success = false;
+			message = "Image was not hashed completely";
+		}
+		else {
+			new_version = verify != nullptr ? verify(slot.c_str(), hex) : "";
+			if (new_version.empty()) {
+				success = false;
+				message = "Image rejected";
+			}
+			else if (!switch_boot_slot(update_slot)) {
+				success = false;
+				message = "Failed to switch the boot slot";
+			}
+		}
+	}
+	if (success) {
+		MG_INFO(("OTA update %s applied to slot %c", new_version.c_str(), update_slot));
+	}
+	else {
+		MG_INFO(("OTA update failed: %s", message != null ? message : "unknown error"));
+	}
+	const char* reported = success ? new_version.c_str() : this->version.c_str();
+	send_ota_state_message(success, reported);
+	if (update_done != nullptr) {
+		update_done(success, reported);
+	}
+}
 
-#ifndef IS_VALUE_TYPE
-#define IS_VALUE_TYPE(json_obj, target_type) (json_obj->value->type == target_type)
+/**
+ * Make `slot` the one to boot. The file is replaced in one step, so a power cut leaves the old or the new one.
+ * The image itself was synced by the transfer, only the new file and the rename are synced here
+ */
+bool hecsion::MqttOtaTask::switch_boot_slot(char slot)
+{
+	string tmp = boot_slot_file + ".tmp";
+	FILE* fp = fopen(tmp.c_str(), "wb");
+	if (fp == null) return false;
+	bool ok = fputc(slot, fp) != EOF && fflush(fp) == 0;
+#if MG_ARCH == MG_ARCH_WIN32
+	ok = ok && _commit(_fileno(fp)) == 0;
+#else
+	ok = ok && fsync(fileno(fp)) == 0;
 #endif
-
-bool hecsion::MqttOtaTask::parse_response(const char* json_data, size_t len, ota_response_t* cmd) {
-	MG_INFO(("start to parse response: %s", json_data));
-	json_value_t* json_obj = json_parse(json_data, len);
-	if (json_obj == null) {
-		MG_INFO(("Failed to parse JSON data: %s", json_data));
+	ok = fclose(fp) == 0 && ok;
+#if MG_ARCH == MG_ARCH_WIN32
+	remove(boot_slot_file.c_str());
+#endif
+	if (!ok || rename(tmp.c_str(), boot_slot_file.c_str()) != 0) {
+		remove(tmp.c_str());
 		return false;
 	}
-	memset(cmd, 0, sizeof(ota_response_t));
-	if (json_obj->type != json_type_object) {
-		MG_INFO(("JSON data is not an object: %s", json_data));
-		goto on_fail;
+#if MG_ARCH != MG_ARCH_WIN32
+	// The rename is a change of the directory, which has to be synced by itself.
+	// The slot is switched already, a failure only means a power cut may undo it
+	size_t slash = boot_slot_file.find_last_of('/');
+	string dir = slash == string::npos ? "." : slash == 0 ? "/" : boot_slot_file.substr(0, slash);
+	int fd = open(dir.c_str(), O_RDONLY);
+	if (fd < 0 || fsync(fd) != 0) {
+		MG_ERROR(("Failed to sync %s: %s", dir.c_str(), strerror(errno)));
 	}
-	else {
-		json_object_t* obj = (json_object_t*)json_obj->payload;
-		json_object_element_t* elem = obj->start;
-		while (elem) {
-			if (IS_KEY(elem, "code") && IS_VALUE_TYPE(elem, json_type_number)) {
-				json_number_t* code_num = json_value_as_number(elem->value);
-				if (code_num == null) {
-					MG_INFO(("Failed to get code from command"));
-					goto on_fail;
-				}
-				bool success = false;
-				cmd->code = string_to_long(code_num->number, code_num->number_size, &success);
-				if (!success) {
-					MG_INFO(("Failed to parse code from command"));
-					goto on_fail;
+	if (fd >= 0) close(fd);
+#endif
+	return true;
+}
+
+/** Copy a string of mg_mprintf and free it */
+string hecsion::MqttOtaTask::take_string(char* str)
+{
+	string result = str != null ? str : "";
+	free(str);
+	return result;
+}
+
+/**
+ * Unescape a JSON string into `out`, `\uXXXX` escapes and surrogate pairs become UTF-8.
+ * Unlike mg_json_unescape, `\/` is accepted, as servers often escape the slashes of URLs.
+ * `\u0000` is rejected, the result is used as a C string.
+ */
+bool hecsion::MqttOtaTask::unescape_string(struct mg_str str, string& out)
+{
+	out.clear();
+	for (size_t i = 0; i < str.len; i++) {
+		char c = str.buf[i];
+		if (c != '\\') {
+			out += c;
+			continue;
+		}
+		if (i + 1 >= str.len) return false;
+		c = str.buf[++i];
+		if (c == 'u') {
+			uint16_t unit = 0;
+			if (i + 4 >= str.len || !mg_str_to_num(mg_str_n(str.buf + i + 1, 4), 16, &unit, sizeof(unit))) return false;
+			i += 4;
+			uint32_t cp = unit;
+			if (unit >= 0xd800 && unit <= 0xdbff) {
+				// A high surrogate, the low one must follow
+				uint16_t low = 0;
+				if (i + 6 >= str.len || str.buf[i + 1] != '\\' || str.buf[i + 2] != 'u' ||
+					!mg_str_to_num(mg_str_n(str.buf + i + 3, 4), 16, &low, sizeof(low)) ||
+					low < 0xdc00 || low > 0xdfff) {
+					return false;
 				}
+				i += 6;
+				cp = 0x10000 + (((uint32_t)unit - 0xd800) << 10) + ((uint32_t)low - 0xdc00);
 			}
-			else if (IS_KEY(elem, "message") && IS_VALUE_TYPE(elem, json_type_string)) {
-				json_string_t* message_str = (json_string_t*)elem->value->payload;
-				cmd->message = mg_mprintf("%.*s", message_str->string_size, message_str->string);
+			else if ((unit >= 0xdc00 && unit <= 0xdfff) || unit == 0) {
+				return false;
 			}
-			else if (IS_KEY(elem, "messageType") && IS_VALUE_TYPE(elem, json_type_string)) {
-				json_string_t* type_str = (json_string_t*)elem->value->payload;
-				cmd->messageType = mg_mprintf("%.*s", type_str->string_size, type_str->string);
+			if (cp < 0x80) {
+				out += (char)cp;
 			}
-			else if (IS_KEY(elem, "clientId") && IS_VALUE_TYPE(elem, json_type_string)) {
-				json_string_t* client_id_str = (json_string_t*)elem->value->payload;
-				cmd->clientId = mg_mprintf("%.*s", client_id_str->string_size, client_id_str->string);
+			else if (cp < 0x800) {
+				out += (char)(0xc0 | (cp >> 6));
+				out += (char)(0x80 | (cp & 0x3f));
 			}
-			else if (IS_KEY(elem, "messageId") && IS_VALUE_TYPE(elem, json_type_string)) {
-				json_string_t* message_id_str = (json_string_t*)elem->value->payload;
-				cmd->messageId = mg_mprintf("%.*s", message_id_str->string_size, message_id_str->string);
+			else if (cp < 0x10000) {
+				out += (char)(0xe0 | (cp >> 12));
+				out += (char)(0x80 | ((cp >> 6) & 0x3f));
+				out += (char)(0x80 | (cp & 0x3f));
 			}
-			else if (IS_KEY(elem, "properties") && IS_VALUE_TYPE(elem, json_type_object)) {
-				json_object_t* object = (json_object_t*)elem->value->payload;
-				json_object_element_t* cmd_elem = object->start;
-				while (cmd_elem) {
-					if (IS_KEY(cmd_elem, "hasNew")) {
-						if (IS_VALUE_TYPE(cmd_elem, json_type_true)) {
-							cmd->properties.hasNew = true;
-						}
-						else {
-							cmd->properties.hasNew = false;
-						}
-					} 
-					else if (IS_KEY(cmd_elem, "remoteUrl") && IS_VALUE_TYPE(cmd_elem, json_type_string)) {
-						json_string_t* remoteUrl = (json_string_t*)cmd_elem->value->payload;
-						cmd->properties.remoteUrl = mg_mprintf("%.*s", remoteUrl->string_size, remoteUrl->string);
-					}
-					cmd_elem = cmd_elem->next;
-				}
+			else {
+				out += (char)(0xf0 | (cp >> 18));
+				out += (char)(0x80 | ((cp >> 12) & 0x3f));
+				out += (char)(0x80 | ((cp >> 6) & 0x3f));
+				out += (char)(0x80 | (cp & 0x3f));
 			}
-
-			elem = elem->next;
+		}
+		else if (c == '/' || c == '\\' || c == '"') {
+			out += c;
+		}
+		else {
+			static const char* const escapes = "bfnrt";
+			const char* esc = strchr(escapes, c);
+			if (c == '\0' || esc == null) return false;
+			out += "\b\f\n\r\t"[esc - escapes];
 		}
 	}
+	return true;
+}
 
-	free(json_obj);
+#ifndef IS_KEY
+#define IS_KEY(key, name) ((key).len == sizeof(name) + 1 && memcmp((key).buf + 1, name, sizeof(name) - 1) == 0)
+#endif
+
+#ifndef STRING_VALUE
+#define STRING_VALUE(val) ((val).len >= 2 && (val).buf[0] == '"' ? mg_str_n((val).buf + 1, (val).len - 2) : mg_str_n(null, 0))
+#endif
+
+bool hecsion::MqttOtaTask::parse_response(struct mg_str json, ota_response_t* cmd) {
+	MG_INFO(("start to parse response: %.*s", (int)json.len, json.buf));
+	memset(cmd, 0, sizeof(ota_response_t));
+	while (json.len > 0 && isspace((unsigned char)json.buf[0])) json.buf++, json.len--;
+	if (json.len == 0 || json.buf[0] != '{') {
+		MG_INFO(("JSON data is not an object: %.*s", (int)json.len, json.buf));
+		return false;
+	}
+	struct mg_str key, val;
+	size_t ofs = 0, end = 1;
+	while ((ofs = mg_json_next(json, ofs, &key, &val)) > 0) {
+		end = ofs;
+		if (IS_KEY(key, "code") && val.len > 0 && (val.buf[0] == '-' || isdigit((unsigned char)val.buf[0]))) {
+			bool success = false;
+			cmd->code = (int)string_to_long(val.buf, (int)val.len, &success);
+			if (!success) {
+				MG_INFO(("Failed to parse code from command"));
+				return false;
+			}
+		}
+		else if (IS_KEY(key, "message")) {
+			cmd->message = STRING_VALUE(val);
+		}
+		else if (IS_KEY(key, "messageType")) {
+			cmd->messageType = STRING_VALUE(val);
+		}
+		else if (IS_KEY(key, "clientId")) {
+			cmd->clientId = STRING_VALUE(val);
+		}
+		else if (IS_KEY(key, "messageId")) {
+			cmd->messageId = STRING_VALUE(val);
+		}
+		else if (IS_KEY(key, "properties") && val.len > 0 && val.buf[0] == '{') {
+			parse_properties(val, cmd);
+		}
+	}
+	// mg_json_next stops at the end and on an error alike, only the former leaves the closing brace
+	while (end < json.len && isspace((unsigned char)json.buf[end])) end++;
+	if (end >= json.len || json.buf[end] != '}') {
+		MG_INFO(("Failed to parse JSON data: %.*s", (int)json.len, json.buf));
+		return false;
+	}
 	return true;
+}
 
-on_fail:
-	free(json_obj);
-	return false;
+void hecsion::MqttOtaTask::parse_properties(struct mg_str json, ota_response_t* cmd)
+{
+	struct mg_str key, val;
+	size_t ofs = 0;
+	while ((ofs = mg_json_next(json, ofs, &key, &val)) > 0) {
+		if (IS_KEY(key, "hasNew")) {
+			cmd->properties.hasNew = mg_strcmp(val, mg_str("true")) == 0;
+		}
+		else if (IS_KEY(key, "remoteUrl")) {
+			cmd->properties.remoteUrl = STRING_VALUE(val);
+		}
+	}
 }
 
 void hecsion::MqttOtaTask::reconnect_callback(void* arg)
 {
 	hecsion::MqttOtaTask* task = (hecsion::MqttOtaTask*)arg;
-	struct mg_mgr* mgr = &task->mgr;
+	struct mg_mgr* mgr = task->mgr;
+	if (task->state != STATE_RUNNING) return;
 	struct mg_mqtt_opts opts;
 	memset(&opts, 0, sizeof(opts));
 	opts.clean = true;
@@ -254,6 +586,7 @@ void hecsion::MqttOtaTask::reconnect_callback(void* arg)
 void hecsion::MqttOtaTask::mqtt_callback_fn(mg_connection* c, int ev, void* ev_data)
 {
 	hecsion::MqttOtaTask* task = (hecsion::MqttOtaTask*) c->fn_data;
+	if (task == null) return; // Left behind by a stopped task
 	char time[10] = { 0 };
 	format_current_time(time);
 	if (ev == MG_EV_OPEN) {
@@ -272,6 +605,12 @@ void hecsion::MqttOtaTask::mqtt_callback_fn(mg_connection* c, int ev, void* ev_d
 		// MQTT connect is successful
 		struct mg_str subt = mg_str(task->mqtt_result_sub_topic.c_str());
 		MG_INFO(("%s \t%lu CONNECTED to %s", time, c->id, task->mqtt_url.c_str()));
+		// The answer to the request arrives on the result topic
+		struct mg_mqtt_opts sub_opts;
+		memset(&sub_opts, 0, sizeof(sub_opts));
+		sub_opts.topic = subt;
+		sub_opts.qos = task->qos;
+		mg_mqtt_sub(c, &sub_opts);
 		task->send_ota_request_pub_message();
 	}
 	else if (ev == MG_EV_MQTT_MSG) {
@@ -286,5 +625,31 @@ void hecsion::MqttOtaTask::mqtt_callback_fn(mg_connection* c, int ev, void* ev_d
 	}
 }
 
+void hecsion::MqttOtaTask::command_callback_fn(mg_connection* c, int ev, void* ev_data)
+{
+	hecsion::MqttOtaTask* task = (hecsion::MqttOtaTask*)c->fn_data;
+	if (task == null) return; // Left behind by a stopped task
+	if (ev == MG_EV_READ) {
+		c->recv.len = 0; // Nobody is meant to send datagrams here
+	}
+	else if (ev == MG_EV_WAKEUP) {
+		struct mg_str* data = (struct mg_str*)ev_data;
+		command_t command;
+		if (data->len != sizeof(command)) return;
+		memcpy(&command, data->buf, sizeof(command));
+		if (command.type == COMMAND_DISCONNECT) {
+			MG_INFO(("Disconnect requested"));
+			task->disconnect();
+		}
+		else if (command.type == COMMAND_STATE) {
+			command.version[sizeof(command.version) - 1] = '\0';
+			task->send_ota_state_message(command.success, command.version);
+		}
+		else if (command.type == COMMAND_CHECK) {
+			task->send_ota_request_pub_message();
+		}
+	}
+}
+
 
 
@@ -3,25 +3,32 @@
 #define HECSION_MQTT_OTA_CLASS
 
 #include "mongoose.h"
+#include "http_transfer.h"
 #include <cctype>
 #include <cstring>
 #include <string>
 #include <cstdio>
 #include <functional>
+#include <atomic>
+#include <memory>
 
 using namespace std;
 
 namespace hecsion {
 
+	/**
+	 * Reply of the OTA server. The strings are views into the received MQTT message, so they
+	 * stay valid only while it is handled, and are still JSON-escaped. A missing one has a null `buf`.
+	 */
 	typedef struct {
 		int code;					// Response code, 200 for success
-		const char* message;		// Optional message, can be null
-		const char* messageType;	// Message type, can be "OTA" or other types
-		const char* clientId;		// Client ID of the device
-		const char* messageId;		// Message ID, can be null if not used
+		struct mg_str message;		// Optional message
+		struct mg_str messageType;	// Message type, can be "OTA" or other types
+		struct mg_str clientId;		// Client ID of the device
+		struct mg_str messageId;	// Message ID, missing if not used
 		struct {
 			bool hasNew;			// Indicates if there is a new OTA update available
-			const char* remoteUrl;	// URL to download the OTA update
+			struct mg_str remoteUrl;	// URL to download the OTA update
 		} properties;				// Properties related to the OTA update
 	} ota_response_t;
 
@@ -37,6 +44,17 @@ namespace hecsion {
 		static const char STATE_DONE    = 1;
 		static const char STATE_ERROR   = 2;
 
+		// Commands posted from other threads, carried by mg_wakeup to the command connection
+		static const char COMMAND_DISCONNECT = 0;
+		static const char COMMAND_STATE      = 1;
+		static const char COMMAND_CHECK      = 2;
+
+		typedef struct {
+			char type;					// COMMAND_*
+			bool success;				// COMMAND_STATE: whether the OTA update succeeded
+			char version[64];			// COMMAND_STATE: version to report
+		} command_t;
+
 	private :
 		string user;
 		string password;
@@ -51,13 +69,33 @@ namespace hecsion {
 		string mqtt_result_sub_topic;
 		string mqtt_on_success_pub_topic;
 		string mqtt_on_fail_pub_topic;
+		string message_head;				// JSON of the OTA messages before the version, the same in all of them
+		string message_tail;				// ... and after it
+		struct mg_iobuf message_buf;		// Every published message is built here, it only grows
+		string remote_url;					// Unescaped URL of the last reply, reused so it rarely allocates
 		struct mg_connection* mqtt_conn;
-		struct mg_mgr mgr;
+		struct mg_mgr own_mgr;				// Used when the constructor is given no manager
+		struct mg_mgr* mgr;					// Manager the task runs on
+		bool owns_mgr;
+		struct mg_timer* reconnect_timer;	// Idle while stopped and freed with the task only, as `stop` may run inside another timer
+		struct mg_connection* command_conn;	// Receives the commands of other threads while the task runs
+		std::atomic<unsigned long> command_id;	// ID of `command_conn`, 0 while there is none
 
 		char state; // Flag to indicate if the request is done
 
 		std::function<void(bool, const char*)> callback;
 
+		// Updates applied by the task itself, see `set_updater`
+		string slot_a;
+		string slot_b;
+		string boot_slot_file;
+		std::function<string(const char*, const char*)> verify;
+		std::function<void(bool, const char*)> update_done;
+		std::unique_ptr<HttpTransfer> transfer;	// Download of the last update, kept until the next one
+		char update_slot;						// 'a' or 'b', the slot the update is written to
+		mg_sha256_ctx image_hash;				// Of the image downloaded so far
+		int64_t hashed_size;
+
 	public:
 		/**
 		 * Constructor for MqttOtaTask.
@@ -72,6 +110,20 @@ namespace hecsion {
 		 */
 		MqttOtaTask(string user, string password, string sn, string name, string version, int qos = 1);
 
+		/**
+		 * Constructor for MqttOtaTask running on an event manager of the caller,
+		 * which polls it along with whatever else runs there, see `start`.
+		 *
+		 * @param [in] mgr : Event manager the task runs on, it must outlive the task
+		 * @param [in] user : User account for MQTT connection
+		 * @param [in] password : User password for MQTT connection
+		 * @param [in] sn : Device serial number
+		 * @param [in] name : Device name
+		 * @param [in] version : Current device version
+		 * @param [in] qos : MQTT Quality of Service level (default is 1)
+		 */
+		MqttOtaTask(struct mg_mgr* mgr, string user, string password, string sn, string name, string version, int qos = 1);
+
 		~MqttOtaTask();
 
 		/**
@@ -82,31 +134,142 @@ namespace hecsion {
 		 *		In this function, `can_update` indicates whether an update is available,
 		 *		if it's `true`, `ota_url` will contain the URL to download the OTA package.
 		 *		And then, you can download the OTA package for updating here.
-		 *		After updating, you should call `send_ota_state_message` to notify the server
+		 *		After updating, you should call `send_ota_state_message` to notify the server,
+		 *		or call `set_updater` first to let the task do all of this.
 		 */
 		void connect(std::function<void(bool, const char*)> callback);
 
+		/**
+		 * Same as `connect`, but returns at once. The task then advances whenever its
+		 * manager is polled, by the caller's own loop or by `poll`.
+		 *
+		 * @param [in] callback : Callback function to handle OTA update availability, see `connect`.
+		 */
+		void start(std::function<void(bool, const char*)> callback);
+
+		/**
+		 * Poll the manager the task runs on once.
+		 *
+		 * @param [in] timeout_ms : Longest time to wait for network events
+		 * @return true while the task is running.
+		 */
+		bool poll(int timeout_ms);
+
+		/**
+		 * Whether the task is still running, it stops on `disconnect` or when the server rejects the request.
+		 */
+		bool is_running() const;
+
+		/**
+		 * Sockets of every connection on the manager of the task, the MQTT one among them.
+		 * The commands of `post_*` arrive on another one, the wakeup socket of the manager.
+		 * A loop that waits on its own must wait on all of them, as waiting on one would miss
+		 * the others, and call `poll(0)` when any is ready, and at least once a second for the timers.
+		 * The set changes as connections come and go, so it is fetched again before every wait.
+		 *
+		 * @param [out] fds : Receives up to `count` sockets
+		 * @param [out] writes : Receives whether each socket is to be waited on for writing too,
+		 *		as it is connecting or has bytes to send. Can be null
+		 * @param [in] count : Size of `fds` and `writes`
+		 * @return number of sockets on the manager, more than `count` if the arrays were too small.
+		 */
+		size_t socket_fds(long* fds, bool* writes, size_t count) const;
+
+		/**
+		 * Let the task download and apply updates by itself. The image is downloaded on the manager
+		 * of the task, so the MQTT keepalive goes on meanwhile, hashed as it arrives and written to the
+		 * slot that does not boot now. Once it is verified, that slot is made the one to boot and the
+		 * result is reported with `send_ota_state_message`. The callback of `connect` is still called
+		 * when an update is offered, but must not download it.
+		 *
+		 * @param [in] slot_a : Path of image slot A, a file or a block device
+		 * @param [in] slot_b : Path of image slot B
+		 * @param [in] boot_slot_file : File holding "a" or "b", the slot the boot script starts. A missing file means A
+		 * @param [in] verify : Called with the slot holding the whole image and its SHA-256 in hex.
+		 *		Returns the version of the image to report to the server, or an empty string to reject it
+		 * @param [in] done : Called when an update is over, with whether it was applied and the version reported.
+		 *		The new image runs once the device is restarted
+		 */
+		void set_updater(string slot_a, string slot_b, string boot_slot_file,
+			std::function<string(const char*, const char*)> verify,
+			std::function<void(bool, const char*)> done);
+
+		/**
+		 * Whether an update is being downloaded, see `set_updater`.
+		 */
+		bool is_updating() const;
+
 		/**
 		 * Disconnect from MQTT server.
+		 * Only from the thread polling the manager, other threads call `post_disconnect`.
 		 */
 		void disconnect();
 
 		/**
 		 * Send to server Whether the OTA update is success or not.
+		 * Only from the thread polling the manager, other threads call `post_ota_state_message`.
 		 * 
 		 * @param [in] success : true if the OTA update is successful, false otherwise
 		 * @param [in] ver : The newest version of device if success; otherwise the current version of device
 		 */
-		void send_ota_state_message(bool success, string ver);
+		void send_ota_state_message(bool success, const string& ver);
+
+		/** Same as above, without building a `string` first */
+		void send_ota_state_message(bool success, const char* ver);
+
+		/**
+		 * `disconnect` from any thread. The poll of the task is woken up at once,
+		 * instead of noticing it when its timeout runs out.
+		 *
+		 * @return false if the task is not running.
+		 */
+		bool post_disconnect();
+
+		/**
+		 * `send_ota_state_message` from any thread, the message is sent as soon as the poll wakes up.
+		 *
+		 * @param [in] success : true if the OTA update is successful, false otherwise
+		 * @param [in] ver : Version to report, up to 63 characters
+		 * @return false if the task is not running or `ver` is too long.
+		 */
+		bool post_ota_state_message(bool success, const char* ver);
+
+		/**
+		 * Ask the server for an OTA update again, from any thread.
+		 *
+		 * @return false if the task is not running.
+		 */
+		bool post_check();
+
+		/**
+		 * Parse a reply of the OTA server in one pass, without allocating.
+		 *
+		 * @param [in] json : The reply, the strings of `cmd` point into it
+		 * @param [out] cmd : Fields of the reply, see ota_response_t
+		 * @return false if `json` is not a valid reply.
+		 */
+		static bool parse_response(struct mg_str json, ota_response_t* cmd);
 
 	private:
 		void send_ota_request_pub_message();
+		void publish_ota_message(const string& topic, const char* ver);
 		void process_received_data(const struct mg_str* data);
+		void stop();
+		bool post_command(const command_t* command);
+		void start_update(const char* url);
+		void finish_update(bool success, const char* message);
+		bool switch_boot_slot(char slot);
 
 	private:
 		static void mqtt_callback_fn(struct mg_connection* c, int ev, void* ev_data);
 
-		static bool parse_response(const char* json_data, size_t len, ota_response_t* cmd);
+		static void command_callback_fn(struct mg_connection* c, int ev, void* ev_data);
+
+		static void parse_properties(struct mg_str json, ota_response_t* cmd);
+
+		static string take_string(char* str);
+
+		static bool unescape_string(struct mg_str str, string& out);
 
 		static void reconnect_callback(void* arg);
 	};
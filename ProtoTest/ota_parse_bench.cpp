@@ -0,0 +1,192 @@
+#include "ota_parse_bench.h"
+#include "mqtt_ota_class.h"
+#include "util.h"
+#include "json.h"
+
+// Fields of a reply as the DOM parser copied them out
+typedef struct {
+	int code;
+	char* message;
+	char* messageType;
+	char* clientId;
+	char* messageId;
+	bool hasNew;
+	char* remoteUrl;
+} dom_response_t;
+
+static int s_iterations = 200000; // Parses of the typical reply, set by -n
+static int s_big_iterations = 2000; // Parses of each padded reply, set by -nbig
+static int s_size = 65536; // Size of the padded replies, set by -size
+
+static void print_ota_parse_bench_usage();
+static bool parse_response_dom(const char* json_data, size_t len, dom_response_t* cmd);
+static void free_response_dom(dom_response_t* cmd);
+static bool run_bench(const char* name, const string& reply, int iterations);
+
+int ota_parse_bench_main(int argc, char* argv[]) {
+	for (int i = 1; i < argc; i++) {
+		if (!strcmp("-h", argv[i]) || !strcmp("-help", argv[i]) || !strcmp("-?", argv[i])) {
+			print_ota_parse_bench_usage();
+			return 0;
+		}
+		else if (i + 1 >= argc) {
+			// Every option below takes a value
+			printf("Missing value for option: %s\n", argv[i]);
+			print_ota_parse_bench_usage();
+			return 1;
+		}
+		else {
+			const char* option = argv[i];
+			const char* value = argv[++i];
+			bool success = false;
+			int64_t number = string_to_long(value, (int)strlen(value), &success);
+			if (!success || number <= 0 || number > 0x7fffffff) {
+				printf("Invalid value of %s: must be an integer and bigger than 0, but received: %s\n", option, value);
+				return 1;
+			}
+			if (!strcmp("-n", option)) {
+				s_iterations = (int)number;
+			}
+			else if (!strcmp("-nbig", option)) {
+				s_big_iterations = (int)number;
+			}
+			else if (!strcmp("-size", option)) {
+				s_size = (int)number;
+			}
+			else {
+				printf("Unknown option: %s\n", option);
+				print_ota_parse_bench_usage();
+				return 1;
+			}
+		}
+	}
+
+	const string properties = "\"properties\":{\"hasNew\": true, \"remoteUrl\" : \"http://192.168.1.1/ota.zip\"}";
+	const string typical =
+		"{\"code\":200,\"message\":\"success\",\"messageType\":\"OTA\",\"clientId\":\"WESEE_E01~24092510001308\","
+		"\"messageId\":\"1234567890\"," + properties + "}";
+
+	string long_message = "{\"code\":200,\"message\":\"";
+	long_message.append(s_size > (int)typical.size() ? s_size - typical.size() : 0, 'x');
+	long_message += "\",\"messageType\":\"OTA\",\"clientId\":\"WESEE_E01~24092510001308\",\"messageId\":\"1\"," + properties + "}";
+
+	string nested = "{\"code\":200,\"messageType\":\"OTA\",\"clientId\":\"WESEE_E01~24092510001308\",\"properties\":{\"notes\":[";
+	while (nested.size() < (size_t)s_size) nested += "{\"a\":1,\"b\":\"text\"},";
+	nested += "0],\"hasNew\": true, \"remoteUrl\" : \"http://192.168.1.1/ota.zip\"}}";
+
+	printf("%-16s %8s %14s %14s %8s\n", "reply", "bytes", "json.h us", "in place us", "speedup");
+	bool ok = run_bench("typical", typical, s_iterations);
+	ok = run_bench("long message", long_message, s_big_iterations) && ok;
+	ok = run_bench("nested objects", nested, s_big_iterations) && ok;
+	return ok ? 0 : 1;
+}
+
+/** Time both parsers on `reply`, returns false if one of them rejects it */
+static bool run_bench(const char* name, const string& reply, int iterations) {
+	dom_response_t dom;
+	hecsion::ota_response_t view;
+	// Logging would dominate the timing
+	int log_level = mg_log_level;
+	mg_log_set(MG_LL_NONE);
+
+	uint64_t start = mg_millis();
+	for (int i = 0; i < iterations; i++) {
+		if (!parse_response_dom(reply.data(), reply.size(), &dom)) {
+			mg_log_set(log_level);
+			printf("json.h parser rejected the %s reply\n", name);
+			return false;
+		}
+		free_response_dom(&dom);
+	}
+	uint64_t dom_ms = mg_millis() - start;
+
+	start = mg_millis();
+	for (int i = 0; i < iterations; i++) {
+		if (!hecsion::MqttOtaTask::parse_response(mg_str_n(reply.data(), reply.size()), &view)) {
+			mg_log_set(log_level);
+			printf("In place parser rejected the %s reply\n", name);
+			return false;
+		}
+	}
+	uint64_t view_ms = mg_millis() - start;
+	mg_log_set(log_level);
+
+	double dom_us = dom_ms * 1000.0 / iterations;
+	double view_us = view_ms * 1000.0 / iterations;
+	printf("%-16s %8lu %14.2f %14.2f %7.1fx\n", name, (unsigned long)reply.size(), dom_us, view_us,
+		view_us > 0 ? dom_us / view_us : 0.0);
+	return true;
+}
+
+#ifndef IS_KEY
+#define IS_KEY(json_obj, key) (strncmp(json_obj->name->string, key, json_obj->name->string_size) == 0)
+#endif
+
+#ifndef IS_VALUE_TYPE
+#define IS_VALUE_TYPE(json_obj, target_type) (json_obj->value->type == target_type)
+#endif
+
+/** The DOM parser that replies were parsed with before, kept as the baseline */
+static bool parse_response_dom(const char* json_data, size_t len, dom_response_t* cmd) {
+	memset(cmd, 0, sizeof(dom_response_t));
+	json_value_t* json_obj = json_parse(json_data, len);
+	if (json_obj == null) return false;
+	if (json_obj->type != json_type_object) {
+		free(json_obj);
+		return false;
+	}
+	json_object_t* obj = (json_object_t*)json_obj->payload;
+	for (json_object_element_t* elem = obj->start; elem != null; elem = elem->next) {
+		if (IS_KEY(elem, "code") && IS_VALUE_TYPE(elem, json_type_number)) {
+			json_number_t* code_num = json_value_as_number(elem->value);
+			bool success = false;
+			cmd->code = (int)string_to_long(code_num->number, (int)code_num->number_size, &success);
+		}
+		else if (IS_KEY(elem, "message") && IS_VALUE_TYPE(elem, json_type_string)) {
+			json_string_t* str = (json_string_t*)elem->value->payload;
+			cmd->message = mg_mprintf("%.*s", (int)str->string_size, str->string);
+		}
+		else if (IS_KEY(elem, "messageType") && IS_VALUE_TYPE(elem, json_type_string)) {
+			json_string_t* str = (json_string_t*)elem->value->payload;
+			cmd->messageType = mg_mprintf("%.*s", (int)str->string_size, str->string);
+		}
+		else if (IS_KEY(elem, "clientId") && IS_VALUE_TYPE(elem, json_type_string)) {
+			json_string_t* str = (json_string_t*)elem->value->payload;
+			cmd->clientId = mg_mprintf("%.*s", (int)str->string_size, str->string);
+		}
+		else if (IS_KEY(elem, "messageId") && IS_VALUE_TYPE(elem, json_type_string)) {
+			json_string_t* str = (json_string_t*)elem->value->payload;
+			cmd->messageId = mg_mprintf("%.*s", (int)str->string_size, str->string);
+		}
+		else if (IS_KEY(elem, "properties") && IS_VALUE_TYPE(elem, json_type_object)) {
+			json_object_t* object = (json_object_t*)elem->value->payload;
+			for (json_object_element_t* prop = object->start; prop != null; prop = prop->next) {
+				if (IS_KEY(prop, "hasNew")) {
+					cmd->hasNew = IS_VALUE_TYPE(prop, json_type_true);
+				}
+				else if (IS_KEY(prop, "remoteUrl") && IS_VALUE_TYPE(prop, json_type_string)) {
+					json_string_t* str = (json_string_t*)prop->value->payload;
+					cmd->remoteUrl = mg_mprintf("%.*s", (int)str->string_size, str->string);
+				}
+			}
+		}
+	}
+	free(json_obj);
+	return true;
+}
+
+static void free_response_dom(dom_response_t* cmd) {
+	free(cmd->message);
+	free(cmd->messageType);
+	free(cmd->clientId);
+	free(cmd->messageId);
+	free(cmd->remoteUrl);
+}
+
+static void print_ota_parse_bench_usage() {
+	printf("Usage: ota_parse_bench [-n <count>] [-nbig <count>] [-size <bytes>]\n");
+	printf("Options:\n");
+	printf("  -n <count>        Set the parses of the typical reply (default: 200000).\n");
+	printf("  -nbig <count>     Set the parses of each padded reply (default: 2000).\n");
+	printf("  -size <bytes>     Set the size of the padded replies (default: 65536).\n");
+}
@@ -0,0 +1,19 @@
+#pragma once
+#ifndef HECSION_OTA_PARSE_BENCH
+#define HECSION_OTA_PARSE_BENCH
+
+/**
+ * main entry of the OTA reply parse benchmark.
+ *
+ * times MqttOtaTask::parse_response, which scans a reply in place, against building a
+ * json.h DOM and copying its strings out, which is how replies were parsed before. the
+ * replies are a typical one, and two padded to `-size` bytes: one by a long message, one
+ * by objects nested in its properties.
+ *
+ * @param [in] argc - argument count of `argv`
+ * @param [in] argv - argument vector of `argc` like command line, see print_ota_parse_bench_usage
+ * @return 0 on success, or non-zero value if a parser rejects a reply.
+ */
+extern int ota_parse_bench_main(int argc, char* argv[]);
+
+#endif // !HECSION_OTA_PARSE_BENCH
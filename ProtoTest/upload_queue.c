@@ -0,0 +1,862 @@
+#include "upload_queue.h"
+
+#define QUEUE_READ_SIZE 16384      // Bytes read from a spool file at once
+#define QUEUE_SEND_WINDOW 32768    // Body bytes queued in the send buffer at most
+#define QUEUE_TICK_MS 200          // Period of the scheduler timer
+#define QUEUE_SCAN_MS 2000         // Period of the spool scan for files put there by other threads and processes
+#define QUEUE_IDLE_CLOSE_MS 30000  // A kept connection without requests is closed after this
+#define QUEUE_MAX_BACKOFF_SHIFT 6  // The retry delay stops doubling after this many failures
+#define QUEUE_NAME_SIZE 100        // Spool names fit the name field of a tar header
+#define QUEUE_TMP_PREFIX ".spool-" // Files being copied into the spool, removed if found at start
+#define TAR_BLOCK 512
+
+/** A file waiting in the spool directory */
+typedef struct upload_item {
+	char name[QUEUE_NAME_SIZE]; // Spool file name, "<priority>-<seq>-<original name>"
+	int priority;               // UPLOAD_PRIORITY_*
+	uint64_t seq;               // Enqueue order, kept across restarts by the file name
+	int64_t size;
+	int64_t mtime;
+	uint64_t queued_ms;         // mg_millis() when enqueued or found in the spool
+	int retry_count;
+	uint64_t retry_at_ms;       // Not sent again before this
+	bool sending;               // Part of the request in flight
+} upload_item_t;
+
+/** The queue, `items` are sorted by priority, then by seq */
+typedef struct upload_queue {
+	struct mg_mgr* mgr;
+	upload_queue_opts_t opts;
+	char spool_dir[512];
+	upload_item_t* items;
+	size_t count;
+	size_t capacity;
+	int64_t spool_bytes;        // Size of all items
+	uint64_t next_seq;
+	uint64_t scanned_ms;        // mg_millis() of the last spool scan
+	struct mg_timer* timer;
+	struct mg_connection* conn; // Kept between requests while the server allows
+	uint64_t idle_since_ms;     // End of the last request on `conn`
+	// The request in flight, made of the items marked `sending` in array order
+	bool active;
+	bool batch;                 // A tar archive of small files, or one file as it is
+	int request_files;
+	int64_t body_len;
+	int64_t body_sent;
+	FILE* file;                 // Spool file of the item being streamed
+	uint64_t file_seq;
+} upload_queue_t;
+
+static upload_queue_t s_queue;
+static char queue_buffer[QUEUE_READ_SIZE];
+
+// Declare the functions
+static void print_upload_queue_usage();
+static void scan_spool_entry(const char* name, void* arg);
+static void rescan_spool_entry(const char* name, void* arg);
+static bool parse_spool_name(upload_queue_t* q, const char* name, upload_item_t* item);
+static void name_item(upload_queue_t* q, const char* path, int priority, upload_item_t* item);
+static int compare_items(const void* a, const void* b);
+static bool insert_item(upload_queue_t* q, const upload_item_t* item);
+static void remove_item(upload_queue_t* q, size_t index);
+static void spool_path(upload_queue_t* q, const char* name, char* path, size_t size);
+static bool make_room(upload_queue_t* q, int64_t size, int priority);
+static bool copy_file(const char* from, const char* to);
+static void queue_timer_fn(void* arg);
+static bool select_request(upload_queue_t* q, uint64_t now);
+static void send_queue_request(struct mg_connection* c, upload_queue_t* q);
+static bool fill_queue_body(struct mg_connection* c, upload_queue_t* q);
+static bool read_spool_file(upload_queue_t* q, upload_item_t* item, char* data, size_t len);
+static void build_tar_header(const upload_item_t* item, char* header);
+static void tar_octal(char* field, size_t width, uint64_t value);
+static void finish_queue_request(upload_queue_t* q);
+static void fail_queue_request(upload_queue_t* q, struct mg_connection* c, const char* reason);
+static void upload_queue_callback_fn(struct mg_connection* c, int ev, void* ev_data);
+
+/** Bytes of file data in a tar entry, padded to whole blocks */
+static int64_t tar_padded(int64_t size) {
+	return (size + TAR_BLOCK - 1) / TAR_BLOCK * TAR_BLOCK;
+}
+
+/** Name the file had before it was spooled */
+static const char* original_name(const upload_item_t* item) {
+	const char* name = strchr(item->name, '-');
+	name = name != null ? strchr(name + 1, '-') : null;
+	return name != null ? name + 1 : item->name;
+}
+
+bool upload_queue_init(struct mg_mgr* mgr, const upload_queue_opts_t* opts) {
+	upload_queue_t* q = &s_queue;
+	if (q->mgr != null) {
+		printf("Upload queue is already running\n");
+		return false;
+	}
+	if (opts->url == null || opts->spool_dir == null) {
+		printf("Upload queue needs a URL and a spool directory\n");
+		return false;
+	}
+	if (!mg_match(mg_str(opts->url), mg_str("#://#"), null)) {
+		printf("Invalid upload queue URL: %s\n", opts->url);
+		return false;
+	}
+
+	memset(q, 0, sizeof(*q));
+	q->opts = *opts;
+	if (q->opts.batch_file_size <= 0) q->opts.batch_file_size = 64 * 1024;
+	if (q->opts.batch_size <= 0) q->opts.batch_size = 1024 * 1024;
+	if (q->opts.batch_files <= 0) q->opts.batch_files = 64;
+	if (q->opts.batch_delay_ms == 0) q->opts.batch_delay_ms = 5000;
+	if (q->opts.timeout_ms == 0) q->opts.timeout_ms = 30000;
+	if (q->opts.retry_base_ms == 0) q->opts.retry_base_ms = 1000;
+	mg_snprintf(q->spool_dir, sizeof(q->spool_dir), "%s", opts->spool_dir);
+
+	mg_fs_posix.mkd(q->spool_dir);
+	if (!(mg_fs_posix.st(q->spool_dir, null, null) & MG_FS_DIR)) {
+		printf("Spool directory is not usable: %s\n", q->spool_dir);
+		return false;
+	}
+	// Whatever an earlier run left in the spool is uploaded first
+	mg_fs_posix.ls(q->spool_dir, scan_spool_entry, q);
+	if (q->count > 1) qsort(q->items, q->count, sizeof(upload_item_t), compare_items);
+	q->scanned_ms = mg_millis();
+
+	q->mgr = mgr;
+	q->timer = mg_timer_add(mgr, QUEUE_TICK_MS, MG_TIMER_REPEAT, queue_timer_fn, q);
+	printf("Upload queue on %s: %lu files, %lld bytes waiting\n", q->spool_dir, (unsigned long)q->count, q->spool_bytes);
+	return true;
+}
+
+bool upload_queue_add(const char* path, int priority, bool move) {
+	upload_queue_t* q = &s_queue;
+	if (q->mgr == null) {
+		printf("Upload queue is not running\n");
+		return false;
+	}
+	if (priority < 0 || priority >= UPLOAD_PRIORITY_COUNT) {
+		printf("Invalid upload priority: %d\n", priority);
+		return false;
+	}
+	size_t size = 0;
+	time_t mtime = 0;
+	int flags = mg_fs_posix.st(path, &size, &mtime);
+	if (flags == 0 || (flags & MG_FS_DIR)) {
+		printf("Cannot queue %s: not a readable file\n", path);
+		return false;
+	}
+	if (!make_room(q, (int64_t)size, priority)) {
+		printf("Cannot queue %s: %lu bytes do not fit the spool limit\n", path, (unsigned long)size);
+		return false;
+	}
+
+	upload_item_t item;
+	name_item(q, path, priority, &item);
+	item.size = (int64_t)size;
+	item.mtime = (int64_t)mtime;
+
+	char target[sizeof(q->spool_dir) + QUEUE_NAME_SIZE + 1];
+	spool_path(q, item.name, target, sizeof(target));
+	if (move && rename(path, target) == 0) {
+		// Done, the spool is on the same file system
+	}
+	else {
+		// Copied under a temporary name, so a crash never leaves a truncated file in the spool
+		char tmp_name[QUEUE_NAME_SIZE + sizeof(QUEUE_TMP_PREFIX)];
+		char tmp[sizeof(target) + sizeof(QUEUE_TMP_PREFIX)];
+		mg_snprintf(tmp_name, sizeof(tmp_name), "%s%s", QUEUE_TMP_PREFIX, item.name);
+		spool_path(q, tmp_name, tmp, sizeof(tmp));
+		if (!copy_file(path, tmp) || rename(tmp, target) != 0) {
+			printf("Cannot queue %s: copy into %s failed\n", path, q->spool_dir);
+			remove(tmp);
+			return false;
+		}
+		if (move) remove(path);
+	}
+	if (!insert_item(q, &item)) {
+		remove(target);
+		return false;
+	}
+	return true;
+}
+
+size_t upload_queue_pending(void) {
+	return s_queue.count;
+}
+
+void upload_queue_free(void) {
+	upload_queue_t* q = &s_queue;
+	if (q->mgr == null) return;
+	if (q->conn != null) {
+		q->conn->is_closing = 1;
+		q->conn = (struct mg_connection*)null;
+	}
+	if (q->timer != null) {
+		mg_timer_free(&q->mgr->timers, q->timer);
+		free(q->timer);
+	}
+	if (q->file) fclose(q->file);
+	free(q->items);
+	memset(q, 0, sizeof(*q));
+}
+
+int upload_queue_main(int argc, char* argv[]) {
+	upload_queue_opts_t opts;
+	memset(&opts, 0, sizeof(opts));
+	int64_t wait_ms = 0; // Give up after this with files left in the spool, 0 to wait until it is empty
+	bool move = false;
+	int priority = UPLOAD_PRIORITY_NORMAL;
+	// -f options are queued once the spool is open, each with the -priority before it
+	const char** files = (const char**)calloc(argc, sizeof(char*));
+	int* priorities = (int*)calloc(argc, sizeof(int));
+	int file_count = 0;
+	int ret = 1;
+	if (files == null || priorities == null) {
+		printf("Out of memory\n");
+		goto done;
+	}
+
+	for (int i = 1; i < argc; i++) {
+		if (!strcmp("-h", argv[i]) || !strcmp("-help", argv[i]) || !strcmp("-?", argv[i])) {
+			print_upload_queue_usage();
+			ret = 0;
+			goto done;
+		}
+		else if (!strcmp("-move", argv[i])) {
+			move = true;
+		}
+		else if (i + 1 >= argc) {
+			// Every option below takes a value
+			printf("Missing value for option: %s\n", argv[i]);
+			print_upload_queue_usage();
+			goto done;
+		}
+		else if (!strcmp("-u", argv[i])) {
+			opts.url = argv[++i];
+		}
+		else if (!strcmp("-d", argv[i])) {
+			opts.spool_dir = argv[++i];
+		}
+		else if (!strcmp("-f", argv[i])) {
+			files[file_count] = argv[++i];
+			priorities[file_count++] = priority;
+		}
+		else if (!strcmp("-priority", argv[i])) {
+			const char* value = argv[++i];
+			if (!strcmp(value, "high")) {
+				priority = UPLOAD_PRIORITY_HIGH;
+			}
+			else if (!strcmp(value, "normal")) {
+				priority = UPLOAD_PRIORITY_NORMAL;
+			}
+			else if (!strcmp(value, "low")) {
+				priority = UPLOAD_PRIORITY_LOW;
+			}
+			else {
+				printf("Invalid priority: must be high, normal or low, but received: %s\n", value);
+				goto done;
+			}
+		}
+		else if (!strcmp("-batch", argv[i]) || !strcmp("-batch_size", argv[i]) || !strcmp("-batch_files", argv[i])
+			|| !strcmp("-delay", argv[i]) || !strcmp("-limit", argv[i]) || !strcmp("-t", argv[i]) || !strcmp("-wait", argv[i])) {
+			const char* name = argv[i];
+			const char* value = argv[++i];
+			bool success = false;
+			int64_t number = string_to_long(value, strlen(value), &success);
+			if (!success || number <= 0) {
+				printf("Invalid value of %s: must be an integer and bigger than 0, but received: %s\n", name, value);
+				goto done;
+			}
+			if (!strcmp("-batch", name)) opts.batch_file_size = number;
+			else if (!strcmp("-batch_size", name)) opts.batch_size = number;
+			else if (!strcmp("-batch_files", name)) opts.batch_files = (int)number;
+			else if (!strcmp("-delay", name)) opts.batch_delay_ms = (uint64_t)number;
+			else if (!strcmp("-limit", name)) opts.spool_limit = number;
+			else if (!strcmp("-t", name)) opts.timeout_ms = (uint64_t)number;
+			else wait_ms = number;
+		}
+		else {
+			printf("Unknown option: %s\n", argv[i]);
+			print_upload_queue_usage();
+			goto done;
+		}
+	}
+
+	if (opts.url == null || opts.spool_dir == null) {
+		printf("URL or spool directory is not set.\n");
+		print_upload_queue_usage();
+		goto done;
+	}
+
+	struct mg_mgr mgr;
+	mg_mgr_init(&mgr);
+	if (!upload_queue_init(&mgr, &opts)) {
+		mg_mgr_free(&mgr);
+		goto done;
+	}
+	for (int i = 0; i < file_count; i++) {
+		if (upload_queue_add(files[i], priorities[i], move)) {
+			printf("Queued %s\n", files[i]);
+		}
+	}
+
+	uint64_t deadline = wait_ms > 0 ? mg_millis() + (uint64_t)wait_ms : 0;
+	while (upload_queue_pending() > 0 && (deadline == 0 || mg_millis() < deadline)) {
+		mg_mgr_poll(&mgr, 100);
+	}
+	if (upload_queue_pending() > 0) {
+		printf("Stopped with %lu files left in %s\n", (unsigned long)upload_queue_pending(), opts.spool_dir);
+	}
+	else {
+		printf("Spool is empty, every file was uploaded.\n");
+		ret = 0;
+	}
+	upload_queue_free();
+	mg_mgr_free(&mgr);
+
+done:
+	free(files);
+	free(priorities);
+	return ret;
+}
+
+/** Queue a file found in the spool directory, called by mg_fs_posix.ls */
+static void scan_spool_entry(const char* name, void* arg) {
+	upload_queue_t* q = (upload_queue_t*)arg;
+	char path[sizeof(q->spool_dir) + QUEUE_NAME_SIZE + 1];
+	spool_path(q, name, path, sizeof(path));
+	if (!strncmp(name, QUEUE_TMP_PREFIX, strlen(QUEUE_TMP_PREFIX))) {
+		// An interrupted copy, the caller did not get a success for it
+		remove(path);
+		return;
+	}
+
+	// Files named otherwise are renamed and queued by the first scan of the timer
+	upload_item_t item;
+	if (!parse_spool_name(q, name, &item)) return;
+
+	// Sorted once the scan is over
+	if (q->count == q->capacity) {
+		size_t capacity = q->capacity ? q->capacity * 2 : 16;
+		upload_item_t* items = (upload_item_t*)realloc(q->items, capacity * sizeof(upload_item_t));
+		if (items == null) return;
+		q->items = items;
+		q->capacity = capacity;
+	}
+	q->items[q->count++] = item;
+	q->spool_bytes += item.size;
+}
+
+/**
+ * Queue a file another thread or process put into the spool, called by mg_fs_posix.ls from the timer.
+ * a file named like the queue names its files keeps its priority, any other is renamed to such a name.
+ */
+static void rescan_spool_entry(const char* name, void* arg) {
+	upload_queue_t* q = (upload_queue_t*)arg;
+	// Hidden files are still being written, copies of upload_queue_add among them
+	if (name[0] == '.') return;
+	for (size_t i = 0; i < q->count; i++) {
+		if (!strcmp(q->items[i].name, name)) return;
+	}
+
+	char path[sizeof(q->spool_dir) + QUEUE_NAME_SIZE + 1];
+	spool_path(q, name, path, sizeof(path));
+	upload_item_t item;
+	if (!parse_spool_name(q, name, &item)) {
+		size_t size = 0;
+		time_t mtime = 0;
+		int flags = mg_fs_posix.st(path, &size, &mtime);
+		if (flags == 0 || (flags & MG_FS_DIR)) return;
+		name_item(q, name, UPLOAD_PRIORITY_NORMAL, &item);
+		item.size = (int64_t)size;
+		item.mtime = (int64_t)mtime;
+		char target[sizeof(q->spool_dir) + QUEUE_NAME_SIZE + 1];
+		spool_path(q, item.name, target, sizeof(target));
+		if (rename(path, target) != 0) {
+			printf("Cannot queue %s: rename in %s failed\n", name, q->spool_dir);
+			return;
+		}
+		mg_snprintf(path, sizeof(path), "%s", target);
+	}
+	if (!make_room(q, item.size, item.priority)) {
+		printf("Dropping %s: %lld bytes do not fit the spool limit\n", name, item.size);
+		remove(path);
+		return;
+	}
+	if (!insert_item(q, &item)) return;
+	printf("Queued %s from the spool\n", item.name);
+}
+
+/** Fill `item` from the spool file `name` if it is named like the queue names its files */
+static bool parse_spool_name(upload_queue_t* q, const char* name, upload_item_t* item) {
+	char path[sizeof(q->spool_dir) + QUEUE_NAME_SIZE + 1];
+	spool_path(q, name, path, sizeof(path));
+	memset(item, 0, sizeof(*item));
+	unsigned long long seq = 0;
+	int used = 0;
+	size_t size = 0;
+	time_t mtime = 0;
+	int flags = mg_fs_posix.st(path, &size, &mtime);
+	if (strlen(name) >= sizeof(item->name) || sscanf(name, "%d-%llu-%n", &item->priority, &seq, &used) != 2 || used == 0
+		|| item->priority < 0 || item->priority >= UPLOAD_PRIORITY_COUNT || flags == 0 || (flags & MG_FS_DIR)) {
+		return false;
+	}
+	mg_snprintf(item->name, sizeof(item->name), "%s", name);
+	item->seq = (uint64_t)seq;
+	item->size = (int64_t)size;
+	item->mtime = (int64_t)mtime;
+	item->queued_ms = mg_millis();
+	if (item->seq >= q->next_seq) q->next_seq = item->seq + 1;
+	return true;
+}
+
+/** Start `item` for the file at `path`, named "<priority>-<seq>-<original name>" in the spool */
+static void name_item(upload_queue_t* q, const char* path, int priority, upload_item_t* item) {
+	// Characters a tar reader or an HTTP header could choke on are replaced
+	const char* base = path;
+	for (const char* p = path; *p; p++) {
+		if (*p == '/' || *p == '\\') base = p + 1;
+	}
+	char safe[64];
+	size_t len = 0;
+	for (; base[len] && len < sizeof(safe) - 1; len++) {
+		char ch = base[len];
+		bool keep = (ch >= 'a' && ch <= 'z') || (ch >= 'A' && ch <= 'Z') || (ch >= '0' && ch <= '9') || ch == '.' || ch == '_' || ch == '-';
+		safe[len] = keep ? ch : '_';
+	}
+	safe[len] = '\0';
+
+	memset(item, 0, sizeof(*item));
+	item->priority = priority;
+	item->seq = q->next_seq++;
+	item->queued_ms = mg_millis();
+	mg_snprintf(item->name, sizeof(item->name), "%d-%010llu-%s", priority, (unsigned long long)item->seq, safe[0] ? safe : "file");
+}
+
+static int compare_items(const void* a, const void* b) {
+	const upload_item_t* x = (const upload_item_t*)a;
+	const upload_item_t* y = (const upload_item_t*)b;
+	if (x->priority != y->priority) return x->priority - y->priority;
+	return x->seq < y->seq ? -1 : x->seq > y->seq;
+}
+
+/** Add `item` at its place in priority order */
+static bool insert_item(upload_queue_t* q, const upload_item_t* item) {
+	if (q->count == q->capacity) {
+		size_t capacity = q->capacity ? q->capacity * 2 : 16;
+		upload_item_t* items = (upload_item_t*)realloc(q->items, capacity * sizeof(upload_item_t));
+		if (items == null) {
+			printf("Out of memory\n");
+			return false;
+		}
+		q->items = items;
+		q->capacity = capacity;
+	}
+	size_t index = q->count;
+	while (index > 0 && compare_items(&q->items[index - 1], item) > 0) index--;
+	memmove(&q->items[index + 1], &q->items[index], (q->count - index) * sizeof(upload_item_t));
+	q->items[index] = *item;
+	q->count++;
+	q->spool_bytes += item->size;
+	return true;
+}
+
+/** Forget the item at `index`, its spool file is removed by the caller */
+static void remove_item(upload_queue_t* q, size_t index) {
+	q->spool_bytes -= q->items[index].size;
+	memmove(&q->items[index], &q->items[index + 1], (q->count - index - 1) * sizeof(upload_item_t));
+	q->count--;
+}
+
+static void spool_path(upload_queue_t* q, const char* name, char* path, size_t size) {
+	mg_snprintf(path, size, "%s/%s", q->spool_dir, name);
+}
+
+/**
+ * Drop queued files until `size` more bytes fit the spool limit. only files of the same or
+ * a lower priority are dropped, the oldest of the lowest priority first.
+ */
+static bool make_room(upload_queue_t* q, int64_t size, int priority) {
+	if (q->opts.spool_limit <= 0) return true;
+	if (size > q->opts.spool_limit) return false;
+	while (q->spool_bytes + size > q->opts.spool_limit) {
+		size_t victim = q->count;
+		for (size_t i = 0; i < q->count; i++) {
+			upload_item_t* item = &q->items[i];
+			if (item->sending || item->priority < priority) continue;
+			// Items ascend by seq within a priority, so the first one met is the oldest
+			if (victim == q->count || item->priority > q->items[victim].priority) victim = i;
+		}
+		if (victim == q->count) return false;
+
+		char path[sizeof(q->spool_dir) + QUEUE_NAME_SIZE + 1];
+		spool_path(q, q->items[victim].name, path, sizeof(path));
+		printf("Spool is full, dropping %s\n", q->items[victim].name);
+		remove(path);
+		remove_item(q, victim);
+	}
+	return true;
+}
+
+static bool copy_file(const char* from, const char* to) {
+	FILE* in = fopen(from, "rb");
+	if (!in) return false;
+	FILE* out = fopen(to, "wb");
+	if (!out) {
+		fclose(in);
+		return false;
+	}
+	bool success = true;
+	size_t n;
+	while ((n = fread(queue_buffer, 1, sizeof(queue_buffer), in)) > 0) {
+		if (fwrite(queue_buffer, 1, n, out) != n) {
+			success = false;
+			break;
+		}
+	}
+	success = success && !ferror(in);
+	fclose(in);
+	return fclose(out) == 0 && success;
+}
+
+/* scheduler, starts the next request once the last one is over */
+static void queue_timer_fn(void* arg) {
+	upload_queue_t* q = (upload_queue_t*)arg;
+	uint64_t now = mg_millis();
+	if (now - q->scanned_ms >= QUEUE_SCAN_MS) {
+		q->scanned_ms = now;
+		mg_fs_posix.ls(q->spool_dir, rescan_spool_entry, q);
+	}
+	if (q->active) return;
+	if (q->conn != null && now - q->idle_since_ms > QUEUE_IDLE_CLOSE_MS) {
+		q->conn->is_draining = 1;
+		q->conn = (struct mg_connection*)null;
+	}
+	if (!select_request(q, now)) return;
+
+	q->active = true;
+	if (q->conn != null) {
+		// Kept from the last request, no new connect or TLS handshake
+		send_queue_request(q->conn, q);
+		return;
+	}
+	q->conn = mg_http_connect(q->mgr, q->opts.url, upload_queue_callback_fn, q);
+	if (q->conn == null) fail_queue_request(q, (struct mg_connection*)null, "cannot connect");
+}
+
+/**
+ * Mark the items of the next request as `sending`, returns false if nothing is due.
+ * the first due file in priority order goes alone if it is big, or opens a batch of the
+ * due small files after it, which waits for more files unless it is full, urgent or old enough.
+ * a waiting batch lets the next due big file go first.
+ */
+static bool select_request(upload_queue_t* q, uint64_t now) {
+	size_t first = 0;
+	while (first < q->count && q->items[first].retry_at_ms > now) first++;
+	if (first == q->count) return false;
+
+	upload_item_t* head = &q->items[first];
+	int files = 0;
+	int64_t bytes = 0;
+	int64_t body = 2 * TAR_BLOCK; // End of archive
+	bool full = false;
+	uint64_t oldest = head->queued_ms;
+	if (head->size <= q->opts.batch_file_size) {
+		for (size_t i = first; i < q->count; i++) {
+			upload_item_t* item = &q->items[i];
+			if (item->retry_at_ms > now || item->size > q->opts.batch_file_size) continue;
+			if (files == q->opts.batch_files || (files > 0 && bytes + item->size > q->opts.batch_size)) {
+				full = true;
+				break;
+			}
+			item->sending = true;
+			files++;
+			bytes += item->size;
+			body += TAR_BLOCK + tar_padded(item->size);
+			if (item->queued_ms < oldest) oldest = item->queued_ms;
+		}
+		if (!full && head->priority != UPLOAD_PRIORITY_HIGH && now - oldest < q->opts.batch_delay_ms) {
+			// While the batch fills, a due big file need not wait behind it
+			for (size_t i = first; i < q->count; i++) q->items[i].sending = false;
+			size_t big = first;
+			while (big < q->count && (q->items[big].retry_at_ms > now || q->items[big].size <= q->opts.batch_file_size)) big++;
+			if (big == q->count) return false;
+			head = &q->items[big];
+			first = big;
+			files = 0;
+		}
+	}
+
+	if (files > 1) {
+		q->batch = true;
+		q->request_files = files;
+		q->body_len = body;
+	}
+	else {
+		// A lone file is sent as it is, the tar framing would only add to it
+		for (size_t i = first; i < q->count; i++) q->items[i].sending = false;
+		head->sending = true;
+		q->batch = false;
+		q->request_files = 1;
+		q->body_len = head->size;
+	}
+	return true;
+}
+
+/** Send the request headers, the body follows as the send buffer drains */
+static void send_queue_request(struct mg_connection* c, upload_queue_t* q) {
+	struct mg_str host = mg_url_host(q->opts.url);
+	upload_item_t* head = null;
+	for (size_t i = 0; i < q->count && head == null; i++) {
+		if (q->items[i].sending) head = &q->items[i];
+	}
+	*(uint64_t*)c->data = mg_millis() + q->opts.timeout_ms;
+	q->body_sent = 0;
+	if (q->batch) {
+		mg_printf(c,
+			"POST %s HTTP/1.1\r\n"
+			"Host: %.*s\r\n"
+			"Content-Type: application/x-tar\r\n"
+			"Content-Length: %lld\r\n"
+			"X-Batch-Files: %d\r\n"
+			"X-Upload-Priority: %d\r\n"
+			"\r\n",
+			mg_url_uri(q->opts.url), (int)host.len, host.buf, q->body_len, q->request_files, head->priority);
+	}
+	else {
+		mg_printf(c,
+			"POST %s HTTP/1.1\r\n"
+			"Host: %.*s\r\n"
+			"Content-Type: application/octet-stream\r\n"
+			"Content-Length: %lld\r\n"
+			"X-File-Name: %s\r\n"
+			"X-Upload-Priority: %d\r\n"
+			"\r\n",
+			mg_url_uri(q->opts.url), (int)host.len, host.buf, q->body_len, original_name(head), head->priority);
+	}
+	if (!fill_queue_body(c, q)) fail_queue_request(q, c, "read failed");
+}
+
+/** Queue body bytes until the send window is full, returns false on read failure */
+static bool fill_queue_body(struct mg_connection* c, upload_queue_t* q) {
+	while (q->body_sent < q->body_len && c->send.len < QUEUE_SEND_WINDOW) {
+		// Find the item under the body position, a tar entry is a header block and the padded data
+		int64_t offset = q->body_sent;
+		upload_item_t* item = null;
+		for (size_t i = 0; i < q->count; i++) {
+			if (!q->items[i].sending) continue;
+			int64_t entry = q->batch ? TAR_BLOCK + tar_padded(q->items[i].size) : q->items[i].size;
+			if (offset < entry) {
+				item = &q->items[i];
+				break;
+			}
+			offset -= entry;
+		}
+
+		size_t n;
+		if (item == null) {
+			// Zero blocks ending the archive
+			n = (size_t)(q->body_len - q->body_sent);
+			memset(queue_buffer, 0, n);
+		}
+		else if (q->batch && offset < TAR_BLOCK) {
+			build_tar_header(item, queue_buffer);
+			n = TAR_BLOCK - (size_t)offset;
+			memmove(queue_buffer, queue_buffer + offset, n);
+		}
+		else {
+			int64_t pos = q->batch ? offset - TAR_BLOCK : offset;
+			if (pos < item->size) {
+				n = item->size - pos < QUEUE_READ_SIZE ? (size_t)(item->size - pos) : QUEUE_READ_SIZE;
+				if (!read_spool_file(q, item, queue_buffer, n)) return false;
+			}
+			else {
+				n = (size_t)(tar_padded(item->size) - pos);
+				memset(queue_buffer, 0, n);
+			}
+		}
+		mg_send(c, queue_buffer, n);
+		q->body_sent += n;
+	}
+	return true;
+}
+
+/** Read the next `len` bytes of the spool file of `item`, the body reads every file from start to end */
+static bool read_spool_file(upload_queue_t* q, upload_item_t* item, char* data, size_t len) {
+	if (q->file == null || q->file_seq != item->seq) {
+		char path[sizeof(q->spool_dir) + QUEUE_NAME_SIZE + 1];
+		spool_path(q, item->name, path, sizeof(path));
+		if (q->file) fclose(q->file);
+		q->file = fopen(path, "rb");
+		q->file_seq = item->seq;
+		if (!q->file) {
+			printf("Cannot open spool file: %s\n", path);
+			return false;
+		}
+	}
+	if (fread(data, 1, len, q->file) != len) {
+		printf("Read failed in spool file: %s\n", item->name);
+		return false;
+	}
+	return true;
+}
+
+/** ustar header of `item`, TAR_BLOCK bytes */
+static void build_tar_header(const upload_item_t* item, char* header) {
+	memset(header, 0, TAR_BLOCK);
+	memcpy(header, item->name, strlen(item->name)); // name, shorter than its 100 bytes
+	tar_octal(header + 100, 8, 0644);               // mode
+	tar_octal(header + 108, 8, 0);                  // uid
+	tar_octal(header + 116, 8, 0);                  // gid
+	tar_octal(header + 124, 12, (uint64_t)item->size);
+	tar_octal(header + 136, 12, (uint64_t)item->mtime);
+	memset(header + 148, ' ', 8);                   // checksum, counted as spaces
+	header[156] = '0';                              // regular file
+	memcpy(header + 257, "ustar", 6);
+	memcpy(header + 263, "00", 2);
+
+	unsigned int sum = 0;
+	for (int i = 0; i < TAR_BLOCK; i++) sum += (unsigned char)header[i];
+	tar_octal(header + 148, 7, sum);
+	header[155] = ' ';
+}
+
+/** Write `value` as zero padded octal digits and a NUL into `width` bytes */
+static void tar_octal(char* field, size_t width, uint64_t value) {
+	field[width - 1] = '\0';
+	for (size_t i = width - 1; i > 0; i--) {
+		field[i - 1] = (char)('0' + (value & 7));
+		value >>= 3;
+	}
+}
+
+/** The server took the request, its files leave the spool */
+static void finish_queue_request(upload_queue_t* q) {
+	int64_t bytes = 0;
+	if (q->file) {
+		fclose(q->file);
+		q->file = (FILE*)null;
+	}
+	for (size_t i = q->count; i > 0; i--) {
+		upload_item_t* item = &q->items[i - 1];
+		if (!item->sending) continue;
+		char path[sizeof(q->spool_dir) + QUEUE_NAME_SIZE + 1];
+		spool_path(q, item->name, path, sizeof(path));
+		remove(path);
+		bytes += item->size;
+		remove_item(q, i - 1);
+	}
+	printf("Uploaded %d %s, %lld bytes, %lu files left\n", q->request_files, q->batch ? "files in one batch" : "file",
+		bytes, (unsigned long)q->count);
+	q->active = false;
+	q->idle_since_ms = mg_millis();
+}
+
+/** Drop the connection of a failed request and schedule the retry of its files, which stay in the spool */
+static void fail_queue_request(upload_queue_t* q, struct mg_connection* c, const char* reason) {
+	uint64_t now = mg_millis();
+	uint64_t delay = 0;
+	if (c != null) c->is_closing = 1;
+	q->conn = (struct mg_connection*)null;
+	q->active = false;
+	if (q->file) {
+		fclose(q->file);
+		q->file = (FILE*)null;
+	}
+	for (size_t i = q->count; i > 0; i--) {
+		upload_item_t* item = &q->items[i - 1];
+		if (!item->sending) continue;
+		item->sending = false;
+		char path[sizeof(q->spool_dir) + QUEUE_NAME_SIZE + 1];
+		spool_path(q, item->name, path, sizeof(path));
+		if (mg_fs_posix.st(path, null, null) == 0) {
+			// Removed behind our back, retrying cannot bring it back
+			printf("Spool file is gone, dropping %s\n", item->name);
+			remove_item(q, i - 1);
+			continue;
+		}
+		int shift = item->retry_count < QUEUE_MAX_BACKOFF_SHIFT ? item->retry_count : QUEUE_MAX_BACKOFF_SHIFT;
+		item->retry_count++;
+		delay = q->opts.retry_base_ms << shift;
+		item->retry_at_ms = now + delay;
+	}
+	printf("Upload of %d queued %s failed: %s, retrying in %llu ms\n", q->request_files,
+		q->request_files > 1 ? "files" : "file", reason, (unsigned long long)delay);
+}
+
+/* callback for the upload queue connection */
+static void upload_queue_callback_fn(struct mg_connection* c, int ev, void* ev_data) {
+	upload_queue_t* q = (upload_queue_t*)c->fn_data;
+
+	if (ev == MG_EV_OPEN) {
+		// Sent from within mg_http_connect, before `conn` is set
+		*(uint64_t*)c->data = mg_millis() + q->opts.timeout_ms;
+		return;
+	}
+	if (q->conn != c) return;
+
+	if (ev == MG_EV_CONNECT) {
+		if (mg_url_is_ssl(q->opts.url)) {
+			struct mg_tls_opts opts;
+			memset(&opts, 0, sizeof(opts));
+			opts.name = mg_url_host(q->opts.url);
+			mg_tls_init(c, &opts);
+		}
+		if (q->active) send_queue_request(c, q);
+	}
+	else if (ev == MG_EV_WRITE) {
+		if (!q->active) return;
+		*(uint64_t*)c->data = mg_millis() + q->opts.timeout_ms;
+		if (!fill_queue_body(c, q)) fail_queue_request(q, c, "read failed");
+	}
+	else if (ev == MG_EV_HTTP_MSG) {
+		struct mg_http_message* hm = (struct mg_http_message*)ev_data;
+		if (!q->active) return;
+		int status = mg_http_status(hm);
+		if (status < 200 || status >= 300) {
+			char reason[64];
+			mg_snprintf(reason, sizeof(reason), "HTTP error %d", status);
+			fail_queue_request(q, c, reason);
+			return;
+		}
+		if (q->body_sent < q->body_len || c->send.len > 0) {
+			// Answered before the body was complete, the server did not take the files
+			fail_queue_request(q, c, "answered before the body was sent");
+			return;
+		}
+		finish_queue_request(q);
+		struct mg_str* conn_hdr = mg_http_get_header(hm, "Connection");
+		if (conn_hdr != NULL && mg_strcasecmp(*conn_hdr, mg_str("close")) == 0) {
+			c->is_draining = 1;
+			q->conn = (struct mg_connection*)null;
+		}
+	}
+	else if (ev == MG_EV_ERROR) {
+		if (q->active) fail_queue_request(q, c, (char*)ev_data);
+	}
+	else if (ev == MG_EV_CLOSE) {
+		q->conn = (struct mg_connection*)null;
+		// A kept connection closed by the server between requests is simply reopened
+		if (q->active) fail_queue_request(q, (struct mg_connection*)null, "connection closed");
+	}
+	else if (ev == MG_EV_POLL) {
+		if (q->active && mg_millis() > *(uint64_t*)c->data) {
+			mg_error(c, "Operation timed out");
+		}
+	}
+}
+
+static void print_upload_queue_usage() {
+	printf("Usage: upload_queue -u <url> -d <spool_dir> [-priority <p>] [-f <file>]... [options]\n");
+	printf("Options:\n");
+	printf("  -u <url>          Required. Set the URL every request is POSTed to.\n");
+	printf("  -d <spool_dir>    Required. Set the spool directory, files left there by an earlier run are uploaded too.\n");
+	printf("  -f <file>         Queue a file, may be given many times.\n");
+	printf("  -priority <p>     Priority of the following -f files: high, normal or low (default: normal).\n");
+	printf("  -move             Move the -f files into the spool instead of copying them.\n");
+	printf("  -batch <size>     Files up to this size are merged into tar batches (default: 65536).\n");
+	printf("  -batch_size <n>   Set the file bytes in one batch at most (default: 1048576).\n");
+	printf("  -batch_files <n>  Set the files in one batch at most (default: 64).\n");
+	printf("  -delay <ms>       A batch that is not full waits this long for more files (default: 5000 ms).\n");
+	printf("  -limit <size>     Bytes the spool may hold, lower priority files are dropped beyond (default: no limit).\n");
+	printf("  -t <timeout_ms>   Set the timeout of a request without progress (default: 30000 ms).\n");
+	printf("  -wait <ms>        Stop after this long even if files are left in the spool (default: until it is empty).\n");
+}
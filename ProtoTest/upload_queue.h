@@ -0,0 +1,76 @@
+#ifndef PROTO_UPLOAD_QUEUE_H
+#define PROTO_UPLOAD_QUEUE_H
+
+#include "util.h"
+#include "mongoose.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Priorities of queued files, higher priority files are sent first
+#define UPLOAD_PRIORITY_HIGH   0  // Crash dumps, sent without waiting for a batch to fill
+#define UPLOAD_PRIORITY_NORMAL 1  // Snapshots
+#define UPLOAD_PRIORITY_LOW    2  // Logs, the first to go when the spool is full
+#define UPLOAD_PRIORITY_COUNT  3
+
+/** Settings of the upload queue, fields left 0 take the default */
+typedef struct upload_queue_opts {
+    const char* url;            // Required. Every request is POSTed here
+    const char* spool_dir;      // Required. Keeps queued files across restarts, created if missing
+    int64_t spool_limit;        // Bytes the spool may hold, lower priority files are dropped beyond (default: no limit)
+    int64_t batch_file_size;    // Files up to this size are merged into tar batches (default: 65536)
+    int64_t batch_size;         // File bytes in one batch at most (default: 1048576)
+    int batch_files;            // Files in one batch at most (default: 64)
+    uint64_t batch_delay_ms;    // A batch that is not full waits this long for more files (default: 5000)
+    uint64_t timeout_ms;        // A request without progress fails after this (default: 30000)
+    uint64_t retry_base_ms;     // First retry delay of a failed file, doubled on every retry (default: 1000)
+} upload_queue_opts_t;
+
+/**
+ * Start the upload queue on `mgr`, shared with whatever else runs on it.
+ *
+ * the files left in the spool by an earlier run are queued again, and a timer on
+ * `mgr` sends them one request at a time over a kept connection. files bigger than
+ * `batch_file_size` go alone, smaller ones are merged into one tar archive per request.
+ * a file leaves the spool only once the server answered 2xx for it.
+ *
+ * the queue is not locked, every function here must be called on the thread that polls `mgr`.
+ * other threads and processes hand files over through the spool directory instead, which the
+ * timer scans every 2 seconds: write the file elsewhere, or under a name starting with '.',
+ * then rename it into the spool. a name like "<priority>-<seq>-<name>" keeps its priority,
+ * any other file is queued with UPLOAD_PRIORITY_NORMAL.
+ *
+ * @return false if the options are invalid or the spool directory is not usable.
+ */
+extern bool upload_queue_init(struct mg_mgr* mgr, const upload_queue_opts_t* opts);
+
+/**
+ * Put a file into the spool, it is uploaded later from the timer of the queue.
+ * only local file work is done here: `path` is copied into the spool, or renamed
+ * into it with `move`, so this never waits for the network.
+ * call it on the thread that polls `mgr`, e.g. from an event handler or a timer.
+ *
+ * @return false if the file cannot be read or does not fit the spool limit.
+ */
+extern bool upload_queue_add(const char* path, int priority, bool move);
+
+/** Number of files waiting in the spool */
+extern size_t upload_queue_pending(void);
+
+/** Stop the timer and drop the connection, files not uploaded yet stay in the spool */
+extern void upload_queue_free(void);
+
+/**
+ * main entry of the upload queue, spools the given files and uploads everything in the spool.
+ *
+ * @param [in] argc - argument count of `argv`
+ * @param [in] argv - argument vector of `argc` like command line, see print_upload_queue_usage
+ * @return 0 once the spool is empty, or non-zero value on error.
+ */
+extern int upload_queue_main(int argc, char* argv[]);
+
+#ifdef __cplusplus
+}
+#endif
+#endif // !PROTO_UPLOAD_QUEUE_H
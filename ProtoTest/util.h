@@ -16,7 +16,7 @@
 #endif
 #endif
 
-#ifdef cplusplus
+#ifdef __cplusplus
 extern "C" {
 #endif
 
@@ -31,7 +31,7 @@ extern "C" {
 	 */
 	extern void format_current_time(char* buffer);
 
-#ifdef cplusplus
+#ifdef __cplusplus
 }
 #endif
 #endif // !PROTO_UTIL_H